@@ -0,0 +1,70 @@
+/*
+ * I2CCoro.c
+ *
+ * Protothread style coroutines on top of I2CBuffer, see I2CCoro.h
+ */
+
+// Other includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Custom includes
+#include "I2CDriver.h"
+#include "I2CCoro.h"
+
+void I2CCoroInit(struct I2CCoro * co, I2CBuffer_pT buf)
+{
+    co->line = 0;
+    co->buf = buf;
+    co->issued = 0;
+    co->status = I2C_STATUS_UNKNOWN;
+    co->transferred = 0;
+}
+
+void I2CCoroArm(struct I2CCoro * co)
+{
+#ifdef I2C_USE_HANDLES
+    I2CBufferSetHandle(co->buf, &co->handle);
+#else
+    (void)co;
+#endif
+}
+
+uint8_t I2CCoroPoll(struct I2CCoro * co, I2CInstruction_ID id)
+{
+    uint8_t status;
+    int transferred = 0;
+
+    if (!co->issued)
+    {
+        // The buffer was full: try again on the next call. An add that can never succeed ends the wait instead
+        if (!id)
+        {
+            if (I2CBufferGetAddStatus(co->buf) != I2C_STATUS_INVALID)
+            {
+                return 0;
+            }
+            co->status = I2C_STATUS_INVALID;
+            co->transferred = 0;
+            return 1;
+        }
+        // I2C_ID_NO_BUS (e.g. an I2CDevice cache hit) reads as done: the layer that answered settled the handle
+        co->issued = 1;
+#ifndef I2C_USE_HANDLES
+        co->id = id;
+#endif
+    }
+
+#ifdef I2C_USE_HANDLES
+    status = I2CHandleResult(&co->handle, &transferred);
+#else
+    status = I2CBufferGetStatus(co->buf, co->id, &transferred);
+#endif
+    if (status == I2C_STATUS_PENDING)
+    {
+        return 0;
+    }
+    co->status = status;
+    co->transferred = transferred;
+    return 1;
+}
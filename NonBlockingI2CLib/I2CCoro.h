@@ -0,0 +1,131 @@
+/*
+ * I2CCoro.h
+ *
+ * Protothread style coroutines, so device code can be written as a sequence of transfers instead of a hand-rolled
+ * state machine around I2CBufferAddInstruction and I2CBufferContains. A coroutine is an ordinary function taking a
+ * struct I2CCoro that is called again and again (e.g. every loop, next to I2CTask); each time it carries on from where
+ * it left off and returns as soon as it has to wait, so nothing ever blocks:
+ *
+ *     static uint8_t readTemp(struct I2CCoro * co)
+ *     {
+ *         static uint8_t reg = 0x00, raw[2];
+ *
+ *         I2C_CORO_BEGIN(co);
+ *         I2C_CORO_WRITE(co, 0x48, cfg, 2);
+ *         I2C_CORO_SLEEP(co, 100);
+ *         I2C_CORO_WRITE_READ(co, 0x48, &reg, 1, raw, 2);
+ *         if (I2C_CORO_STATUS(co) == I2C_STATUS_DONE) ...
+ *         I2C_CORO_END(co);
+ *     }
+ *
+ * The resume point is a switch on a line number, so a coroutine costs sizeof(struct I2CCoro) bytes of RAM, a jump per
+ * call and a call into I2CCoro.c per wait. make -C tests size compares its code with the hand-rolled state machine it
+ * replaces (tests/bench.c). Like any protothread, local variables do not survive a wait (keep them
+ * static or in a struct that embeds the struct I2CCoro) and the macros cannot be used inside a switch of your own.
+ * With I2C_USE_HANDLES each wait is polled through a handle (one byte read), otherwise through I2CBufferGetStatus, in
+ * which case a coroutine must be called before I2C_RESULT_TABLE_SIZE newer results push its own out (it then sees
+ * I2C_STATUS_UNKNOWN)
+ */
+
+
+#ifndef I2C_CORO_H_
+#define I2C_CORO_H_
+
+#include <stdint.h>
+
+#include "I2CDriver.h"
+
+// What a coroutine returns
+#define I2C_CORO_WAITING    0       // Waiting for a transfer (or a delay), call it again
+#define I2C_CORO_DONE       1       // Reached I2C_CORO_END (or I2C_CORO_EXIT); the next call starts it over
+
+/* A coroutine's state. Set up with I2CCoroInit, the fields are used by the macros */
+struct I2CCoro
+{
+    uint16_t line;                  // Line to carry on from (0 to start from the beginning)
+    I2CBuffer_pT buf;               // Buffer the transfers are added to
+#ifdef I2C_USE_HANDLES
+    struct I2CFuture handle;        // Handle of the transfer being waited for
+#else
+    I2CInstruction_ID id;           // ID of the transfer being waited for
+#endif
+    int transferred;                // Bytes the last transfer moved
+    uint16_t wakeAt;                // Tick an I2C_CORO_SLEEP ends at
+    uint8_t issued;                 // The transfer being waited for has been added
+    uint8_t status;                 // I2C_STATUS_ code of the last transfer
+};
+
+/* Starts co from the beginning, adding its transfers to buf */
+void I2CCoroInit(struct I2CCoro * co, I2CBuffer_pT buf);
+
+/* Used by I2C_CORO_AWAIT: gets buf ready for the add that issues co's next transfer */
+void I2CCoroArm(struct I2CCoro * co);
+
+/* Used by I2C_CORO_AWAIT: takes the ID returned by the add (0 if it has not been issued yet, or was refused), then checks
+ * on the transfer. Returns 1 once it has finished, with its status and byte count in co; an add refused for good
+ * (I2CBufferGetAddStatus says I2C_STATUS_INVALID) finishes at once with I2C_STATUS_INVALID, any other is tried again */
+uint8_t I2CCoroPoll(struct I2CCoro * co, I2CInstruction_ID id);
+
+// Marks the fall through into a resume point as meant (for -Wimplicit-fallthrough)
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define I2C_CORO_FALLTHROUGH        __attribute__((fallthrough))
+#else
+#define I2C_CORO_FALLTHROUGH
+#endif
+
+/* Opens the body of a coroutine (first statement of the function) */
+#define I2C_CORO_BEGIN(co)          switch ((co)->line) { case 0:
+
+/* Closes the body of a coroutine (last statement of the function) */
+#define I2C_CORO_END(co)            } (co)->line = 0; return I2C_CORO_DONE
+
+/* Ends the coroutine early */
+#define I2C_CORO_EXIT(co)           do { (co)->line = 0; return I2C_CORO_DONE; } while (0)
+
+/* Returns until cond is true */
+#define I2C_CORO_WAIT_UNTIL(co, cond) \
+    do { (co)->line = __LINE__; I2C_CORO_FALLTHROUGH; case __LINE__: if (!(cond)) return I2C_CORO_WAITING; } while (0)
+
+/* Returns once, letting the rest of the program run */
+#define I2C_CORO_YIELD(co) \
+    do { (co)->line = __LINE__; return I2C_CORO_WAITING; case __LINE__:; } while (0)
+
+/* Waits ticks ticks of I2CTimerTick */
+#define I2C_CORO_SLEEP(co, ticks) \
+    do { \
+        (co)->wakeAt = I2CGetTicks() + (ticks); \
+        I2C_CORO_WAIT_UNTIL(co, (int16_t)(I2CGetTicks() - (co)->wakeAt) >= 0); \
+    } while (0)
+
+/* Runs another coroutine (call is e.g. readTemp(&child), with child started by I2CCoroInit) until it is done */
+#define I2C_CORO_SPAWN(co, call)    I2C_CORO_WAIT_UNTIL(co, (call) == I2C_CORO_DONE)
+
+/* Issues a transfer with add (an I2CBufferAdd... call on co->buf, evaluated once it succeeds) and waits for it to
+ * finish. A full buffer is not an error: the add is tried again on the next call. One that can never be added (bad
+ * arguments) is not retried; the wait ends with I2C_CORO_STATUS I2C_STATUS_INVALID */
+#define I2C_CORO_AWAIT(co, add) \
+    do { \
+        (co)->line = __LINE__; \
+        (co)->issued = 0; \
+        I2C_CORO_FALLTHROUGH; \
+        case __LINE__: \
+        if (!I2CCoroPoll((co), (co)->issued ? 0 : (I2CCoroArm(co), (add)))) return I2C_CORO_WAITING; \
+    } while (0)
+
+/* Writes (a copy of) len bytes of data to address and waits for it */
+#define I2C_CORO_WRITE(co, address, data, len) \
+    I2C_CORO_AWAIT(co, I2CBufferAddInstruction((co)->buf, (address), I2C_WRITE, (data), (len)))
+
+/* Reads len bytes from address into data and waits for it */
+#define I2C_CORO_READ(co, address, data, len) \
+    I2C_CORO_AWAIT(co, I2CBufferAddInstruction((co)->buf, (address), I2C_READ, (data), (len)))
+
+/* Writes wrLen bytes of wrData (e.g. a register pointer), then reads rdLen bytes into rdData after a repeated start */
+#define I2C_CORO_WRITE_READ(co, address, wrData, wrLen, rdData, rdLen) \
+    I2C_CORO_AWAIT(co, I2CBufferAddWriteReadInstruction((co)->buf, (address), (wrData), (wrLen), (rdData), (rdLen)))
+
+/* The I2C_STATUS_ code and byte count of the last transfer awaited */
+#define I2C_CORO_STATUS(co)         ((co)->status)
+#define I2C_CORO_TRANSFERRED(co)    ((co)->transferred)
+
+#endif /* I2C_CORO_H_ */
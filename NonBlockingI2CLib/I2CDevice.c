@@ -0,0 +1,320 @@
+/*
+ * I2CDevice.c
+ *
+ * Register based devices with a shadow cache, see I2CDevice.h
+ */
+
+// Other includes
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CInstruction.h"
+#include "I2CDevice.h"
+
+// Returns bit r of map
+static inline uint8_t mapGet(const uint8_t * map, uint16_t r)
+{
+    return (map[r >> 3] >> (r & 7)) & 1;
+}
+
+static inline void mapSet(uint8_t * map, uint16_t r)
+{
+    map[r >> 3] |= (1 << (r & 7));
+}
+
+static inline void mapClear(uint8_t * map, uint16_t r)
+{
+    map[r >> 3] &= ~(1 << (r & 7));
+}
+
+// Returns 1 if register r can be kept in the shadow
+static uint8_t deviceCacheable(struct I2CDevice * dev, uint16_t r)
+{
+    return dev->shadow && r < dev->regCount && !(dev->volatileMap && mapGet(dev->volatileMap, r));
+}
+
+// Stores the register address of r (1 or 2 bytes, MSB first) at out and returns its length
+static uint8_t deviceRegBytes(struct I2CDevice * dev, uint16_t r, uint8_t * out)
+{
+    if (dev->flags & I2C_DEVICE_REG16)
+    {
+        out[0] = r >> 8;
+        out[1] = r & 0xFF;
+        return 2;
+    }
+    out[0] = r & 0xFF;
+    return 1;
+}
+
+// Caches the registers of a finished load. Returns 1 if no load is left that covers any of len registers from reg
+static uint8_t deviceSettle(struct I2CDevice * dev, uint16_t reg, uint16_t len)
+{
+    uint8_t ind;
+
+    if (!dev->loadID)
+    {
+        return 1;
+    }
+    uint8_t status = I2CBufferGetStatus(dev->buf, dev->loadID, NULL);
+    if (status != I2C_STATUS_PENDING)
+    {
+        // A failed or discarded load (or one pushed out of the result table before we looked) caches nothing
+        if (status == I2C_STATUS_DONE && !dev->loadDiscard)
+        {
+            for (ind = 0; ind < dev->loadLength; ind++)
+            {
+                mapSet(dev->validMap, dev->loadReg + ind);
+            }
+        }
+        dev->loadID = 0;
+        dev->loadDiscard = 0;
+        return 1;
+    }
+    return reg + len <= dev->loadReg || dev->loadReg + dev->loadLength <= reg;
+}
+
+/* Ends a request that adds nothing, see I2CBufferSettleAdd: done (status I2C_STATUS_DONE, transferred bytes answered
+ * from the shadow) or refused (I2C_STATUS_INVALID, or I2C_STATUS_UNKNOWN if it may work later). Returns its ID */
+static I2CInstruction_ID deviceNoAdd(struct I2CDevice * dev, uint8_t status, int transferred)
+{
+    if (dev)
+    {
+        I2CBufferSettleAdd(dev->buf, status, transferred);
+    }
+    return status == I2C_STATUS_DONE ? I2C_ID_NO_BUS : 0;
+}
+
+void I2CDeviceInit(struct I2CDevice * dev, I2CBuffer_pT buf, uint8_t address, uint8_t flags,
+                   uint8_t * shadow, uint8_t * validMap, const uint8_t * volatileMap, uint16_t regCount)
+{
+    dev->buf = buf;
+    dev->address = address;
+    dev->flags = flags;
+    dev->shadow = validMap ? shadow : NULL;
+    dev->validMap = validMap;
+    dev->volatileMap = volatileMap;
+    dev->regCount = regCount;
+    dev->loadID = 0;
+    dev->loadDiscard = 0;
+    if (dev->shadow)
+    {
+        memset(validMap, 0, I2C_DEVICE_MAP_BYTES(regCount));
+    }
+}
+
+void I2CDeviceInvalidate(struct I2CDevice * dev, uint16_t reg, uint16_t len)
+{
+    uint16_t r;
+
+    if (!dev || !dev->shadow)
+    {
+        return;
+    }
+    for (r = reg; r < dev->regCount && r - reg < len; r++)
+    {
+        mapClear(dev->validMap, r);
+    }
+}
+
+uint8_t I2CDeviceIsCached(struct I2CDevice * dev, uint16_t reg, uint8_t len)
+{
+    uint8_t ind;
+
+    if (!dev || !len)
+    {
+        return 0;
+    }
+    deviceSettle(dev, reg, len);
+    for (ind = 0; ind < len; ind++)
+    {
+        if (!deviceCacheable(dev, reg + ind) || !mapGet(dev->validMap, reg + ind))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint8_t I2CDeviceAssume(struct I2CDevice * dev, uint16_t reg, const uint8_t * data, uint8_t len)
+{
+    uint8_t ind;
+
+    if (!dev || !data)
+    {
+        return 0;
+    }
+    // The load would overwrite the values later
+    if (!deviceSettle(dev, reg, len))
+    {
+        return 0;
+    }
+    for (ind = 0; ind < len; ind++)
+    {
+        if (deviceCacheable(dev, reg + ind))
+        {
+            dev->shadow[reg + ind] = data[ind];
+            mapSet(dev->validMap, reg + ind);
+        }
+    }
+    return 1;
+}
+
+I2CInstruction_ID I2CDeviceWrite(struct I2CDevice * dev, uint16_t reg, const uint8_t * data, uint8_t len)
+{
+    uint8_t ind;
+    I2CInstruction_ID id = 0;
+
+    if (!dev || !data || !len || len > I2C_DEVICE_MAX_BURST)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+    }
+
+    if ((dev->flags & I2C_DEVICE_AUTO_INC) || len == 1)
+    {
+        // One burst: register address, then the data
+        uint8_t payload[2 + I2C_DEVICE_MAX_BURST];
+        uint8_t head = deviceRegBytes(dev, reg, payload);
+        memcpy(payload + head, data, len);
+        // Only an auto-incrementing device with 8-bit registers takes a burst that another write was merged into
+        uint8_t mergeable = (dev->flags & (I2C_DEVICE_AUTO_INC | I2C_DEVICE_REG16)) == I2C_DEVICE_AUTO_INC;
+        id = I2CBufferAddRegisterWrite(dev->buf, dev->address, payload, head + len, mergeable);
+    }
+    else
+    {
+        // One write per register, added (or not) as a whole
+        uint8_t payload[I2C_DEVICE_MAX_BURST][3];
+        struct I2CBatchEntry entries[I2C_DEVICE_MAX_BURST];
+        for (ind = 0; ind < len; ind++)
+        {
+            uint8_t head = deviceRegBytes(dev, reg + ind, payload[ind]);
+            payload[ind][head] = data[ind];
+            entries[ind] = (struct I2CBatchEntry){payload[ind], NULL, head + 1, 0, dev->address, I2C_WRITE, 0};
+        }
+        I2CBufferAddBatch(dev->buf, entries, len, &id);
+    }
+    if (!id)
+    {
+        return 0;
+    }
+
+    // Write through. A load still to come back would put the old values over these, so then it is discarded and the
+    // registers are left for the bus. It is still tracked until it is back, as the ISR is still filling the shadow
+    uint8_t cache = deviceSettle(dev, reg, len);
+    if (!cache)
+    {
+        dev->loadDiscard = 1;
+    }
+    for (ind = 0; ind < len; ind++)
+    {
+        if (deviceCacheable(dev, reg + ind))
+        {
+            dev->shadow[reg + ind] = data[ind];
+            if (cache)
+            {
+                mapSet(dev->validMap, reg + ind);
+            }
+            else
+            {
+                mapClear(dev->validMap, reg + ind);
+            }
+        }
+    }
+    return id;
+}
+
+I2CInstruction_ID I2CDeviceRead(struct I2CDevice * dev, uint16_t reg, uint8_t * out, uint8_t len)
+{
+    uint8_t ind;
+    I2CInstruction_ID id = 0;
+
+    if (!dev || !out || !len)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+    }
+
+    // No bus time at all if everything is cached
+    if (I2CDeviceIsCached(dev, reg, len))
+    {
+        memcpy(out, dev->shadow + reg, len);
+        return deviceNoAdd(dev, I2C_STATUS_DONE, len);
+    }
+
+    uint8_t regBytes[2];
+    if ((dev->flags & I2C_DEVICE_AUTO_INC) || len == 1)
+    {
+        uint8_t head = deviceRegBytes(dev, reg, regBytes);
+        return I2CBufferAddWriteReadInstruction(dev->buf, dev->address, regBytes, head, out, len);
+    }
+    if (len > I2C_DEVICE_MAX_BURST)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+    }
+
+    // One write-read per register
+    uint8_t payload[I2C_DEVICE_MAX_BURST][2];
+    struct I2CBatchEntry entries[I2C_DEVICE_MAX_BURST];
+    for (ind = 0; ind < len; ind++)
+    {
+        uint8_t head = deviceRegBytes(dev, reg + ind, payload[ind]);
+        entries[ind] = (struct I2CBatchEntry){payload[ind], out + ind, head, 1, dev->address, I2C_WRITE_READ, 0};
+    }
+    I2CBufferAddBatch(dev->buf, entries, len, &id);
+    return id;
+}
+
+I2CInstruction_ID I2CDeviceUpdate(struct I2CDevice * dev, uint16_t reg, uint8_t mask, uint8_t value)
+{
+    if (!dev || !I2CDeviceIsCached(dev, reg, 1))
+    {
+        // Unless a load is on its way, nothing will cache it
+        return deviceNoAdd(dev, (dev && dev->loadID) ? I2C_STATUS_UNKNOWN : I2C_STATUS_INVALID, 0);
+    }
+
+    uint8_t newValue = (dev->shadow[reg] & ~mask) | (value & mask);
+    if (newValue == dev->shadow[reg])
+    {
+        return deviceNoAdd(dev, I2C_STATUS_DONE, 0);
+    }
+    return I2CDeviceWrite(dev, reg, &newValue, 1);
+}
+
+I2CInstruction_ID I2CDeviceLoad(struct I2CDevice * dev, uint16_t reg, uint8_t len)
+{
+    uint8_t ind;
+    uint8_t regBytes[2];
+
+    if (!dev || !len)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+    }
+    if (!deviceSettle(dev, reg, len) || dev->loadID)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_UNKNOWN, 0);    // One load at a time
+    }
+    for (ind = 0; ind < len; ind++)
+    {
+        if (!deviceCacheable(dev, reg + ind))
+        {
+            return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+        }
+    }
+    // One burst, so the device must auto-increment (a single register always can be loaded)
+    if (!(dev->flags & I2C_DEVICE_AUTO_INC) && len > 1)
+    {
+        return deviceNoAdd(dev, I2C_STATUS_INVALID, 0);
+    }
+
+    // Not cached until the read is back, as the ISR fills the shadow in byte by byte
+    I2CDeviceInvalidate(dev, reg, len);
+    uint8_t head = deviceRegBytes(dev, reg, regBytes);
+    I2CInstruction_ID id = I2CBufferAddWriteReadInstruction(dev->buf, dev->address, regBytes, head, dev->shadow + reg, len);
+    if (id)
+    {
+        dev->loadID = id;
+        dev->loadReg = reg;
+        dev->loadLength = len;
+    }
+    return id;
+}
@@ -0,0 +1,92 @@
+/*
+ * I2CDevice.h
+ *
+ * Device layer on top of I2CBuffer: describes a register based device (address, register address width, whether
+ * multi-register transfers auto-increment, which registers change by themselves) and keeps a write-through shadow of
+ * the registers that do not. Reading a cached register then costs no bus time, and a read-modify-write is one write
+ * (or nothing at all, if the bits are already set).
+ *
+ * A register is cached once it has been written through the device, seeded with I2CDeviceAssume (e.g. the datasheet's
+ * reset values) or read with I2CDeviceLoad. Writes update the shadow as soon as they are queued, so if one fails (see
+ * the buffer's completion callback) call I2CDeviceInvalidate for its registers. Everything is added to the device's
+ * buffer like any other instruction, and must only be called from the context that adds to that buffer. A request
+ * that returns 0 says why through I2CBufferGetAddStatus, whether or not it got as far as an add. With I2C_USE_HANDLES
+ * a handle armed on the buffer (I2CBufferSetHandle) follows the request's (last) instruction; one answered from the
+ * cache gets I2C_STATUS_DONE straight away
+ */
+
+
+#ifndef I2C_DEVICE_H_
+#define I2C_DEVICE_H_
+
+#include <stdint.h>
+
+#include "I2CInstruction.h"
+
+#ifndef I2C_DEVICE_MAX_BURST
+#define I2C_DEVICE_MAX_BURST    8       // Registers one write (or non auto-incrementing read) can cover
+#endif
+
+// Device flags
+#define I2C_DEVICE_AUTO_INC     0x01    // A multi-register transfer is one burst (the device moves its register pointer on)
+#define I2C_DEVICE_REG16        0x02    // Register addresses are 16 bits, sent MSB first (8 bits otherwise)
+
+// Bytes of a register bitmap (volatileMap, validMap) for regCount registers
+#define I2C_DEVICE_MAP_BYTES(regCount)  (((regCount) + 7) / 8)
+
+/* A device. Set up with I2CDeviceInit; the arrays belong to the caller and are used in place */
+struct I2CDevice
+{
+    I2CBuffer_pT buf;               // Buffer its transfers are added to
+    uint8_t * shadow;               // Cached register values, regCount bytes (NULL for no cache)
+    uint8_t * validMap;             // Bit set: the register's shadow byte holds its value
+    const uint8_t * volatileMap;    // Bit set: the register changes by itself, always read from the bus (NULL: none do)
+    uint16_t regCount;              // Registers 0 to regCount - 1 may be cached, the rest always use the bus
+    uint16_t loadReg;               // First register of the I2CDeviceLoad in progress
+    I2CInstruction_ID loadID;       // The I2CDeviceLoad in progress (0 if none)
+    uint8_t loadLength;
+    uint8_t loadDiscard;            // A write overtook the load: it still fills the shadow, but caches nothing
+    uint8_t address;                // 7-bit address
+    uint8_t flags;                  // I2C_DEVICE_ flags
+};
+
+/* Describes a device at address on buf. flags are I2C_DEVICE_ flags. shadow (regCount bytes) and validMap
+ * (I2C_DEVICE_MAP_BYTES(regCount) bytes) hold the cache, NULL shadow for none; volatileMap (same size, may be const or
+ * in RAM) marks the registers that are never cached (status, data, FIFO...), NULL if there are none. Nothing is cached
+ * to begin with */
+void I2CDeviceInit(struct I2CDevice * dev, I2CBuffer_pT buf, uint8_t address, uint8_t flags,
+                   uint8_t * shadow, uint8_t * validMap, const uint8_t * volatileMap, uint16_t regCount);
+
+/* Writes len (1 to I2C_DEVICE_MAX_BURST) bytes of data (copied) to the registers from reg, as one burst with
+ * I2C_DEVICE_AUTO_INC or as a batch of single-register writes without. The shadow is updated straight away.
+ * Returns the ID of the (last) write, 0 if the operation failed */
+I2CInstruction_ID I2CDeviceWrite(struct I2CDevice * dev, uint16_t reg, const uint8_t * data, uint8_t len);
+
+/* Reads len registers from reg into out. If they are all cached they are copied from the shadow straight away and
+ * I2C_ID_NO_BUS is returned (I2CBufferGetStatus reports it as done). Otherwise a write-read is queued (a batch of them,
+ * at most I2C_DEVICE_MAX_BURST, without I2C_DEVICE_AUTO_INC) and the ID of the (last) one is returned. 0 if the
+ * operation failed. Bus reads go to out only; use I2CDeviceLoad to fill the cache */
+I2CInstruction_ID I2CDeviceRead(struct I2CDevice * dev, uint16_t reg, uint8_t * out, uint8_t len);
+
+/* Read-modify-write of a cached register: sets the bits of mask to those of value with a single write, or none if
+ * they are already that way (then I2C_ID_NO_BUS is returned). Returns 0 if reg is not cached (load or write it first)
+ * or the write could not be added */
+I2CInstruction_ID I2CDeviceUpdate(struct I2CDevice * dev, uint16_t reg, uint8_t mask, uint8_t value);
+
+/* Reads len registers from reg (none of them volatile) into the shadow. They are cached once the read is done, which
+ * the device checks for whenever it is used. One load at a time per device; a write to a register it covers makes it
+ * cache nothing, but it is still in progress (and covers its registers) until it is back. Returns its ID, 0 if the
+ * operation failed */
+I2CInstruction_ID I2CDeviceLoad(struct I2CDevice * dev, uint16_t reg, uint8_t len);
+
+/* Seeds the cache with values known without reading them (e.g. reset values after a reset command). Volatile and
+ * uncached registers are skipped. Returns 0 if a load in progress covers them */
+uint8_t I2CDeviceAssume(struct I2CDevice * dev, uint16_t reg, const uint8_t * data, uint8_t len);
+
+/* Forgets the cached values of len registers from reg, so they are read from the bus again */
+void I2CDeviceInvalidate(struct I2CDevice * dev, uint16_t reg, uint16_t len);
+
+/* Returns 1 if the len registers from reg are all cached */
+uint8_t I2CDeviceIsCached(struct I2CDevice * dev, uint16_t reg, uint8_t len);
+
+#endif /* I2C_DEVICE_H_ */
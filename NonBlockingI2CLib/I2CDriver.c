@@ -6,72 +6,116 @@
  */ 
 
 // Other includes
-#include <avr/interrupt.h>
 #include <stdint.h>
+#include <string.h>
 
 // Custom includes
+#include "I2CPort.h"
 #include "I2CDriver.h"
 #include "I2CInstruction.h"
-#include "Defines.h"
+#include "I2CSlave.h"
+#ifndef I2C_HOST_SIM
+#include "Defines.h"    // F_CPU (pass -DF_CPU=... to a host build)
+#if I2C_TIMEOUT_TICKS > 0
+#include <util/delay.h>
+#endif
+#endif
 
 //Forward declaration
 void I2CHandle(void);
 
+#ifdef I2C_PROFILE
+static struct I2CProfile g_profile;
+static uint16_t g_profileStopTime;      // I2C_PROFILE_TIMER when the bus last went idle
+static uint8_t g_profileIdle = 0;       // High between a STOP and the next START from I2CTask
+#endif
+
 // I2C event interrupt
 ISR(TWI_vect)
 {
+#ifdef I2C_PROFILE
+    uint8_t state = (TWSR & 0b11111000) >> 3;
+    uint16_t start = I2C_PROFILE_TIMER;
     I2CHandle();
+    uint16_t cost = I2C_PROFILE_TIMER - start;
+    g_profile.isrCount[state]++;
+    g_profile.isrCycles[state] += cost;
+    if (cost > g_profile.isrMaxCycles[state])
+    {
+        g_profile.isrMaxCycles[state] = cost;
+    }
+#else
+    I2CHandle();
+#endif
 }
 
 
+#ifdef I2C_SLAVE
+#define TWI_SLAVE_ACK   (1 << TWI_ACK_EN)   // Keep answering to our slave address while sending (TWEA is ignored there)
+#else
+#define TWI_SLAVE_ACK   0
+#endif
+
 // Sends a start condition to the I2C bus
-inline void sendStartCond()
+static inline void sendStartCond()
 {
     TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_START) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
 }
 
 // Sends a stop condition to the I2C bus
-inline void sendStopCond()
+static inline void sendStopCond()
 {
     TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_STOP) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
 }
 
+// Sends a stop condition followed directly by a start condition
+static inline void sendStopStartCond()
+{
+    TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_STOP) | (1 << TWI_START) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+}
+
 // Enables ACK
-inline void enableACK()
+static inline void enableACK()
 {
     TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
 }
 
 // Disables ACK
-inline void disableAck()
+static inline void disableAck()
 {
     TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
 }
 
 // Load data into TWDR
-inline void loadTWDR(uint8_t data)
+static inline void loadTWDR(uint8_t data)
 {
     TWDR = data;
-    TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+    TWCR = (1 << TWI_INT_FLAG) | TWI_SLAVE_ACK | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+}
+
+// Lets go of the bus without a STOP (after losing arbitration it belongs to another master)
+static inline void releaseBus()
+{
+    TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
 }
 
 // Read is high on SDA, Write is low on SDA
 // Loads the slave address + r/w onto the I2C bus
-inline void loadAdress(uint8_t address, uint8_t r_w)
+static inline void loadAdress(uint8_t address, uint8_t r_w)
 {
     loadTWDR((address << 1) | r_w);
 }
 
 // Read is high on SDA
 // Loads the slave address + r onto the I2C bus
-inline void loadAddressRead(uint8_t address)
+static inline void loadAddressRead(uint8_t address)
 {
     loadTWDR((address << 1) | 1);
 }
 
 // Write is low on SDA
 // Loads the slave address + w onto the I2C bus
-inline void loadAddressWrite(uint8_t address)
+static inline void loadAddressWrite(uint8_t address)
 {
     loadTWDR(address << 1);
 }
@@ -79,30 +123,447 @@ inline void loadAddressWrite(uint8_t address)
 // This is high when the I2C bus is active and low when its not
 static uint8_t g_state = 0;
 
+// This is high while a write-read is in its read phase (after the repeated start)
+static uint8_t g_readPhase = 0;
+
+// The current instruction, fetched once when its transaction starts so the per-byte states never go back to the buffer
+static struct I2CTransfer g_xfer;
+static uint8_t * g_xferBase = NULL;     // Start of the phase in progress (write data or read buffer)
+static uint8_t * g_xferPtr = NULL;      // Next byte to send or receive
+static uint8_t * g_xferEnd = NULL;      // One past the last byte of the phase
+
+#ifdef I2C_USE_STREAMS
+// The stream of the phase in progress (NULL for an ordinary phase). g_xfer* then point into its window
+static struct I2CStream * g_stream = NULL;
+static uint8_t g_streamRead = 0;        // The stream is being read (the callback empties the window rather than fills it)
+static uint32_t g_streamLeft = 0;       // Bytes of the stream that have not been given a window yet
+static uint32_t g_streamDone = 0;       // Bytes moved through earlier windows
+#endif
+
+// Bytes of the phase in progress beyond the end of the transfer cache (only a stream has any)
+static inline uint32_t streamLeft()
+{
+#ifdef I2C_USE_STREAMS
+    return g_streamLeft;
+#else
+    return 0;
+#endif
+}
+
+#ifdef I2C_USE_HANDLES
+// Set by I2CCancelInFlight: the instruction on the bus is to end at the next byte boundary
+static volatile uint8_t g_cancel = 0;
+#define cancelRequested()   g_cancel
+#else
+#define cancelRequested()   0
+#endif
+
+#if I2C_TIMEOUT_TICKS > 0
+// Tick of the last sign of life (START sent or TWI interrupt) from the transaction on the bus
+static volatile uint16_t g_lastProgress = 0;
+#endif
+
 // This has to exist because we need to access the buffer from interrupts
 // Global variables it is :(
+// g_curBuf is the buffer the transaction on the bus (or the last one) came from. It only changes between transactions
 static I2CBuffer_pT g_curBuf = NULL;
 
+// Every buffer the driver serves, and the scheduler's position among them
+static I2CBuffer_pT g_bufs[I2C_MAX_SCHED_BUFFERS];
+static uint8_t g_bufWeights[I2C_MAX_SCHED_BUFFERS];
+static uint8_t g_bufCount = 0;
+static uint8_t g_schedIndex = 0;        // Buffer served last
+static uint8_t g_schedCredit = 0;       // Transactions g_bufs[g_schedIndex] may still have this round (I2C_SCHED_WEIGHTED)
+
 /*	Must be called to set the buffer for the I2C driver to take instructions from
  *	Param: struct I2CInstruction * buf is a pointer to the the buffer you want to use */
 void I2CSetCurBuf(I2CBuffer_pT buf)
 {
-    g_curBuf = buf;
+    uint8_t sreg = I2CCriticalEnter();
+    g_bufCount = 0;
+    g_schedIndex = 0;
+    g_schedCredit = 0;
+    if (buf)
+    {
+        g_bufs[0] = buf;
+        g_bufWeights[0] = 1;
+        g_bufCount = 1;
+    }
+    // A running transaction keeps its buffer until it ends
+    if (!g_state)
+    {
+        g_curBuf = buf;
+    }
+    I2CCriticalExit(sreg);
+}
+
+int I2CAddBuffer(I2CBuffer_pT buf, uint8_t weight)
+{
+    int ret = 0;
+    
+    if (!buf)
+    {
+        return 0;
+    }
+    
+    uint8_t sreg = I2CCriticalEnter();
+    if (g_bufCount < I2C_MAX_SCHED_BUFFERS)
+    {
+        g_bufs[g_bufCount] = buf;
+        g_bufWeights[g_bufCount] = weight ? weight : 1;
+        g_bufCount++;
+        ret = 1;
+    }
+    I2CCriticalExit(sreg);
+    return ret;
+}
+
+int I2CRemoveBuffer(I2CBuffer_pT buf)
+{
+    uint8_t ind;
+    int ret = 0;
+    
+    uint8_t sreg = I2CCriticalEnter();
+    for (ind = 0; ind < g_bufCount; ind++)
+    {
+        if (g_bufs[ind] == buf)
+        {
+            break;
+        }
+    }
+    if (ind < g_bufCount && !(g_state && g_curBuf == buf))
+    {
+        g_bufCount--;
+        for (; ind < g_bufCount; ind++)
+        {
+            g_bufs[ind] = g_bufs[ind + 1];
+            g_bufWeights[ind] = g_bufWeights[ind + 1];
+        }
+        g_schedIndex = 0;
+        g_schedCredit = 0;
+        if (g_curBuf == buf)
+        {
+            g_curBuf = g_bufCount ? g_bufs[0] : NULL;
+        }
+        ret = 1;
+    }
+    I2CCriticalExit(sreg);
+    return ret;
+}
+
+// Chooses the buffer the next transaction comes from (with its current instruction picked) and makes it g_curBuf.
+// Returns 1 if there is something to send, 0 if every buffer is empty. Only called between transactions
+static uint8_t scheduleNext()
+{
+    uint8_t tries;
+    
+#if I2C_SCHED_POLICY == I2C_SCHED_PRIORITY
+    for (tries = 0; tries < g_bufCount; tries++)
+    {
+        if (I2CBufferPickNext(g_bufs[tries]))
+        {
+            g_curBuf = g_bufs[tries];
+            return 1;
+        }
+    }
+#else
+    uint8_t ind = g_schedIndex;
+    
+    // The +1 lets the weighted policy come back round to the buffer it started on
+    for (tries = 0; tries <= g_bufCount; tries++)
+    {
+#if I2C_SCHED_POLICY == I2C_SCHED_WEIGHTED
+        // Stay on the same buffer while it has credit left this round
+        if (g_schedCredit && ind < g_bufCount && I2CBufferPickNext(g_bufs[ind]))
+        {
+            g_schedCredit--;
+            g_schedIndex = ind;
+            g_curBuf = g_bufs[ind];
+            return 1;
+        }
+        ind = (ind + 1 < g_bufCount) ? ind + 1 : 0;
+        g_schedCredit = g_bufWeights[ind];
+#else
+        ind = (ind + 1 < g_bufCount) ? ind + 1 : 0;
+        if (ind < g_bufCount && I2CBufferPickNext(g_bufs[ind]))
+        {
+            g_schedIndex = ind;
+            g_curBuf = g_bufs[ind];
+            return 1;
+        }
+#endif
+    }
+#endif
+    return 0;
+}
+
+// The clock set by I2CInit/I2CInitClock, and the one the TWI is running at right now
+static I2CClock g_defaultClock = 0;
+static I2CClock g_activeClock = 0;
+
+#if I2C_MAX_DEVICE_CLOCKS > 0
+// Devices that run at their own clock
+static uint8_t g_deviceClockAddr[I2C_MAX_DEVICE_CLOCKS];
+static I2CClock g_deviceClock[I2C_MAX_DEVICE_CLOCKS];
+static uint8_t g_deviceClockCount = 0;
+#endif
+
+// Writes a TWPS/TWBR pair to the TWI
+static inline void applyClock(I2CClock clk)
+{
+    TWBR = clk & 0xFF;
+    TWSR = clk >> 8;    // Only the prescaler bits of TWSR are writable
+    g_activeClock = clk;
+}
+
+// Retunes the TWI for the device the current instruction talks to. Only called while no byte is on the bus
+static inline void selectDeviceClock()
+{
+#if I2C_MAX_DEVICE_CLOCKS > 0
+    uint8_t address = I2CBufferGetCurrentInstructionAddress(g_curBuf);
+    I2CClock clk = g_defaultClock;
+    uint8_t ind;
+    
+    for (ind = 0; ind < g_deviceClockCount; ind++)
+    {
+        if (g_deviceClockAddr[ind] == address)
+        {
+            clk = g_deviceClock[ind];
+            break;
+        }
+    }
+    if (clk != g_activeClock)
+    {
+        applyClock(clk);
+    }
+#endif
+}
+
+// Points the transfer cache at the bytes of one phase
+static inline void setPhase(uint8_t * data, int length)
+{
+    g_xferBase = data;
+    g_xferPtr = data;
+    g_xferEnd = data + length;
+}
+
+#ifdef I2C_USE_STREAMS
+// Finishes the stream's current window (a read's is handed to the callback) and points the transfer cache at the next
+// one (a write's is filled by the callback first). At the end of the stream the next window is empty
+static void streamNextWindow()
+{
+    uint16_t count = g_stream->windowSize;
+    
+    if (g_streamRead && g_xferPtr != g_xferBase)
+    {
+        g_stream->callback(g_stream->context, g_xferBase, g_xferPtr - g_xferBase);
+    }
+    g_streamDone += g_xferPtr - g_xferBase;
+    
+    if (g_streamLeft < count)
+    {
+        count = g_streamLeft;
+    }
+    g_streamLeft -= count;
+    if (!g_streamRead && count)
+    {
+        uint16_t produced = g_stream->callback(g_stream->context, g_stream->window, count);
+        if (produced < count)
+        {
+            // Underrun: the write ends after what the producer had
+            count = produced;
+            g_streamLeft = 0;
+        }
+    }
+    setPhase(g_stream->window, count);
+}
+
+// Makes stream the phase in progress
+static void streamStart(struct I2CStream * stream, uint8_t read)
+{
+    g_stream = stream;
+    g_streamRead = read;
+    g_streamLeft = stream->length;
+    g_streamDone = 0;
+    setPhase(stream->window, 0);
+    streamNextWindow();
+}
+#endif
+
+#ifdef I2C_MULTI_MASTER
+static uint8_t g_arbRestarts = 0;       // Times in a row the instruction in progress has lost arbitration
+
+// Gets the instruction that has just lost arbitration ready to go again from its first byte. Returns 0 if it has
+// already been restarted I2C_ARB_RESTARTS times (or is a stream, whose windows cannot be replayed)
+static uint8_t arbRestart()
+{
+    // A cancelled instruction is not worth another go
+    if (cancelRequested())
+    {
+        return 0;
+    }
+#ifdef I2C_USE_STREAMS
+    if (g_xfer.stream)
+    {
+        return 0;
+    }
+#endif
+    if (g_arbRestarts >= I2C_ARB_RESTARTS)
+    {
+        return 0;
+    }
+    g_arbRestarts++;
+    g_readPhase = 0;
+    setPhase(NULL, 0);
+    return 1;
+}
+
+// Returns 1 if both lines are high right now
+static inline uint8_t busFree()
+{
+    return I2C_SCL_READ() && I2C_SDA_READ();
+}
+
+static uint8_t g_busFreeSeen = 0;       // I2CTask calls in a row that have found the bus free since our last START
+
+// Returns 1 once the bus has read free on I2C_BUS_FREE_SAMPLES calls in a row, so no other master is likely to be in
+// the middle of a transfer. The TWI holds back a START until it has seen the STOP of a transfer that began while it
+// was enabled; for the rest one reading proves little (it may land on a high SCL with a 1 bit on SDA), and a START
+// that still collides with another master is caught as a lost arbitration and restarted by arbRestart
+static uint8_t busIdle()
+{
+    if (!busFree())
+    {
+        g_busFreeSeen = 0;
+        return 0;
+    }
+    if (g_busFreeSeen < I2C_BUS_FREE_SAMPLES)
+    {
+        g_busFreeSeen++;
+    }
+    return g_busFreeSeen >= I2C_BUS_FREE_SAMPLES;
+}
+#else
+#define busFree()   1
+#define busIdle()   1
+#endif
+
+// Reports the current instruction's result (status is an I2C_STATUS_ code) and moves g_curBuf on to the next one,
+// without touching the bus
+static void completeInstruction(uint8_t status)
+{
+    int transferred = g_xferPtr - g_xferBase;
+    
+    // A write-read's read phase also moved its write bytes
+    if (g_readPhase)
+    {
+        transferred += g_xfer.length;
+    }
+    g_readPhase = 0;
+#ifdef I2C_USE_STREAMS
+    if (g_stream)
+    {
+        transferred += g_streamDone;
+        g_stream->transferred = g_streamDone + (g_xferPtr - g_xferBase);
+        g_stream = NULL;
+        g_streamLeft = 0;
+    }
+#endif
+    setPhase(NULL, 0);                          // Nothing moved yet if the next transaction is aborted before its START
+#ifdef I2C_MULTI_MASTER
+    g_arbRestarts = 0;
+#endif
+#ifdef I2C_USE_HANDLES
+    // A cancelled instruction that did not finish says cancelled whatever stopped it (so it is not retried either)
+    if (g_cancel && status != I2C_STATUS_DONE)
+    {
+        status = I2C_STATUS_CANCELLED;
+    }
+    g_cancel = 0;                               // A cancel only ever applies to the instruction it was asked for
+#endif
+    I2CBufferCompleteCurrentInstruction(g_curBuf, status, transferred); // Report and move to the next instruction
+}
+
+// Ends the current instruction with status (an I2C_STATUS_ code) and moves g_curBuf on to the next one. With
+// I2C_CHAIN_MODE set, the next instruction (if there is one) is started straight from here, otherwise the bus is
+// stopped and left to I2CTask. An instruction that failed always ends the chain, so the slave sees a STOP
+static void endInstruction(uint8_t status)
+{
+#if I2C_CHAIN_MODE == I2C_CHAIN_NONE
+    sendStopCond();                             // Send a stop condition
+    completeInstruction(status);
+#else
+    completeInstruction(status);
+    if (status == I2C_STATUS_DONE && scheduleNext())
+    {
+        selectDeviceClock();
+#if I2C_CHAIN_MODE == I2C_CHAIN_REP_START
+        sendStartCond();                        // Keep the bus, answered with REP_START_TRA
+#else
+        sendStopStartCond();                    // Release the bus for a moment, answered with START_TRA
+#endif
+        g_state = 1;
+        return;
+    }
+    sendStopCond();                             // Nothing left (or a failure), send a stop condition
+#endif
+    g_state = 0;                                // set g_state to 0 (I2C ready/off)
+#ifdef I2C_PROFILE
+    g_profileStopTime = I2C_PROFILE_TIMER;
+    g_profileIdle = 1;
+#endif
+}
+
+// Ends the current instruction with status after the bus has been lost to another master: lets go of it without a
+// STOP (it is not ours to stop) and leaves the next instruction to I2CTask
+static void abandonInstruction(uint8_t status)
+{
+    completeInstruction(status);
+    releaseBus();
+    g_state = 0;
+#ifdef I2C_PROFILE
+    g_profileStopTime = I2C_PROFILE_TIMER;
+    g_profileIdle = 1;
+#endif
 }
 
 // This handles I2C using info from the I2C-Instructions
 void I2CHandle()
 {	
-    static int dataPtr = 0; // Holds how many bytes have been written/read
-
-    if (!g_curBuf)
+#if I2C_TIMEOUT_TICKS > 0
+    g_lastProgress = I2CGetTicks();             // Slave transactions count too, see I2CTask
+#endif
+#ifdef I2C_SLAVE
+    uint8_t status = TWSR & 0b11111000;
+    
+    // A bus error ends a transaction another master was having with us too (then the master switch below has none
+    // of ours to end)
+    if (status == BUS_ERROR)
     {
-        // LOG ERROR, current buffer is NULL!
+        I2CSlaveReset();
+    }
+    // Another master is talking to us
+    if (status >= SLA_W_REC_ACK_TRA && status <= LAST_DATA_TRA_ACK_REC)
+    {
+        // If it won arbitration from us on the way, the bus is its now: end our instruction without touching TWCR
+        // (with I2C_MULTI_MASTER it stays at the head, and I2CTask starts it again once the other master is done)
+        if (g_state && (status == ARB_LOST_SLA_W_REC_ACK_TRA || status == ARB_LOST_GEN_CALL_ACK_TRA || status == ARB_LOST_SLA_R_REC_ACK_TRA))
+        {
+#ifdef I2C_MULTI_MASTER
+            if (!arbRestart())
+#endif
+            {
+                completeInstruction(I2C_STATUS_ARB_LOST);
+            }
+            g_state = 0;
+        }
+        I2CSlaveHandle(status);
         return;
     }
-    if (!I2CBufferGetCurrentSize(g_curBuf))
+#endif
+    if (!g_curBuf)
     {
-        // LOG ERROR, current buffer is EMPTY!
+        // LOG ERROR, current buffer is NULL!
         return;
     }
 
@@ -112,62 +573,109 @@ void I2CHandle()
         // Start or repeated start
         case START_TRA:
         case REP_START_TRA:
-            loadAdress(I2CBufferGetCurrentInstructionAddress(g_curBuf), I2CBufferGetCurrentInstructionReadWrite(g_curBuf));	// Load the device address and r/w
+            // The repeated start of a write-read's read phase addresses the device for reading
+            if (g_readPhase)
+            {
+                loadAddressRead(g_xfer.address);
+                break;
+            }
+            // Otherwise a new instruction is starting, so fetch it
+            if (!I2CBufferGetCurrentTransfer(g_curBuf, &g_xfer))
+            {
+                // LOG ERROR, current buffer is EMPTY!
+                sendStopCond();
+                g_state = 0;
+                return;
+            }
+            setPhase(g_xfer.data, g_xfer.length);
+#ifdef I2C_USE_STREAMS
+            if (g_xfer.stream && g_xfer.readWrite != I2C_WRITE_READ)
+            {
+                streamStart(g_xfer.stream, g_xfer.readWrite == I2C_READ);
+            }
+#endif
+            // Load the device address and r/w
+            if (g_xfer.readWrite == I2C_READ)
+            {
+                loadAddressRead(g_xfer.address);
+            }
+            else
+            {
+                loadAddressWrite(g_xfer.address);
+            }
             break;
             
         // Slave address + write has been transmitted and ACK received
         case SLA_W_TRA_ACK_REC:
-            loadTWDR(I2CBufferGetCurrentInstructionData(g_curBuf, 0));  // Load the first byte to write into TWDR
-            dataPtr = 1;											    // Update  dataPtr
-            break;
-            
-        // Slave address + write has been transmitted and NACK received
-        case SLA_W_TRA_NACK_REC:
-            // Could put an error message here
-            sendStopCond();						        // Send a stop condition
-            I2CBufferMoveToNextInstruction(g_curBuf);	// Move to the next instruction (could comment out)
-            dataPtr = 0;
-            g_state = 0;						        // set g_state to 0 (I2C ready/off)
-            return;
-        
         // A data byte has been transmitted and an ACK received
         case DATA_TRA_ACK_REC:
+            // Cancelled with bytes still to go (a write-read's read phase counts): stop here
+            if (cancelRequested() && (g_xferPtr != g_xferEnd || streamLeft() || g_xfer.readWrite == I2C_WRITE_READ))
+            {
+                endInstruction(I2C_STATUS_CANCELLED);
+                return;
+            }
+#ifdef I2C_USE_STREAMS
+            // A stream carries on with its next window
+            if (g_xferPtr == g_xferEnd && g_streamLeft)
+            {
+                streamNextWindow();
+            }
+#endif
             // If all of the bytes have been transmitted
-            if(dataPtr == I2CBufferGetCurrentInstructionLength(g_curBuf))
+            if(g_xferPtr == g_xferEnd)
             {
-                sendStopCond();					            // Send a stop condition
-                I2CBufferMoveToNextInstruction(g_curBuf);	// Move to the next instruction (could comment out)
-                g_state = 0;					            // set g_state to 0 (I2C ready/off)
-                dataPtr = 0;					            // Reset the dataPtr var
+                // A write-read keeps the bus and switches to its read phase with a repeated start
+                if (g_xfer.readWrite == I2C_WRITE_READ)
+                {
+                    sendStartCond();    // Repeated start, answered with REP_START_TRA
+                    g_readPhase = 1;
+                    setPhase(g_xfer.rdData, g_xfer.rdLength);
+#ifdef I2C_USE_STREAMS
+                    if (g_xfer.stream)
+                    {
+                        streamStart(g_xfer.stream, 1);
+                    }
+#endif
+                    break;
+                }
+                endInstruction(I2C_STATUS_DONE);    // Stop (or chain) and move to the next instruction
                 return;
             }
-            // Otherwise
+            // Otherwise load the next byte to write into TWDR
+            if (g_xfer.progmem)
+            {
+                loadTWDR(pgm_read_byte(g_xferPtr));
+            }
             else
-            {	
-                loadTWDR(I2CBufferGetCurrentInstructionData(g_curBuf,dataPtr));	// Load the next byte to write into TWDR
-                dataPtr++;								                        // Increment the dataPtr
+            {
+                loadTWDR(*g_xferPtr);
             }
+            g_xferPtr++;
             break;
             
+        // Slave address + write has been transmitted and NACK received
+        case SLA_W_TRA_NACK_REC:
+            endInstruction(I2C_STATUS_ADDR_NACK);   // Stop (or chain) and move to the next instruction
+            return;
+            
         // A data byte has been transmitted and a NACK received
         case DATA_TRA_NACK_REC:
-            sendStopCond();					                    // Send a stop condition
-            if (dataPtr == I2CBufferGetCurrentInstructionLength(g_curBuf))
+            // Devices may NACK the last byte of a write, so that still counts as done
+            if (g_xferPtr == g_xferEnd && !streamLeft() && g_xfer.readWrite == I2C_WRITE)
             {
-                I2CBufferMoveToNextInstruction(g_curBuf);		// Move to the next instruction (could comment out)
+                endInstruction(I2C_STATUS_DONE);
             }
             else
             {
-                I2CBufferMoveToNextInstruction(g_curBuf);
+                endInstruction(I2C_STATUS_DATA_NACK);   // Stop (or chain) and move to the next instruction
             }
-            g_state = 0;					                    // set g_state to 0 (I2C ready/off)
-            dataPtr = 0;
             return;
             
         // Slave address + read transmitted and an ACK received
         case SLA_R_TRA_ACK_REC:
-            // If only 1 byte is going to be read
-            if(dataPtr == I2CBufferGetCurrentInstructionLength(g_curBuf) - 1)
+            // If only 1 byte is going to be read (or the read has been cancelled, which takes one byte to NACK)
+            if((g_xferEnd - g_xferPtr <= 1 && !streamLeft()) || cancelRequested())
             {
                 disableAck();				// Disable the ACK
             }
@@ -180,18 +688,22 @@ void I2CHandle()
         
         // Slave address + read transmitted and a NACK received
         case SLA_R_TRA_NACK_REC:
-            sendStopCond();				                // Send a stop condition
-            I2CBufferMoveToNextInstruction(g_curBuf);   // Push instruction to back and move to the next instruction (could comment out)
-            dataPtr = 0;
-            g_state = 0;					            // set g_state to 0 (I2C ready/off)
+            endInstruction(I2C_STATUS_ADDR_NACK);   // Stop (or chain) and move to the next instruction
             return;
             
         // Data received and ACK transmitted
         case DATA_REC_ACK_TRA:
-            I2CBufferSetCurrentInstructionData(g_curBuf, dataPtr, TWDR);		// Read in the byte
-            dataPtr++;							// Increment dataPtr
-            // If we've read as much as we want
-            if(dataPtr == I2CBufferGetCurrentInstructionLength(g_curBuf) - 1)
+            *g_xferPtr = TWDR;                  // Read in the byte
+            g_xferPtr++;
+#ifdef I2C_USE_STREAMS
+            // A full window of a stream goes to the callback
+            if (g_xferPtr == g_xferEnd && g_streamLeft)
+            {
+                streamNextWindow();
+            }
+#endif
+            // If we've read as much as we want (or the read has been cancelled)
+            if((g_xferEnd - g_xferPtr == 1 && !streamLeft()) || cancelRequested())
             {
                 disableAck();					// Disable the ACK
             }
@@ -203,63 +715,327 @@ void I2CHandle()
         
         // Data received and NACK transmitted
         case DATA_REC_NACK_TRA:
-            I2CBufferSetCurrentInstructionData(g_curBuf, dataPtr, TWDR);	// Read in the byte
-            dataPtr = 0;					// Reset the dataPtr var
-            sendStopCond();					// Send a stop condition
-            I2CBufferMoveToNextInstruction(g_curBuf);		// Move to the next instruction (could comment out)
-            dataPtr = 0;
-            g_state = 0;					// set g_state to 0 (I2C ready/off)
+        {
+            // Only a zero length read has nowhere to put the byte
+            if (g_xferPtr != g_xferEnd)
+            {
+                *g_xferPtr = TWDR;              // Read in the byte
+                g_xferPtr++;
+            }
+            // The NACK may have come early, for a cancel
+            uint8_t status = (cancelRequested() && (g_xferPtr != g_xferEnd || streamLeft())) ? I2C_STATUS_CANCELLED : I2C_STATUS_DONE;
+#ifdef I2C_USE_STREAMS
+            // The last window of a stream goes to the callback
+            if (g_stream)
+            {
+                streamNextWindow();
+            }
+#endif
+            endInstruction(status);             // Stop (or chain) and move to the next instruction
             return;
+        }
             
-        // If one of the other statuses pops up
+        // Arbitration lost, the TWI has already let go of the bus
+        case ARB_LOST:
+#ifdef I2C_MULTI_MASTER
+            // Go again from the first byte, the START goes out once the winner's STOP frees the bus
+            if (arbRestart())
+            {
+                sendStartCond();
+                break;
+            }
+#endif
+            abandonInstruction(I2C_STATUS_ARB_LOST);    // No STOP, the bus is the winner's
+            return;
+            
+        // If one of the other statuses pops up (a bus error, most likely)
         default:
-            sendStopCond();							// Send a stop condition
-            I2CBufferMoveToNextInstruction(g_curBuf);			// Push instruction to back and move to the next instruction (could comment out)
-            dataPtr = 0;
-            g_state = 0;							// set g_state to 0 (I2C ready/off)
+#ifdef I2C_PROFILE
+            g_profile.defaultCases++;
+#endif
+            // With no transaction of ours on the bus there is nothing to end: a STOP request just takes the TWI back
+            // to idle (after a bus error it only releases the lines)
+            if (!g_state)
+            {
+                sendStopCond();
+                return;
+            }
+            endInstruction(I2C_STATUS_BUS_ERROR);   // Stop (or chain) and move to the next instruction
             return;
     }
     // If we haven't returned, then make sure g_state is 1
     g_state = 1;
 }
 
-// Called every loop to determine when to start I2C transaction
+#if I2C_TIMEOUT_TICKS > 0
+// Frees a bus a slave is holding: clocks SCL until the slave lets go of SDA (9 clocks finish any byte it may be in the
+// middle of), then sends a STOP. The TWI must be disabled so the port drives the pins
+static void clearBus()
+{
+    uint8_t pulses;
+    
+    I2C_SDA_RELEASE();
+    for (pulses = 0; pulses < 9 && !I2C_SDA_READ(); pulses++)
+    {
+        I2C_SCL_LOW();
+        _delay_us(5);
+        I2C_SCL_RELEASE();
+        _delay_us(5);
+    }
+    // STOP: SDA goes high while SCL is high
+    I2C_SCL_LOW();
+    _delay_us(5);
+    I2C_SDA_LOW();
+    _delay_us(5);
+    I2C_SCL_RELEASE();
+    _delay_us(5);
+    I2C_SDA_RELEASE();
+    _delay_us(5);
+}
+
+// Frees the bus and restarts the TWI. Called inside the critical section opened with sreg, which is left for the
+// clocking (up to about 200us) so other interrupts are not held off; the TWI is off by then, so its own cannot fire
+static void resetBus(uint8_t sreg)
+{
+    TWCR = 0;                                   // Disable the TWI, the port takes the pins back
+    I2CCriticalExit(sreg);
+    clearBus();
+    // The flag it returns is sreg's own (sreg was just restored), so the caller's I2CCriticalExit(sreg) closes this
+    // section exactly as it would have closed the one it opened
+    (void)I2CCriticalEnter();
+    TWCR = (1 << TWI_INT_FLAG) | TWI_SLAVE_ACK | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+    I2CSlaveReset();                            // Whatever another master was doing with us is gone as well
+    g_lastProgress = I2CGetTicks();
+}
+
+// Aborts a transaction that has stalled, frees the bus and restarts the TWI. Called inside the critical section
+// opened with sreg
+static void recoverBus(uint8_t sreg)
+{
+    resetBus(sreg);
+    endInstruction(I2C_STATUS_TIMEOUT);         // Report and move on
+}
+#endif
+
+#ifdef I2C_USE_HANDLES
+uint8_t I2CCancelInFlight(I2CBuffer_pT buf, I2CInstruction_ID id)
+{
+    uint8_t inFlight = 0;
+    
+    uint8_t sreg = I2CCriticalEnter();
+    // Only the instruction the transaction on the bus is running (from START until it completes) is in flight
+    if (g_state && g_curBuf == buf && I2CBufferGetCurrentInstructionID(buf) == id)
+    {
+        g_cancel = 1;
+        inFlight = 1;
+    }
+    I2CCriticalExit(sreg);
+    return inFlight;
+}
+#endif
+
+// Called every loop to determine when to start I2C transaction (with I2C_CHAIN_MODE set, only needed to kick an idle bus)
 void I2CTask()
 {
-    cli();
-    // If g_state is low and there is an instruction available
-    if(!g_state)
+    uint8_t sreg = I2CCriticalEnter();
+#if I2C_TIMEOUT_TICKS > 0
+    // A transaction that has gone quiet for too long is stuck
+    if (g_state && (uint16_t)(I2CGetTicks() - g_lastProgress) >= I2C_TIMEOUT_TICKS)
+    {
+        recoverBus(sreg);
+        I2CCriticalExit(sreg);
+        return;
+    }
+    // So is a transaction another master started with us and then left without a STOP, which would otherwise hold
+    // the queue off for good
+    if (!g_state && I2CSlaveBusy() && (uint16_t)(I2CGetTicks() - g_lastProgress) >= I2C_TIMEOUT_TICKS)
+    {
+        resetBus(sreg);
+    }
+#ifdef I2C_MULTI_MASTER
+    // The bus being busy for that long with nothing of ours on it means something is holding it
+    if (!g_state && !I2CSlaveBusy())
+    {
+        if (busFree())
+        {
+            g_lastProgress = I2CGetTicks();
+        }
+        else if ((uint16_t)(I2CGetTicks() - g_lastProgress) >= I2C_TIMEOUT_TICKS)
+        {
+            resetBus(sreg);
+        }
+    }
+#endif
+#endif
+    // If g_state is low (and no other master is using the bus or talking to us) and there is an instruction available
+    if(!g_state && !I2CSlaveBusy() && busIdle())
     {
         
-        if (I2CBufferGetCurrentSize(g_curBuf))
+        // Take the next buffer's most urgent instruction (an urgent one may have arrived while the bus was idle)
+        if (scheduleNext())
         {
             // Send a start condition and update g_state
+            selectDeviceClock();
             sendStartCond();
             g_state = 1;
+#ifdef I2C_MULTI_MASTER
+            g_busFreeSeen = 0;                  // The next START needs fresh readings
+#endif
+#if I2C_TIMEOUT_TICKS > 0
+            g_lastProgress = I2CGetTicks();
+#endif
+#ifdef I2C_PROFILE
+            if (g_profileIdle)
+            {
+                g_profile.gaps++;
+                g_profile.gapCycles += (uint16_t)(I2C_PROFILE_TIMER - g_profileStopTime);
+                g_profileIdle = 0;
+            }
+#endif
         }
     }
-    sei();	
+    I2CCriticalExit(sreg);
+}
+
+// Ticks counted by I2CTimerTick
+static volatile uint16_t g_ticks = 0;
+
+void I2CTimerTick()
+{
+    g_ticks++;
+#ifdef I2C_PROFILE
+    g_profile.ticks++;
+#endif
+}
+
+uint16_t I2CGetTicks()
+{
+    uint16_t ticks;
+    
+    // Two byte read, so read again if the timer interrupt changed it in between (no cli, this is also used by the ISR)
+    do
+    {
+        ticks = g_ticks;
+    } while (ticks != g_ticks);
+    return ticks;
 }
 
 /* Called to initialize the I2C to a certain frequency
  * Param: long sclFreq is the intended frequency for the I2C peripheral to run at */
 void I2CInit(long sclFreq)
 {	
-    /*
+    I2CInitClock(I2CClockFor(sclFreq));
+}
+
+/* Initializes the I2C with a TWPS/TWBR pair from I2C_CLOCK or I2CClockFor */
+void I2CInitClock(I2CClock clk)
+{
+    g_defaultClock = clk;
+    applyClock(clk);
+    TWCR = (1 << TWI_INT_FLAG) | TWI_SLAVE_ACK | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+}
+
+/* Returns the TWPS/TWBR pair for sclFreq
+ * Calculation stems from the following equation:
+ *     SCL_CLK = F_CPU / (16 + 2 * TWBR * (4^TWPS))
+ * The smallest TWPS that lets TWBR fit in a byte is used, and TWBR is rounded up so SCL_CLK is never above sclFreq */
+I2CClock I2CClockFor(long sclFreq)
+{
+    uint32_t div;
+    uint8_t twps;
     
-    Calculation stems from the following equation:
-        SCL_CLK = F_CPU / (16 + 2 * TWBR * (4^TWPS))
-    With the assumption that TWPS is 1
+    if (sclFreq <= 0)
+    {
+        return 0x3FF;   // Slowest possible
+    }
     
-    For lower SCL_CLKs, it may be necessary to set TWPS to a number other than 1, and so this function should be
-    changed or ignored.
+    div = (F_CPU + sclFreq - 1) / sclFreq;
+    if (div <= 16)
+    {
+        return 0;       // Fastest possible
+    }
+    div -= 16;
     
-    */
+    for (twps = 0; twps < 4; twps++)
+    {
+        // TWBR = div / (2 * 4^TWPS), rounded up
+        uint32_t twbr = (div + (2UL << (2 * twps)) - 1) >> (1 + 2 * twps);
+        if (twbr <= 255)
+        {
+            return ((I2CClock)twps << 8) | twbr;
+        }
+    }
+    return 0x3FF;
+}
+
+/* Returns the SCL_CLK the TWI is running at right now */
+long I2CGetSclFreq()
+{
+    return I2C_CLOCK_FREQ(((I2CClock)(TWSR & 0x03) << 8) | TWBR);
+}
+
+#if I2C_MAX_DEVICE_CLOCKS > 0
+
+int I2CSetDeviceClock(uint8_t address, I2CClock clk)
+{
+    uint8_t ind;
+    int ret = 0;
     
-    long temp1 = (F_CPU / sclFreq);
-    long temp2 = temp1 - 16;
-    long temp3 = temp2 / 8;
+    uint8_t sreg = I2CCriticalEnter();
+    for (ind = 0; ind < g_deviceClockCount; ind++)
+    {
+        if (g_deviceClockAddr[ind] == address)
+        {
+            break;
+        }
+    }
+    if (ind < I2C_MAX_DEVICE_CLOCKS)
+    {
+        g_deviceClockAddr[ind] = address;
+        g_deviceClock[ind] = clk;
+        if (ind == g_deviceClockCount)
+        {
+            g_deviceClockCount++;
+        }
+        ret = 1;
+    }
+    I2CCriticalExit(sreg);
+    return ret;
+}
+
+#endif
+
+#ifdef I2C_PROFILE
+
+void I2CProfileGetSnapshot(struct I2CProfile * out)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    *out = g_profile;
+    I2CCriticalExit(sreg);
     
-    TWBR = (int)temp3;
-    TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
-}
\ No newline at end of file
+    // Every data byte and NACK has its own status, so these come straight from the per-status counts
+    out->bytes = out->isrCount[DATA_TRA_ACK_REC >> 3] + out->isrCount[DATA_TRA_NACK_REC >> 3]
+               + out->isrCount[DATA_REC_ACK_TRA >> 3] + out->isrCount[DATA_REC_NACK_TRA >> 3];
+    out->nacks = out->isrCount[SLA_W_TRA_NACK_REC >> 3] + out->isrCount[DATA_TRA_NACK_REC >> 3]
+               + out->isrCount[SLA_R_TRA_NACK_REC >> 3];
+    out->arbLosses = out->isrCount[ARB_LOST >> 3];
+    out->bytesPerSecond = out->ticks ? (uint32_t)((uint64_t)out->bytes * I2C_PROFILE_TICK_HZ / out->ticks) : 0;
+}
+
+void I2CProfileReset()
+{
+    uint8_t sreg = I2CCriticalEnter();
+    memset(&g_profile, 0, sizeof(g_profile));
+    g_profileIdle = 0;
+    I2CCriticalExit(sreg);
+}
+
+void I2CProfileQueueDepth(size_t depth)
+{
+    if (depth > g_profile.queueHighWater)
+    {
+        g_profile.queueHighWater = depth;
+    }
+}
+
+#endif /* I2C_PROFILE */
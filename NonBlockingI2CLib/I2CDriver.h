@@ -9,7 +9,7 @@
 #ifndef I2C_DRIVER_H_
 #define I2C_DRIVER_H_
 
-#include <avr/io.h>
+#include "I2CPort.h"
 
 #include "I2CInstruction.h"
 
@@ -26,6 +26,7 @@
 
 // I2C States
 
+#define BUS_ERROR                   0x00    // Illegal START or STOP on the bus (whatever was going on is lost)
 #define START_TRA                   0x08    // Start transmitted
 #define REP_START_TRA               0x10    // Repeated start transmitted
 #define SLA_W_TRA_ACK_REC           0x18    // Slave address + write transmitted and an ACK received
@@ -53,21 +54,185 @@
 #define LAST_DATA_TRA_ACK_REC       0xC8    // As slave, last data transmitted, ACK received
 
 
+// Instruction chaining (set I2C_CHAIN_MODE globally to one of these)
+
+#define I2C_CHAIN_NONE              0       // STOP after every instruction, I2CTask starts the next one (default)
+#define I2C_CHAIN_REP_START         1       // The ISR starts the next queued instruction with a repeated start (keeps the bus)
+#define I2C_CHAIN_STOP_START        2       // The ISR sends STOP followed directly by START (lets other masters in between)
+
+#ifndef I2C_CHAIN_MODE
+#define I2C_CHAIN_MODE              I2C_CHAIN_NONE
+#endif
+
+
+/* SCL clock settings
+ * SCL_CLK = F_CPU / (16 + 2 * TWBR * (4^TWPS))
+ * An I2CClock packs a TWPS/TWBR pair as (TWPS << 8) | TWBR. The smallest prescaler that fits is used (finest steps),
+ * and TWBR is rounded up, so the achieved SCL_CLK is never above the one asked for. I2C_CLOCK only uses constant
+ * arithmetic, so I2C_CLOCK(400000) costs nothing at run time */
+typedef uint16_t I2CClock;
+
+#define I2C_CLOCK_DIV(f)            (((F_CPU) + (f) - 1) / (f))     // CPU cycles per SCL period, rounded up
+#define I2C_CLOCK_TWBR(f, twps)     ((I2C_CLOCK_DIV(f) <= 16) ? 0 : \
+                                     (I2C_CLOCK_DIV(f) - 16 + (2UL << (2 * (twps))) - 1) / (2UL << (2 * (twps))))
+#define I2C_CLOCK(f)                ((I2CClock)( \
+                                     (I2C_CLOCK_TWBR(f, 0) <= 255) ? I2C_CLOCK_TWBR(f, 0) : \
+                                     (I2C_CLOCK_TWBR(f, 1) <= 255) ? (0x100 | I2C_CLOCK_TWBR(f, 1)) : \
+                                     (I2C_CLOCK_TWBR(f, 2) <= 255) ? (0x200 | I2C_CLOCK_TWBR(f, 2)) : \
+                                     (I2C_CLOCK_TWBR(f, 3) <= 255) ? (0x300 | I2C_CLOCK_TWBR(f, 3)) : 0x3FF))
+#define I2C_CLOCK_FREQ(clk)         ((F_CPU) / (16 + 2UL * ((clk) & 0xFF) * (1UL << (2 * ((clk) >> 8)))))  // Achieved SCL_CLK
+
+// Initialises the I2C with a clock worked out at compile time, e.g. I2C_INIT(400000)
+#define I2C_INIT(f)                 I2CInitClock(I2C_CLOCK(f))
+
+/* Buffer scheduling: the driver serves every buffer registered with I2CAddBuffer. Each time a transaction starts,
+ * I2C_SCHED_POLICY (set globally to one of these) decides which buffer it comes from */
+#define I2C_SCHED_ROUND_ROBIN       0       // One transaction from each non-empty buffer in turn (default)
+#define I2C_SCHED_WEIGHTED          1       // Up to weight transactions from a buffer before moving on to the next
+#define I2C_SCHED_PRIORITY          2       // Always the first registered buffer that has an instruction
+
+#ifndef I2C_SCHED_POLICY
+#define I2C_SCHED_POLICY            I2C_SCHED_ROUND_ROBIN
+#endif
+
+#ifndef I2C_MAX_SCHED_BUFFERS
+#define I2C_MAX_SCHED_BUFFERS       4       // Buffers the driver can serve at once
+#endif
+
+/* Set I2C_MAX_DEVICE_CLOCKS (globally) to let up to that many devices run at their own SCL_CLK (see I2CSetDeviceClock).
+ * 0 (the default) runs every transaction at the I2CInit clock */
+#ifndef I2C_MAX_DEVICE_CLOCKS
+#define I2C_MAX_DEVICE_CLOCKS       0
+#endif
+
+/* Set I2C_TIMEOUT_TICKS (globally) to abort a transaction that makes no progress (no TWI interrupt) for that many ticks
+ * of I2CTimerTick, e.g. a slave holding SDA low or stretching SCL forever. I2CTask then ends the instruction with
+ * I2C_STATUS_TIMEOUT, clocks SCL by hand (up to 9 pulses, until SDA is released) and sends a STOP to free the bus,
+ * re-enables the TWI and carries on with the queue. Pick the timeout with the slowest legitimate clock stretch in
+ * mind. 0 (the default) leaves it out */
+#ifndef I2C_TIMEOUT_TICKS
+#define I2C_TIMEOUT_TICKS           0
+#endif
+
+/* Define I2C_MULTI_MASTER (globally) when other masters share the bus. An instruction that loses arbitration is then
+ * restarted from its first byte (the TWI sends the START as soon as the winner's STOP frees the bus) up to
+ * I2C_ARB_RESTARTS times in a row before it ends with I2C_STATUS_ARB_LOST, and I2CTask only starts a transaction once
+ * SCL and SDA have read high on I2C_BUS_FREE_SAMPLES calls in a row. Without it, an instruction that loses
+ * arbitration ends with I2C_STATUS_ARB_LOST straight away. Either way the bus is let go of without a STOP, as it
+ * belongs to the winner. With I2C_TIMEOUT_TICKS as well, pick a timeout longer than the other masters' longest
+ * transfer, as waiting for the bus counts towards it */
+#if defined(I2C_MULTI_MASTER) && !defined(I2C_ARB_RESTARTS)
+#define I2C_ARB_RESTARTS            8
+#endif
+
+/* With I2C_MULTI_MASTER, I2CTask calls in a row that must find SCL and SDA both high before it sends a START. A single
+ * reading can fall inside another master's transfer, so more readings make a collision less likely; one that still
+ * happens is a lost arbitration and is restarted */
+#if defined(I2C_MULTI_MASTER) && !defined(I2C_BUS_FREE_SAMPLES)
+#define I2C_BUS_FREE_SAMPLES        2
+#endif
+
+
+/* Define I2C_PROFILE (globally) to count and time every TWI interrupt. Cycle costs come from I2C_PROFILE_TIMER, a free
+ * running 16 bit counter the application sets up (Timer1 with no prescaler by default), so a single measurement must
+ * stay under 65536 timer ticks. In a host build the counter is the simulated bus clock, which only bus time moves, so
+ * isrCycles, isrMaxCycles and gapCycles stay 0 there: the counts are exact, the timings have to come from the target */
+#ifdef I2C_PROFILE
+
+#ifndef I2C_PROFILE_TIMER
+#ifdef I2C_HOST_SIM
+#define I2C_PROFILE_TIMER           ((uint16_t)I2CSimGetStats()->busCycles)
+#else
+#define I2C_PROFILE_TIMER           TCNT1
+#endif
+#endif
+
+#ifndef I2C_PROFILE_TICK_HZ
+#define I2C_PROFILE_TICK_HZ         1000    // I2CTimerTick calls per second, for bytesPerSecond
+#endif
+
+#define I2C_PROFILE_STATES          32      // One slot per value status >> 3 can take, 0xF8 (no information) included
+
+struct I2CProfile
+{
+    uint32_t isrCount[I2C_PROFILE_STATES];      // Interrupts seen for each status, indexed by status >> 3
+    uint32_t isrCycles[I2C_PROFILE_STATES];     // Timer ticks spent in I2CHandle for each status
+    uint16_t isrMaxCycles[I2C_PROFILE_STATES];  // Longest single I2CHandle call for each status
+    uint32_t bytes;                             // Data bytes written or read (filled in by I2CProfileGetSnapshot)
+    uint32_t bytesPerSecond;                    // bytes over the ticks counted (filled in by I2CProfileGetSnapshot, 0 before a tick)
+    uint32_t ticks;                             // I2CTimerTick calls since the counters were reset
+    uint32_t nacks;                             // Address and data NACKs (filled in by I2CProfileGetSnapshot)
+    uint32_t arbLosses;                         // Arbitration losses (filled in by I2CProfileGetSnapshot)
+    uint32_t defaultCases;                      // Statuses I2CHandle has no case for
+    uint32_t gaps;                              // Idle periods between a STOP and the next START from I2CTask
+    uint32_t gapCycles;                         // Timer ticks spent in those idle periods
+    uint16_t queueHighWater;                    // Largest number of instructions any buffer has held
+};
+
+/* Copies the counters into out (with the derived totals filled in) */
+void I2CProfileGetSnapshot(struct I2CProfile * out);
+
+/* Zeroes every counter */
+void I2CProfileReset();
+
+/* Tells the profiler how many instructions a buffer holds (called by the buffer code on every enqueue) */
+void I2CProfileQueueDepth(size_t depth);
+
+#endif /* I2C_PROFILE */
+
+
+#ifdef I2C_USE_HANDLES
+/* Asks the ISR to end the transaction on the bus at the next byte boundary if it is running id from buf (see
+ * I2CHandleCancel, which calls it). Returns 1 if it is, 0 if id is not on the bus */
+uint8_t I2CCancelInFlight(I2CBuffer_pT buf, I2CInstruction_ID id);
+#endif
+
 /* Must be called frequently (every loop in a simple embedded program) to determine when to start I2C transaction */
 void I2CTask();	
 
+/* Advances the driver's tick count, the time base for recurring instructions and the profiler's bytesPerSecond. Call
+ * it at a steady rate, e.g. from a 1 ms timer interrupt; the length of a tick is up to the application */
+void I2CTimerTick();
+
+/* Returns the tick count (wraps around at 65536) */
+uint16_t I2CGetTicks();
+
 /* Called to initialize the I2C to a certain frequency
  * Param: long sclFreq is the intended frequency for the I2C peripheral to run at 
  *
- * NOTE: Calculation stems from the following equation:
- * SCL_CLK = F_CPU / (16 + 2 * TWBR * (4^TWPS))
- * With the assumption that TWPS is 1
- * For lower SCL_CLKs, it may be necessary to set TWPS to a number other than 1, and so this function should be
- * changed or ignored.	*/
+ * NOTE: Works out TWPS/TWBR at run time (see I2CClockFor). When sclFreq is a constant, I2C_INIT(sclFreq) does the
+ * same with no run time arithmetic. Use I2CGetSclFreq to find out the SCL_CLK actually achieved */
 void I2CInit(long sclFreq);
 
-/*	Must be called to set the buffer for the I2C driver to take instructions from
- *	Param: struct I2CInstruction * buf is a pointer to the the buffer you want to use */
+/* Initializes the I2C with a TWPS/TWBR pair from I2C_CLOCK or I2CClockFor. This becomes the default clock */
+void I2CInitClock(I2CClock clk);
+
+/* Returns the TWPS/TWBR pair for sclFreq (same rounding as I2C_CLOCK, but at run time) */
+I2CClock I2CClockFor(long sclFreq);
+
+/* Returns the SCL_CLK the TWI is running at right now */
+long I2CGetSclFreq();
+
+#if I2C_MAX_DEVICE_CLOCKS > 0
+/* Makes every transaction with the device at address run at clk (e.g. I2C_CLOCK(1000000) for an FM+ FRAM), instead
+ * of the default clock. The TWI is retuned between transactions, never during one.
+ * Returns 1 if successful, 0 if I2C_MAX_DEVICE_CLOCKS devices already have their own clock */
+int I2CSetDeviceClock(uint8_t address, I2CClock clk);
+#endif
+
+/*	Must be called to set the buffer for the I2C driver to take instructions from (unless I2CAddBuffer is used)
+ *	Param: struct I2CInstruction * buf is a pointer to the the buffer you want to use
+ *	Replaces every registered buffer with buf. A transaction already on the bus finishes first */
 void I2CSetCurBuf(I2CBuffer_pT buf);
 
+/*	Registers another buffer for the driver to take instructions from, so each subsystem can own its queue
+ *	Param: weight is how many transactions in a row buf gets under I2C_SCHED_WEIGHTED (ignored by the other policies,
+ *	I2C_SCHED_PRIORITY serves buffers in the order they were added)
+ *	Returns 1 if successful, 0 if I2C_MAX_SCHED_BUFFERS buffers are already registered */
+int I2CAddBuffer(I2CBuffer_pT buf, uint8_t weight);
+
+/*	Stops the driver taking instructions from buf. Returns 1 if successful, 0 if buf was not registered or one of its
+ *	instructions is on the bus right now (try again later) */
+int I2CRemoveBuffer(I2CBuffer_pT buf);
+
 #endif /* I2C_DRIVER_H_ */
\ No newline at end of file
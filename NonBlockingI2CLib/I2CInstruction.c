@@ -6,69 +6,549 @@
  */ 
 
 // Other includes
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <stdlib.h>
 #include <string.h>
 
 // Custom includes
+#include "I2CPort.h"
 #include "I2CInstruction.h"
 #include "I2CDriver.h"
+#ifndef I2C_HOST_SIM
 #include "UsartAsFile.h"
+#endif
 
+// Instruction flags
+#define I2C_INSTR_FLAG_REMOVED  0x01    // Removed (from a ring) or cancelled while waiting, skipped when it reaches the head
+#define I2C_INSTR_FLAG_BORROWED 0x02    // Write data belongs to the caller (no copy was made, so it is not freed)
+#define I2C_INSTR_FLAG_PROGMEM  0x04    // Write data is in program memory (implies I2C_INSTR_FLAG_BORROWED)
+#define I2C_INSTR_FLAG_STREAM   0x08    // The streamed phase's pointer (data, or the read phase's of a write-read) is a struct I2CStream
+#define I2C_INSTR_FLAG_WRITE_READ 0x10  // An I2C_WRITE_READ (addrRW then has the R/W bit of its first, write, phase)
+#define I2C_INSTR_FLAG_MERGE    0x20    // A copied write the caller says may be merged with its neighbours (I2C_COALESCE_WRITES)
+
+#ifndef I2C_USE_RING_BUFFER
 static I2CInstruction_ID g_s_instrIDAssigner = 1;
+#endif
+
+// Returns the 7-bit device address of an instruction
+static inline uint8_t I2CInstrAddress(I2CInstruction_pT ipt)
+{
+	return ipt->addrRW >> 1;
+}
+
+// Returns I2C_WRITE, I2C_READ or I2C_WRITE_READ
+static inline uint8_t I2CInstrReadWrite(I2CInstruction_pT ipt)
+{
+	if (ipt->flags & I2C_INSTR_FLAG_WRITE_READ)
+	{
+		return I2C_WRITE_READ;
+	}
+	return ipt->addrRW & 1;
+}
+
+/* The read phase of an I2C_WRITE_READ (its buffer, or its struct I2CStream, and its length) is kept in the write
+ * phase's payload block, right after the write bytes, so no other instruction pays for it in its descriptor. It is
+ * stored byte by byte (I2C_READ_PHASE_SIZE bytes), so it needs no alignment */
+static inline void I2CInstrSetReadPhase(I2CInstruction_pT ipt, uint8_t * rdData, uint16_t rdLength)
+{
+	uint8_t * phase = ipt->data + ipt->length;
+	memcpy(phase, &rdData, sizeof(rdData));
+	memcpy(phase + sizeof(rdData), &rdLength, sizeof(rdLength));
+}
+
+// Returns the read phase's buffer of an I2C_WRITE_READ
+static inline uint8_t * I2CInstrRdData(I2CInstruction_pT ipt)
+{
+	uint8_t * rdData;
+	memcpy(&rdData, ipt->data + ipt->length, sizeof(rdData));
+	return rdData;
+}
+
+// Returns the read phase's length of an I2C_WRITE_READ
+static inline uint16_t I2CInstrRdLength(I2CInstruction_pT ipt)
+{
+	uint16_t rdLength;
+	memcpy(&rdLength, ipt->data + ipt->length + sizeof(uint8_t *), sizeof(rdLength));
+	return rdLength;
+}
 
-typedef struct I2CInstruction
+// One entry of a buffer's result table
+struct I2CResult
 {
-	int dev_addr;
-	int readWrite;
-	uint8_t* data;
-	int length;
-	struct I2CInstruction * nextInstr;
 	I2CInstruction_ID instrID;
+	int transferred;
+	uint8_t status;
+	
+};
+
+#if I2C_MAX_RECURRING > 0
+
+// A resident recurring instruction
+struct I2CRecurringSlot
+{
+	struct I2CInstruction instr;	// Runs in place, never freed
+	uint8_t wrData[I2C_RECURRING_WRITE_SIZE + I2C_READ_PHASE_SIZE];	// A write-read's read phase goes after its write bytes
+	uint8_t * dest;		// Two halves of sampleLength bytes
+	int sampleLength;
+	uint16_t period;	// Ticks from the end of one run to the start of the next
+	uint16_t due;		// Tick the next run may start at
+	uint16_t seq;		// Completed samples
+	uint8_t front;		// Half of dest with the latest complete sample
+	uint8_t active;
+	uint8_t running;	// On the bus right now
+	
+};
+
+// buf->lane while a recurring instruction is the current one
+#define I2C_RECURRING_LANE	I2C_PRIORITY_LEVELS
+
+#define I2C_RECURRING_FIELDS \
+	struct I2CRecurringSlot recurring[I2C_MAX_RECURRING]; \
+	uint8_t recurCur;	/* Slot of the current (or last) recurring run */ \
+	uint8_t recurYield;	/* A recurring run ended, so the queue goes first (until one of its instructions starts) */
+
+#else
+
+#define I2C_RECURRING_FIELDS
+
+#endif /* I2C_MAX_RECURRING */
+
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+
+#define I2C_RETRY_FIELDS \
+	uint8_t retries;	/* Retries given to new instructions */ \
+	struct I2CRetryStats retryStats;
+
+#else
+
+#define I2C_RETRY_FIELDS
+
+#endif /* I2C_RETRY_BACKOFF */
+
+#ifdef I2C_USE_HANDLES
+#define I2C_HANDLE_FIELDS \
+	struct I2CFuture * nextHandle;	/* Armed for the next instruction added (producer) */
+#else
+#define I2C_HANDLE_FIELDS
+#endif
+
+#ifdef I2C_COALESCE_WRITES
+#define I2C_COALESCE_FIELDS \
+	uint8_t coalesce;	/* Merge copied writes as they are added */ \
+	uint16_t coalesced;	/* Writes merged so far */
+#else
+#define I2C_COALESCE_FIELDS
+#endif
+
+#ifdef I2C_USE_RING_BUFFER
+
+#define I2C_RING_MASK   (I2C_RING_SIZE - 1)
+
+/* head and tail are free running counters, so (tail - head) is the number of instructions in the ring.
+ * Only the producer (I2CBufferAddInstruction) moves tail, and only the consumer (the ISR) moves head. The consumer
+ * never frees anything: the producer gives back the data of the slots between reclaim and head */
+struct I2CRing
+{
+	struct I2CInstruction slot[I2C_RING_SIZE];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	uint8_t reclaim;	// Slots before this have been given back (producer)
 	
-}* I2CInstruction_pT;
+};
 
+// One ring per priority lane
 struct I2CBuffer
 {
-	I2CInstruction_pT endPt;
-	I2CInstruction_pT currPt;
-	size_t currentSize;
+	struct I2CRing lanes[I2C_PRIORITY_LEVELS];
+	uint8_t lane;		// Lane of the current instruction (only the consumer changes it)
+	uint8_t addLane;	// Lane new instructions are added to
+	uint8_t addStatus;	// Why the last add was refused: I2C_STATUS_UNKNOWN (no room yet) or I2C_STATUS_INVALID
+	I2CCompletionCallback callback;
+	struct I2CResult results[I2C_RESULT_TABLE_SIZE];
+	uint8_t resultNext;
+	I2C_RECURRING_FIELDS
+	I2C_RETRY_FIELDS
+	I2C_HANDLE_FIELDS
+	I2C_COALESCE_FIELDS
 	
 };
 
-I2CInstruction_pT I2CInstructionNew(int d_add, int rw, uint8_t* dat, int leng)
+#else
+
+/* One linked list per priority lane, shared without disabling interrupts: only the producer (the code adding
+ * instructions) links nodes in and gives them back, only the consumer (the ISR) takes them off, and each side
+ * publishes with a single byte store. A node taken off stays linked in (as lastPt) until the producer reclaims it,
+ * so the ISR never frees anything and never sees a pointer half written */
+struct I2CLane
 {
-	I2CInstruction_pT newInstr = malloc(sizeof(struct I2CInstruction));
-	if (!newInstr)
+	I2CInstruction_pT endPt;	// Last instruction added (producer)
+	I2CInstruction_pT lastPt;	// Last instruction taken off, its nextInstr is the head of the lane (consumer)
+	I2CInstruction_pT freePt;	// Oldest instruction taken off and not given back yet (producer)
+	volatile uint8_t added;	// Instructions ever added, free running (producer)
+	volatile uint8_t taken;	// Instructions ever taken off, free running (consumer)
+	uint8_t reclaimed;	// Instructions given back, free running (producer)
+	struct I2CInstruction stub;	// Stands in for lastPt until the first instruction has been taken off
+	
+};
+
+struct I2CBuffer
+{
+	struct I2CLane lanes[I2C_PRIORITY_LEVELS];
+	uint8_t lane;		// Lane of the current instruction (only the consumer changes it)
+	uint8_t addLane;	// Lane new instructions are added to
+	uint8_t addStatus;	// Why the last add was refused: I2C_STATUS_UNKNOWN (no room yet) or I2C_STATUS_INVALID
+	I2CCompletionCallback callback;
+	struct I2CResult results[I2C_RESULT_TABLE_SIZE];
+	uint8_t resultNext;
+	I2C_RECURRING_FIELDS
+	I2C_RETRY_FIELDS
+	I2C_HANDLE_FIELDS
+	I2C_COALESCE_FIELDS
+	
+};
+
+#endif /* I2C_USE_RING_BUFFER */
+
+#ifdef I2C_USE_STATIC_POOL
+
+#ifndef I2C_USE_RING_BUFFER
+// Instruction slots. Free slots are kept in a singly linked list through nextInstr
+static struct I2CInstruction g_s_instrPool[I2C_POOL_SIZE];
+static I2CInstruction_pT g_s_instrFreeList = NULL;
+#endif
+
+// Payload arena. Free blocks are kept as a stack of block indices
+static uint8_t g_s_payloadArena[I2C_POOL_SIZE][I2C_POOL_PAYLOAD_SIZE];
+static uint8_t g_s_payloadFreeStack[I2C_POOL_SIZE];
+static uint8_t g_s_payloadFreeCount = 0;
+
+// Buffers
+static struct I2CBuffer g_s_bufferPool[I2C_POOL_MAX_BUFFERS];
+static uint8_t g_s_bufferInUse[I2C_POOL_MAX_BUFFERS];
+
+static uint8_t g_s_poolReady = 0;
+
+// Puts every slot and payload block on the free lists (done once, by the first I2CBufferNew)
+static void I2CPoolInit()
+{
+	uint8_t ind;
+	
+#ifndef I2C_USE_RING_BUFFER
+	g_s_instrFreeList = NULL;
+#endif
+	for (ind = 0; ind < I2C_POOL_SIZE; ind++)
+	{
+#ifndef I2C_USE_RING_BUFFER
+		g_s_instrPool[ind].nextInstr = g_s_instrFreeList;
+		g_s_instrFreeList = &g_s_instrPool[ind];
+#endif
+		g_s_payloadFreeStack[ind] = ind;
+	}
+	g_s_payloadFreeCount = I2C_POOL_SIZE;
+	g_s_poolReady = 1;
+}
+
+#endif /* I2C_USE_STATIC_POOL */
+
+#ifdef I2C_SRAM_BUDGET
+/* Worst case footprint: the pools, or for heap builds one buffer holding as many instructions as it accepts (none of
+ * them copying a payload). sizeof cannot be used by the preprocessor, so the check is an array that gets a negative
+ * size (a compile error naming I2CSramBudgetExceeded) when the footprint is over budget */
+#if defined(I2C_USE_STATIC_POOL) && defined(I2C_USE_RING_BUFFER)
+#define I2C_WORST_CASE_BYTES    (sizeof(g_s_payloadArena) + sizeof(g_s_payloadFreeStack) + sizeof(g_s_bufferPool) + sizeof(g_s_bufferInUse))
+#elif defined(I2C_USE_STATIC_POOL)
+#define I2C_WORST_CASE_BYTES    (sizeof(g_s_instrPool) + sizeof(g_s_payloadArena) + sizeof(g_s_payloadFreeStack) + sizeof(g_s_bufferPool) + sizeof(g_s_bufferInUse))
+#elif defined(I2C_USE_RING_BUFFER)
+#define I2C_WORST_CASE_BYTES    (I2C_HEAP_BLOCK_OVERHEAD + sizeof(struct I2CBuffer))
+#else
+#define I2C_WORST_CASE_BYTES    (I2C_HEAP_BLOCK_OVERHEAD + sizeof(struct I2CBuffer) + I2C_QUEUE_BYTES(I2C_MAX_BUFFER_SIZE - 1, 0))
+#endif
+
+typedef char I2CSramBudgetExceeded[(I2C_WORST_CASE_BYTES <= (I2C_SRAM_BUDGET)) ? 1 : -1];
+#endif /* I2C_SRAM_BUDGET */
+
+/* Storage is only ever taken and given back by the producer (the ISR leaves what it is done with for the producer to
+ * reclaim), so the allocators below need no critical sections */
+
+#ifndef I2C_USE_RING_BUFFER
+
+// Gets storage for one instruction (pool slot or heap). Returns NULL if none is available
+static I2CInstruction_pT I2CInstructionAlloc()
+{
+#ifdef I2C_USE_STATIC_POOL
+	I2CInstruction_pT ipt = g_s_instrFreeList;
+	if (ipt)
+	{
+		g_s_instrFreeList = ipt->nextInstr;
+	}
+	return ipt;
+#else
+	return malloc(sizeof(struct I2CInstruction));
+#endif
+}
+
+// Gives back storage from I2CInstructionAlloc
+static void I2CInstructionRelease(I2CInstruction_pT ipt)
+{
+#ifdef I2C_USE_STATIC_POOL
+	ipt->nextInstr = g_s_instrFreeList;
+	g_s_instrFreeList = ipt;
+#else
+	free(ipt);
+#endif
+}
+
+#endif /* !I2C_USE_RING_BUFFER */
+
+// Gets leng bytes to hold a copy of a write's data. Returns NULL if they are not available
+static uint8_t * I2CPayloadAlloc(int leng)
+{
+#ifdef I2C_USE_STATIC_POOL
+	if (leng > I2C_POOL_PAYLOAD_SIZE || !g_s_payloadFreeCount)
 	{
 		return NULL;
 	}
+	g_s_payloadFreeCount--;
+	return g_s_payloadArena[g_s_payloadFreeStack[g_s_payloadFreeCount]];
+#else
+	return malloc(leng);
+#endif
+}
+
+// Gives back storage from I2CPayloadAlloc
+static void I2CPayloadRelease(uint8_t * block)
+{
+#ifdef I2C_USE_STATIC_POOL
+	g_s_payloadFreeStack[g_s_payloadFreeCount] = (uint8_t)((block - &g_s_payloadArena[0][0]) / I2C_POOL_PAYLOAD_SIZE);
+	g_s_payloadFreeCount++;
+#else
+	free(block);
+#endif
+}
+
+// Returns 1 if the packed descriptor can hold an instruction with these fields, 0 otherwise
+static int I2CInstructionValid(int d_add, int rw, int leng, int rdLeng)
+{
+	if (rw != I2C_WRITE && rw != I2C_READ && rw != I2C_WRITE_READ)
+	{
+		return 0;
+	}
+	return d_add >= 0 && d_add <= 0x7F && (unsigned)leng <= 0xFFFF && (unsigned)rdLeng <= 0xFFFF;
+}
+
+/* Fills in an instruction's fields (everything except nextInstr and instrID). A borrowed I2C_WRITE_READ must leave
+ * I2C_READ_PHASE_SIZE bytes free after its leng write bytes for the read phase. Returns 1 if successful, 0 otherwise */
+static int I2CInstructionInit(I2CInstruction_pT newInstr, int d_add, int rw, uint8_t* dat, int leng, uint8_t* rdDat, int rdLeng, uint8_t flags)
+{
+	if (!I2CInstructionValid(d_add, rw, leng, rdLeng))
+	{
+		return 0;
+	}
 	
-	// If it is a write, make a defensive copy (instruction owns the data)
-	if (rw == I2C_WRITE)
+	// If it is a write, make a defensive copy (instruction owns the data) unless the caller lends it to us
+	if (rw != I2C_READ && !(flags & I2C_INSTR_FLAG_BORROWED))
 	{
-		newInstr->data = malloc(leng);
+		newInstr->data = I2CPayloadAlloc(leng + (rw == I2C_WRITE_READ ? I2C_READ_PHASE_SIZE : 0));
 		if (!newInstr->data)
 		{
-			free(newInstr);
-			return NULL;
+			return 0;
 		}
 		memcpy(newInstr->data, dat, leng);
 	}
-	// If it is a read, then keep the passed pointer to add data to (program owns the data)
+	// If it is a read (or a borrowed write), then keep the passed pointer (program owns the data)
 	else
 	{
 		newInstr->data = dat;
 	}
 	
-	newInstr->dev_addr = d_add;
-	newInstr->readWrite = rw;
+	newInstr->addrRW = (uint8_t)((d_add << 1) | (rw == I2C_READ));
 	newInstr->length = leng;
+	if (rw == I2C_WRITE_READ)
+	{
+		flags |= I2C_INSTR_FLAG_WRITE_READ;
+		I2CInstrSetReadPhase(newInstr, rdDat, rdLeng);	// The read phase's buffer is always the program's
+	}
+	newInstr->flags = flags;
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+	newInstr->retries = 0;
+	newInstr->attempt = 0;
+#endif
+#ifdef I2C_USE_HANDLES
+	newInstr->handle = NULL;
+#endif
+	
+	return 1;
+}
+
+#ifdef I2C_USE_HANDLES
+
+// Takes the handle armed for buf's next instruction (NULL if none). It says I2C_STATUS_UNKNOWN until the add succeeds
+static struct I2CFuture * I2CHandleTake(I2CBuffer_pT buf)
+{
+	struct I2CFuture * hpt = buf->nextHandle;
+	
+	buf->nextHandle = NULL;
+	if (hpt)
+	{
+		hpt->status = I2C_STATUS_UNKNOWN;
+	}
+	return hpt;
+}
+
+// Makes hpt follow ipt (which has its ID) and marks it pending. Called before ipt is published to the ISR
+static void I2CHandleBind(struct I2CFuture * hpt, I2CBuffer_pT buf, I2CInstruction_pT ipt)
+{
+	ipt->handle = hpt;
+	if (hpt)
+	{
+		hpt->instr = ipt;
+		hpt->buf = buf;
+		hpt->id = ipt->instrID;
+		hpt->transferred = 0;
+		hpt->status = I2C_STATUS_PENDING;
+	}
+}
+
+// Gives ipt's handle (if any) its result and lets go of it, as the caller may reuse it from then on
+static void I2CHandleFinish(I2CInstruction_pT ipt, uint8_t status, int transferred)
+{
+	struct I2CFuture * hpt = ipt->handle;
+	
+	if (hpt)
+	{
+		ipt->handle = NULL;
+		hpt->transferred = transferred;
+		hpt->status = status;	// Last, once transferred is in place
+	}
+}
+
+#else
+
+#define I2CHandleTake(buf)              NULL
+#define I2CHandleBind(hpt, buf, ipt)    ((void)(hpt))
+
+#endif /* I2C_USE_HANDLES */
+
+// Gives a new instruction buf's retry count
+static inline void I2CRetryArm(I2CBuffer_pT buf, I2CInstruction_pT ipt)
+{
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+	ipt->retries = buf->retries;
+#else
+	(void)buf;
+	(void)ipt;
+#endif
+}
+
+// Returns 1 if ipt failed and its backoff delay has not run out yet
+static inline uint8_t I2CRetryWaiting(I2CInstruction_pT ipt)
+{
+#if I2C_RETRY_BACKOFF == I2C_RETRY_FIXED || I2C_RETRY_BACKOFF == I2C_RETRY_EXPONENTIAL
+	return ipt->attempt && (int16_t)(I2CGetTicks() - ipt->retryAt) < 0;
+#else
+	(void)ipt;
+	return 0;
+#endif
+}
+
+/* Fills in an instruction from a batch entry, copying its write data unless the entry lends it.
+ * Returns 1 if successful, 0 otherwise */
+static int I2CInstructionInitEntry(I2CInstruction_pT newInstr, const struct I2CBatchEntry * entry)
+{
+	uint8_t * dat = (uint8_t*)entry->data;
+	uint8_t flags = 0;
+	int extra = 0;
+	int ind;
+	
+	if (entry->readWrite == I2C_WRITE_READ)
+	{
+		// Its read phase goes after the write bytes, so a write-read's write phase is always copied
+		extra = I2C_READ_PHASE_SIZE;
+	}
+	else if (entry->flags & I2C_BATCH_PROGMEM)
+	{
+		flags = I2C_INSTR_FLAG_BORROWED | I2C_INSTR_FLAG_PROGMEM;
+	}
+	else if (entry->flags & I2C_BATCH_NO_COPY)
+	{
+		flags = I2C_INSTR_FLAG_BORROWED;
+	}
+	
+	if (entry->readWrite != I2C_READ && !flags)
+	{
+		dat = I2CPayloadAlloc(entry->length + extra);
+		if (!dat)
+		{
+			return 0;
+		}
+		if (entry->flags & I2C_BATCH_PROGMEM)
+		{
+			for (ind = 0; ind < entry->length; ind++)
+			{
+				dat[ind] = pgm_read_byte(entry->data + ind);
+			}
+		}
+		else
+		{
+			memcpy(dat, entry->data, entry->length);
+		}
+	}
+	
+	// The copy is already made, so Init must not make another
+	if (!I2CInstructionInit(newInstr, entry->address, entry->readWrite, dat, entry->length, entry->rdData, entry->rdLength, flags | I2C_INSTR_FLAG_BORROWED))
+	{
+		if (dat != entry->data)
+		{
+			I2CPayloadRelease(dat);
+		}
+		return 0;
+	}
+	newInstr->flags = (newInstr->flags & ~I2C_INSTR_FLAG_BORROWED) | flags;	// Keeps the write-read flag Init set
+	return 1;
+}
+
+// Frees the data an instruction owns (but not the instruction itself)
+static void I2CInstructionFreeData(I2CInstruction_pT ipt)
+{
+	// If this is a write then the instruction owns the data pointer (unless it was borrowed)
+	if (I2CInstrReadWrite(ipt) != I2C_READ && !(ipt->flags & I2C_INSTR_FLAG_BORROWED))
+	{
+		if (ipt->data)
+		{
+			I2CPayloadRelease(ipt->data);
+		}
+	}
+}
+
+// Returns byte offset of ipt's data, fetching it from program memory if that is where it lives
+static uint8_t I2CInstructionReadData(I2CInstruction_pT ipt, int offset)
+{
+	if (ipt->flags & I2C_INSTR_FLAG_PROGMEM)
+	{
+		return pgm_read_byte(ipt->data + offset);
+	}
+	return *(ipt->data + offset);
+}
+
+#ifndef I2C_USE_RING_BUFFER
+
+I2CInstruction_pT I2CInstructionNew(int d_add, int rw, uint8_t* dat, int leng, uint8_t* rdDat, int rdLeng, uint8_t flags)
+{
+	I2CInstruction_pT newInstr = I2CInstructionAlloc();
+	if (!newInstr)
+	{
+		return NULL;
+	}
+	
+	if (!I2CInstructionInit(newInstr, d_add, rw, dat, leng, rdDat, rdLeng, flags))
+	{
+		I2CInstructionRelease(newInstr);
+		return NULL;
+	}
 	
 	newInstr->instrID = g_s_instrIDAssigner;
 	g_s_instrIDAssigner++;
-	if (!g_s_instrIDAssigner)
+	// 0 and the I2C_RECURRING_ID range are never handed out
+	if (!g_s_instrIDAssigner || g_s_instrIDAssigner >= I2C_RECURRING_ID(0))
 	{
 		g_s_instrIDAssigner = 1;
 	}
@@ -78,383 +558,1739 @@ I2CInstruction_pT I2CInstructionNew(int d_add, int rw, uint8_t* dat, int leng)
 
 void I2CInstructionFree(I2CInstruction_pT ipt)
 {
-	cli();
 	if (!ipt)
 	{
 		return;
 	}
-	
-	// If this is a write then the instruction owns the data pointer
-	if (ipt->readWrite == I2C_WRITE)
+	
+	I2CInstructionFreeData(ipt);
+	I2CInstructionRelease(ipt);
+}
+
+#endif /* !I2C_USE_RING_BUFFER */
+
+int I2CInstructionGetAddress(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return I2CInstrAddress(ipt);
+}
+
+int I2CInstructionGetLength(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return ipt->length;
+}
+
+uint8_t * I2CInstructionGetData(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return NULL;
+	}
+	
+	return ipt->data;
+}
+
+int I2CInstructionGetReadWrite(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return I2CInstrReadWrite(ipt);
+}
+
+#ifndef I2C_USE_RING_BUFFER
+I2CInstruction_pT I2CInstructionGetNextInstr(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return NULL;
+	}
+	
+	return ipt->nextInstr;
+}
+#endif
+
+I2CInstruction_ID I2CInstructionGetID(I2CInstruction_pT ipt)
+{
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return ipt->instrID;
+}
+
+int I2CInstructionPrint(I2CInstruction_pT ipt, FILE * ostream)
+{
+	size_t ind;
+	static const char * const rwNames[] = {"Write", "Read", "WriteRead"};
+
+	if (fprintf(ostream, "I_id: %lu: %s with Addr: %x; Data: ", (unsigned long)ipt->instrID, rwNames[I2CInstrReadWrite(ipt)], I2CInstrAddress(ipt)) < 0)
+	{
+		return -1;	
+	}
+
+	for (ind = 0; ind < ipt->length; ind++)
+	{
+		if (fprintf(ostream, "%x ", I2CInstructionReadData(ipt, ind)) < 0)
+		{
+			return -1;
+		}
+	}
+	if (I2CInstrReadWrite(ipt) == I2C_WRITE_READ)
+	{
+		if (fprintf(ostream, "then Read %d bytes", I2CInstrRdLength(ipt)) < 0)
+		{
+			return -1;
+		}
+	}
+	fputc('\n', ostream);
+	return 0;
+}
+
+#ifdef I2C_USE_RING_BUFFER
+
+/* Returns the number of slots in use (including removed instructions that have not reached the head yet). The barrier
+ * keeps the caller's reads of those slots after the load of tail */
+static uint8_t I2CRingCount(struct I2CRing * ring)
+{
+	uint8_t count = (uint8_t)(ring->tail - ring->head);
+	
+	I2CCompilerBarrier();
+	return count;
+}
+
+// Returns the instruction at the head of ring (only valid if it is not empty)
+static I2CInstruction_pT I2CRingHead(struct I2CRing * ring)
+{
+	return &ring->slot[ring->head & I2C_RING_MASK];
+}
+
+// Skips removed instructions sitting at the head (the producer frees their data). Only called by the consumer
+static void I2CRingSkipRemoved(struct I2CRing * ring)
+{
+	while (I2CRingCount(ring) && (I2CRingHead(ring)->flags & I2C_INSTR_FLAG_REMOVED))
+	{
+		I2CCompilerBarrier();
+		ring->head++;
+	}
+}
+
+/* Returns the number of slots of ring the producer cannot use yet: those in the ring plus those the consumer has moved
+ * past but that have not been given back */
+static inline uint8_t I2CRingUsed(struct I2CRing * ring)
+{
+	return (uint8_t)(ring->tail - ring->reclaim);
+}
+
+// Gives back the data of the slots the consumer has moved past. Only called by the producer
+static void I2CRingReclaim(struct I2CRing * ring)
+{
+	uint8_t head = ring->head;	// Read once, the ISR may move it on meanwhile
+	
+	I2CCompilerBarrier();
+	while (ring->reclaim != head)
+	{
+		I2CInstructionFreeData(&ring->slot[ring->reclaim & I2C_RING_MASK]);
+		ring->reclaim++;
+	}
+}
+
+// Returns the slot an ID refers to if the instruction is still waiting in buf, NULL otherwise. O(1)
+static I2CInstruction_pT I2CRingLookup(I2CBuffer_pT buf, I2CInstruction_ID instr)
+{
+	uint8_t ind = (uint8_t)(instr & 0xFF);
+	uint8_t lane = ind / I2C_RING_SIZE;
+	
+	if (lane >= I2C_PRIORITY_LEVELS)
+	{
+		return NULL;
+	}
+	
+	struct I2CRing * ring = &buf->lanes[lane];
+	ind &= I2C_RING_MASK;
+	I2CInstruction_pT ipt = &ring->slot[ind];
+	if (ipt->instrID != instr || (ipt->flags & I2C_INSTR_FLAG_REMOVED))
+	{
+		return NULL;
+	}
+	// A slot keeps its old ID after being popped, so also check that it is between head and tail
+	if (((uint8_t)(ind - ring->head) & I2C_RING_MASK) >= I2CRingCount(ring))
+	{
+		return NULL;
+	}
+	return ipt;
+}
+
+/* Copies src into the slot ahead places past the tail of lane and gives it the next ID for that slot, without
+ * publishing it to the ISR. The caller must have reclaimed the ring and checked that the slot is free.
+ * Returns the new ID */
+static I2CInstruction_ID I2CRingStage(I2CBuffer_pT buf, uint8_t lane, uint8_t ahead, I2CInstruction_pT src)
+{
+	struct I2CRing * ring = &buf->lanes[lane];
+	uint8_t ind = (uint8_t)(ring->tail + ahead) & I2C_RING_MASK;
+	I2CInstruction_pT ipt = &ring->slot[ind];
+	
+	// IDs are (generation << 8) | (lane * I2C_RING_SIZE + slot index). Bump the slot's generation, wrapping round to 1
+	// so an ID is never 0
+	I2CInstruction_ID gen = (ipt->instrID >> 8) + 1;
+	if (gen >= (I2C_RECURRING_ID(0) >> 8))	// Nor an I2C_RECURRING_ID
+	{
+		gen = 1;
+	}
+	
+	*ipt = *src;
+	ipt->instrID = (gen << 8) | (lane * I2C_RING_SIZE + ind);
+#ifdef I2C_USE_HANDLES
+	// The handle follows the instruction into the slot (and under its new ID, if it is being moved)
+	if (ipt->handle)
+	{
+		ipt->handle->instr = ipt;
+		ipt->handle->id = ipt->instrID;
+	}
+#endif
+	return ipt->instrID;
+}
+
+/* Copies src into the tail slot of lane, gives it the next ID for that slot and publishes it to the ISR.
+ * The caller must have checked that there is a free slot. Returns the new ID */
+static I2CInstruction_ID I2CRingPush(I2CBuffer_pT buf, uint8_t lane, I2CInstruction_pT src)
+{
+	I2CInstruction_ID id = I2CRingStage(buf, lane, 0, src);
+	
+	I2CCompilerBarrier();	// The slot is written before it is published
+	buf->lanes[lane].tail++;	// Single byte store, publishes the slot
+#ifdef I2C_PROFILE
+	I2CProfileQueueDepth(I2CBufferGetCurrentSize(buf));
+#endif
+	return id;
+}
+
+#else
+
+/* Returns the number of instructions waiting in lane (the current one included). The barrier keeps the caller's reads
+ * of those nodes after the load of added */
+static inline uint8_t I2CLaneCount(struct I2CLane * lpt)
+{
+	uint8_t count = (uint8_t)(lpt->added - lpt->taken);
+	
+	I2CCompilerBarrier();
+	return count;
+}
+
+// Returns the instruction at the head of lane (only valid if it is not empty)
+static inline I2CInstruction_pT I2CLaneHead(struct I2CLane * lpt)
+{
+	return lpt->lastPt->nextInstr;
+}
+
+// Takes cancelled instructions sitting at the head off lane (the producer frees them). Only called by the consumer
+static void I2CLaneSkipRemoved(struct I2CLane * lpt)
+{
+	while (I2CLaneCount(lpt) && (I2CLaneHead(lpt)->flags & I2C_INSTR_FLAG_REMOVED))
+	{
+		lpt->lastPt = I2CLaneHead(lpt);
+		I2CCompilerBarrier();
+		lpt->taken++;
+	}
+}
+
+// Gives back the instructions the consumer has taken off lane since the last call. Only called by the producer
+static void I2CLaneReclaim(struct I2CLane * lpt)
+{
+	uint8_t taken = lpt->taken;	// Read once, the ISR may take more meanwhile
+	
+	I2CCompilerBarrier();
+	while (lpt->reclaimed != taken)
+	{
+		I2CInstruction_pT ipt = lpt->freePt;
+		lpt->freePt = ipt->nextInstr;
+		lpt->reclaimed++;
+		if (ipt != &lpt->stub)
+		{
+			I2CInstructionFreeData(ipt);
+			I2CInstructionRelease(ipt);
+		}
+	}
+	// freePt is the last instruction taken off: the ISR may still follow its nextInstr, but its data can go now
+	I2CInstructionFreeData(lpt->freePt);
+	lpt->freePt->flags |= I2C_INSTR_FLAG_BORROWED;
+}
+
+#endif /* I2C_USE_RING_BUFFER */
+
+// Gives back everything the consumer is done with in buf. Only called by the producer, before it takes storage
+static void I2CBufferReclaim(I2CBuffer_pT buf)
+{
+	uint8_t lane;
+	
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+#ifdef I2C_USE_RING_BUFFER
+		I2CRingReclaim(&buf->lanes[lane]);
+#else
+		I2CLaneReclaim(&buf->lanes[lane]);
+#endif
+	}
+}
+
+// Returns the current (head) instruction of buf, or NULL if buf is empty
+static I2CInstruction_pT I2CBufferGetCurrent(I2CBuffer_pT buf)
+{
+	if (!buf)
+	{
+		return NULL;
+	}
+#if I2C_MAX_RECURRING > 0
+	if (buf->lane == I2C_RECURRING_LANE)
+	{
+		return &buf->recurring[buf->recurCur].instr;
+	}
+#endif
+#ifdef I2C_USE_RING_BUFFER
+	if (!I2CRingCount(&buf->lanes[buf->lane]))
+	{
+		return NULL;
+	}
+	return I2CRingHead(&buf->lanes[buf->lane]);
+#else
+	if (!I2CLaneCount(&buf->lanes[buf->lane]))
+	{
+		return NULL;
+	}
+	return I2CLaneHead(&buf->lanes[buf->lane]);
+#endif
+}
+
+#if I2C_MAX_RECURRING > 0
+
+// Makes the next due recurring instruction (taking slots in turn) the current one. Returns its ID, or 0 if none is due
+static I2CInstruction_ID I2CRecurringPickDue(I2CBuffer_pT buf)
+{
+	uint16_t now = I2CGetTicks();
+	uint8_t ind = buf->recurCur;
+	uint8_t tries;
+	
+	for (tries = 0; tries < I2C_MAX_RECURRING; tries++)
+	{
+		ind = (ind + 1 < I2C_MAX_RECURRING) ? ind + 1 : 0;
+		struct I2CRecurringSlot * rpt = &buf->recurring[ind];
+		if (rpt->active && (int16_t)(now - rpt->due) >= 0)
+		{
+			// Fill the half that does not hold the latest sample
+			uint8_t * half = rpt->dest + (rpt->front ? 0 : rpt->sampleLength);
+			if (I2CInstrReadWrite(&rpt->instr) == I2C_READ)
+			{
+				rpt->instr.data = half;
+			}
+			else
+			{
+				I2CInstrSetReadPhase(&rpt->instr, half, rpt->sampleLength);
+			}
+			rpt->running = 1;
+			buf->recurCur = ind;
+			buf->lane = I2C_RECURRING_LANE;
+			return rpt->instr.instrID;
+		}
+	}
+	return 0;
+}
+
+// Ends the run of the current (recurring) instruction. A successful run's half becomes the latest sample
+static void I2CRecurringFinish(I2CBuffer_pT buf, uint8_t status)
+{
+	struct I2CRecurringSlot * rpt = &buf->recurring[buf->recurCur];
+	
+	if (status == I2C_STATUS_DONE)
+	{
+		I2CCompilerBarrier();	// The sample is written before it is published
+		rpt->front ^= 1;	// Single byte store, publishes the sample
+		rpt->seq++;
+		if (!rpt->seq)
+		{
+			rpt->seq = 1;
+		}
+	}
+	rpt->due = I2CGetTicks() + rpt->period;
+	rpt->running = 0;
+	buf->recurYield = 1;
+	buf->lane = 0;
+}
+
+#endif /* I2C_MAX_RECURRING */
+
+// Makes the most urgent lane with an instruction in it the current lane. Only called by the consumer
+I2CInstruction_ID I2CBufferPickNext(I2CBuffer_pT buf)
+{
+	uint8_t lane;
+	
+	if (!buf)
+	{
+		return 0;
+	}
+	
+#if I2C_MAX_RECURRING > 0
+	// The driver may pick again before the START (e.g. I2CTask after the ISR), so a recurring run stays picked until
+	// it has been on the bus, and the queue's turn lasts until one of its instructions starts
+	if (buf->lane == I2C_RECURRING_LANE)
+	{
+		return buf->recurring[buf->recurCur].instr.instrID;
+	}
+	// Due recurring instructions go first, but after a recurring run the queue gets a turn
+	if (!buf->recurYield)
+	{
+		I2CInstruction_ID id = I2CRecurringPickDue(buf);
+		if (id)
+		{
+			return id;
+		}
+	}
+#endif
+	
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+#ifdef I2C_USE_RING_BUFFER
+		I2CRingSkipRemoved(&buf->lanes[lane]);
+		// A lane whose head is backing off before a retry waits, so its order is kept
+		if (I2CRingCount(&buf->lanes[lane]) && !I2CRetryWaiting(I2CRingHead(&buf->lanes[lane])))
+		{
+			buf->lane = lane;
+			return I2CRingHead(&buf->lanes[lane])->instrID;
+		}
+#else
+		I2CLaneSkipRemoved(&buf->lanes[lane]);
+		// A lane whose head is backing off before a retry waits, so its order is kept
+		if (I2CLaneCount(&buf->lanes[lane]) && !I2CRetryWaiting(I2CLaneHead(&buf->lanes[lane])))
+		{
+			buf->lane = lane;
+			return I2CLaneHead(&buf->lanes[lane])->instrID;
+		}
+#endif
+	}
+	
+#if I2C_MAX_RECURRING > 0
+	return I2CRecurringPickDue(buf);
+#else
+	return 0;
+#endif
+}
+
+I2CBuffer_pT I2CBufferNew()
+{
+#ifdef I2C_USE_STATIC_POOL
+	I2CBuffer_pT newBuf = NULL;
+	uint8_t ind;
+	
+	if (!g_s_poolReady)
+	{
+		I2CPoolInit();
+	}
+	for (ind = 0; ind < I2C_POOL_MAX_BUFFERS; ind++)
+	{
+		if (!g_s_bufferInUse[ind])
+		{
+			g_s_bufferInUse[ind] = 1;
+			newBuf = &g_s_bufferPool[ind];
+			break;
+		}
+	}
+#else
+	I2CBuffer_pT newBuf = malloc(sizeof(struct I2CBuffer));
+#endif
+	
+	if (!newBuf)
+	{
+		return NULL;
+	}
+	// Zeroes every lane (empty rings/lists) and, for rings, every slot's ID
+	memset(newBuf->lanes, 0, sizeof(newBuf->lanes));
+#ifndef I2C_USE_RING_BUFFER
+	uint8_t lane;
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+		struct I2CLane * lpt = &newBuf->lanes[lane];
+		lpt->stub.flags = I2C_INSTR_FLAG_BORROWED;	// Owns nothing
+		lpt->endPt = &lpt->stub;
+		lpt->lastPt = &lpt->stub;
+		lpt->freePt = &lpt->stub;
+	}
+#endif
+	newBuf->lane = 0;
+	newBuf->addLane = I2C_PRIORITY_LOWEST;
+	newBuf->addStatus = I2C_STATUS_UNKNOWN;
+#if I2C_MAX_RECURRING > 0
+	memset(newBuf->recurring, 0, sizeof(newBuf->recurring));
+	newBuf->recurCur = 0;
+	newBuf->recurYield = 0;
+#endif
+	newBuf->callback = NULL;
+#ifdef I2C_USE_HANDLES
+	newBuf->nextHandle = NULL;
+#endif
+#ifdef I2C_COALESCE_WRITES
+	newBuf->coalesce = 0;
+	newBuf->coalesced = 0;
+#endif
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+	newBuf->retries = 0;
+	memset(&newBuf->retryStats, 0, sizeof(newBuf->retryStats));
+#endif
+	memset(newBuf->results, 0, sizeof(newBuf->results));
+	newBuf->resultNext = 0;
+	return newBuf;
+}
+
+void I2CBufferFree(I2CBuffer_pT buf)
+{
+	if (!buf)
+	{
+		return;
+	}
+	
+	uint8_t lane;
+	
+	// The driver must not be using buf any more, so everything from the oldest unreclaimed instruction on can go
+#ifdef I2C_USE_RING_BUFFER
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+		struct I2CRing * ring = &buf->lanes[lane];
+		while (ring->reclaim != ring->tail)
+		{
+#ifdef I2C_USE_HANDLES
+			I2CHandleFinish(&ring->slot[ring->reclaim & I2C_RING_MASK], I2C_STATUS_CANCELLED, 0);
+#endif
+			I2CInstructionFreeData(&ring->slot[ring->reclaim & I2C_RING_MASK]);
+			ring->reclaim++;
+		}
+	}
+#else
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+		I2CInstruction_pT ipt = buf->lanes[lane].freePt;
+		while (ipt)
+		{
+			I2CInstruction_pT next = ipt->nextInstr;
+			if (ipt != &buf->lanes[lane].stub)
+			{
+#ifdef I2C_USE_HANDLES
+				I2CHandleFinish(ipt, I2C_STATUS_CANCELLED, 0);
+#endif
+				I2CInstructionFree(ipt);
+			}
+			ipt = next;
+		}
+	}
+#endif
+#ifdef I2C_USE_STATIC_POOL
+	g_s_bufferInUse[buf - g_s_bufferPool] = 0;
+#else
+	free(buf);
+#endif
+}
+
+// Moves to the next instruction
+I2CInstruction_ID I2CBufferMoveToNextInstruction(I2CBuffer_pT buf)
+{
+	if (!buf)
+	{
+		return 0;
+	}
+	
+#if I2C_MAX_RECURRING > 0
+	if (buf->lane == I2C_RECURRING_LANE)
+	{
+		// A recurring instruction is never freed, its run just ends (without a new sample)
+		I2CRecurringFinish(buf, I2C_STATUS_UNKNOWN);
+		return I2CBufferPickNext(buf);
+	}
+#endif
+	
+#ifdef I2C_USE_RING_BUFFER
+	struct I2CRing * ring = &buf->lanes[buf->lane];
+	
+	// Only the head slot is touched, and only the consumer moves head (the producer frees the slot's data later)
+	if (!I2CRingCount(ring))
+	{
+		return 0;
+	}
+	
+	I2CCompilerBarrier();	// Done with the slot before the producer may reuse it
+	ring->head++;	// Single byte store
+	I2CRingSkipRemoved(ring);
+#else
+	struct I2CLane * lpt = &buf->lanes[buf->lane];
+	
+	if (!I2CLaneCount(lpt))
+	{
+		return 0;
+	}
+	
+	// The node stays linked in as lastPt until the producer reclaims it
+	lpt->lastPt = I2CLaneHead(lpt);
+	I2CCompilerBarrier();	// Done with the node before the producer may reclaim it
+	lpt->taken++;	// Single byte store
+#endif
+	
+	// Returns the next instruction, from the most urgent lane (or 0 if none)
+	return I2CBufferPickNext(buf);
+}
+
+// Puts ipt's outcome in buf's result table (and its handle, if it has one)
+static void I2CBufferRecordResult(I2CBuffer_pT buf, I2CInstruction_pT ipt, uint8_t status, int transferred)
+{
+	// The table is a small ring, the oldest result is overwritten
+	struct I2CResult * res = &buf->results[buf->resultNext];
+	res->instrID = ipt->instrID;
+	res->transferred = transferred;
+	res->status = status;
+	buf->resultNext++;
+	if (buf->resultNext >= I2C_RESULT_TABLE_SIZE)
+	{
+		buf->resultNext = 0;
+	}
+#ifdef I2C_USE_HANDLES
+	I2CHandleFinish(ipt, status, transferred);
+#endif
+}
+
+// Records the outcome of the current instruction, tells the callback, then moves to the next instruction
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+
+/* Leaves ipt (buf's current instruction) where it is, to be tried again once its backoff delay is over, if status is
+ * worth retrying and it has retries left. Returns 1 if it will be retried */
+static uint8_t I2CRetryAgain(I2CBuffer_pT buf, I2CInstruction_pT ipt, uint8_t status)
+{
+	if (status != I2C_STATUS_ADDR_NACK && status != I2C_STATUS_DATA_NACK && status != I2C_STATUS_ARB_LOST)
+	{
+		return 0;
+	}
+	if (ipt->attempt >= ipt->retries || (ipt->flags & I2C_INSTR_FLAG_STREAM))
+	{
+		return 0;
+	}
+	
+	ipt->attempt++;
+#if I2C_RETRY_BACKOFF == I2C_RETRY_FIXED
+	ipt->retryAt = I2CGetTicks() + I2C_RETRY_DELAY_TICKS;
+#elif I2C_RETRY_BACKOFF == I2C_RETRY_EXPONENTIAL
+	uint16_t delay = I2C_RETRY_DELAY_TICKS;
+	uint8_t ind;
+	for (ind = 1; ind < ipt->attempt && delay < I2C_RETRY_MAX_DELAY_TICKS; ind++)
+	{
+		delay <<= 1;
+	}
+	if (delay > I2C_RETRY_MAX_DELAY_TICKS)
+	{
+		delay = I2C_RETRY_MAX_DELAY_TICKS;
+	}
+	ipt->retryAt = I2CGetTicks() + delay;
+#endif
+	buf->retryStats.retries++;
+	return 1;
+}
+
+#endif /* I2C_RETRY_BACKOFF */
+
+I2CInstruction_ID I2CBufferCompleteCurrentInstruction(I2CBuffer_pT buf, uint8_t status, int transferred)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(buf);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	I2CInstruction_ID id = ipt->instrID;
+	
+#if I2C_MAX_RECURRING > 0
+	// Recurring runs report through their samples (and the callback), not the result table
+	if (buf->lane == I2C_RECURRING_LANE)
+	{
+		I2CRecurringFinish(buf, status);
+		I2CInstruction_ID next = I2CBufferPickNext(buf);
+		if (buf->callback)
+		{
+			buf->callback(id, status, transferred);
+		}
+		return next;
+	}
+#endif
+	
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+	if (I2CRetryAgain(buf, ipt, status))
+	{
+		return I2CBufferPickNext(buf);
+	}
+	if (ipt->attempt)
+	{
+		if (status == I2C_STATUS_DONE)
+		{
+			buf->retryStats.recovered++;
+		}
+		else
+		{
+			buf->retryStats.exhausted++;
+		}
+	}
+#endif
+	
+	I2CBufferRecordResult(buf, ipt, status, transferred);
+	
+	I2CInstruction_ID next = I2CBufferMoveToNextInstruction(buf);
+	
+	// Called once the instruction has left buf, so I2CBufferContains(buf, id) already returns 0 in the callback
+	if (buf->callback)
+	{
+		buf->callback(id, status, transferred);
+	}
+	return next;
+}
+
+int I2CBufferGetCurrentTransfer(I2CBuffer_pT ibt, struct I2CTransfer * xfer)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+#if I2C_MAX_RECURRING > 0
+	// Called at the START, so the queue has had its turn
+	if (ibt->lane != I2C_RECURRING_LANE)
+	{
+		ibt->recurYield = 0;
+	}
+#endif
+	xfer->data = ipt->data;
+	xfer->rdData = NULL;
+	xfer->length = ipt->length;
+	xfer->rdLength = 0;
+	if (ipt->flags & I2C_INSTR_FLAG_WRITE_READ)
+	{
+		xfer->rdData = I2CInstrRdData(ipt);
+		xfer->rdLength = I2CInstrRdLength(ipt);
+	}
+	xfer->address = I2CInstrAddress(ipt);
+	xfer->readWrite = I2CInstrReadWrite(ipt);
+	xfer->progmem = (ipt->flags & I2C_INSTR_FLAG_PROGMEM) != 0;
+#ifdef I2C_USE_STREAMS
+	xfer->stream = NULL;
+	if (ipt->flags & I2C_INSTR_FLAG_STREAM)
+	{
+		xfer->stream = (struct I2CStream *)((ipt->flags & I2C_INSTR_FLAG_WRITE_READ) ? xfer->rdData : ipt->data);
+	}
+#endif
+	return 1;
+}
+
+int I2CBufferGetCurrentInstructionAddress(I2CBuffer_pT ibt)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return I2CInstrAddress(ipt);
+}
+
+int I2CBufferGetCurrentInstructionLength(I2CBuffer_pT ibt)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return ipt->length;
+}
+
+int I2CBufferSetCurrentInstructionData(I2CBuffer_pT ibt, int offset, uint8_t data)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	if (offset >= ipt->length)
+	{
+		return 0;
+	}
+	if (ipt->flags & I2C_INSTR_FLAG_BORROWED)
+	{
+		// Never write into memory a write instruction borrowed (it may be const or in flash)
+		return 0;
+	}
+	*(ipt->data + offset) = data;
+	return 1;
+}
+
+uint8_t I2CBufferGetCurrentInstructionData(I2CBuffer_pT ibt, int offset)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	if (offset >= ipt->length)
+	{
+		return 0;
+	}
+	return I2CInstructionReadData(ipt, offset);
+}
+
+int I2CBufferGetCurrentInstructionReadWrite(I2CBuffer_pT ibt)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return I2CInstrReadWrite(ipt);
+}
+
+int I2CBufferGetCurrentInstructionReadLength(I2CBuffer_pT ibt)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return (ipt->flags & I2C_INSTR_FLAG_WRITE_READ) ? I2CInstrRdLength(ipt) : ipt->length;
+}
+
+int I2CBufferSetCurrentInstructionReadData(I2CBuffer_pT ibt, int offset, uint8_t data)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	if (!(ipt->flags & I2C_INSTR_FLAG_WRITE_READ))
+	{
+		return I2CBufferSetCurrentInstructionData(ibt, offset, data);
+	}
+	if (offset >= I2CInstrRdLength(ipt))
+	{
+		return 0;
+	}
+	*(I2CInstrRdData(ipt) + offset) = data;
+	return 1;
+}
+
+I2CInstruction_ID I2CBufferGetCurrentInstructionID(I2CBuffer_pT ibt)
+{
+	I2CInstruction_pT ipt = I2CBufferGetCurrent(ibt);
+	if (!ipt)
+	{
+		return 0;
+	}
+	
+	return ipt->instrID;
+}
+
+#ifndef I2C_USE_RING_BUFFER
+
+// Links newInstr in at the end of lane, without disabling interrupts
+I2CInstruction_ID I2CBufferPushInstruction(I2CBuffer_pT buf, uint8_t lane, I2CInstruction_pT newInstr)
+{
+	if (!newInstr)
+	{
+		return 0;
+	}
+
+	if (!buf)
+	{
+		I2CInstructionFree(newInstr);
+		return 0;
+	}
+	
+	struct I2CLane * lpt = &buf->lanes[lane];
+	
+	if (I2CBufferGetCurrentSize(buf) >= I2C_MAX_BUFFER_SIZE || I2CLaneCount(lpt) == 0xFF)
+	{
+		I2CInstructionFree(newInstr);
+
+		return 0;
+	}
+	
+	I2CInstruction_ID id = newInstr->instrID;
+	
+	// The ISR does not look past the last instruction it knows of, so the links can be made in any order
+	newInstr->nextInstr = NULL;
+	lpt->endPt->nextInstr = newInstr;
+	lpt->endPt = newInstr;
+	I2CCompilerBarrier();	// The node and its link are written before they are published
+	lpt->added++;	// Single byte store, publishes the instruction
+#ifdef I2C_PROFILE
+	I2CProfileQueueDepth(I2CBufferGetCurrentSize(buf));
+#endif
+	
+	return id;
+}
+
+#endif /* !I2C_USE_RING_BUFFER */
+
+
+
+// Adds an instruction with the given read phase and flags at the end of buf
+#ifdef I2C_COALESCE_WRITES
+
+/* Returns the last instruction queued in lane if it is not also the head, so the ISR cannot be on it (nor get to it
+ * while interrupts are off), NULL otherwise */
+static I2CInstruction_pT I2CBufferLaneTail(I2CBuffer_pT buf, uint8_t lane)
+{
+#ifdef I2C_USE_RING_BUFFER
+	struct I2CRing * ring = &buf->lanes[lane];
+	if (I2CRingCount(ring) < 2)
+	{
+		return NULL;
+	}
+	return &ring->slot[(uint8_t)(ring->tail - 1) & I2C_RING_MASK];
+#else
+	struct I2CLane * lpt = &buf->lanes[lane];
+	if (I2CLaneCount(lpt) < 2)
+	{
+		return NULL;
+	}
+	return lpt->endPt;
+#endif
+}
+
+/* Appends a copied write of leng bytes (register pointer first) to the last write queued in buf's add lane, if that
+ * one may be merged too, is to the same device and carries on from the register where it stops. Returns the ID the
+ * write now shares, 0 if it could not be merged */
+static I2CInstruction_ID I2CBufferCoalesce(I2CBuffer_pT buf, int d_add, const uint8_t * dat, int leng)
+{
+	if (!buf->coalesce || d_add < 0 || d_add > 0x7F || !dat || leng < 2)
+	{
+		return 0;
+	}
+#ifdef I2C_USE_HANDLES
+	if (buf->nextHandle)	// It wants its own result
+	{
+		return 0;
+	}
+#endif
+	
+	I2CInstruction_pT tail = I2CBufferLaneTail(buf, buf->addLane);
+	if (!tail || tail->addrRW != (uint8_t)(d_add << 1) || tail->length < 2 || !(tail->flags & I2C_INSTR_FLAG_MERGE))
+	{
+		return 0;
+	}
+	if (tail->flags & (I2C_INSTR_FLAG_REMOVED | I2C_INSTR_FLAG_BORROWED | I2C_INSTR_FLAG_STREAM | I2C_INSTR_FLAG_WRITE_READ))
+	{
+		return 0;
+	}
+#ifdef I2C_USE_HANDLES
+	if (tail->handle)
+	{
+		return 0;
+	}
+#endif
+	// The register after the last one it writes (no wrapping past 0xFF)
+	if (tail->data[0] + tail->length - 1 != dat[0] || tail->length + leng - 1 > I2C_COALESCE_MAX_LENGTH)
+	{
+		return 0;
+	}
+	
+	// Build the merged payload first, so only the swap needs the ISR held off
+	int merged = tail->length + leng - 1;
+	uint8_t * block = I2CPayloadAlloc(merged);
+	if (!block)
+	{
+		return 0;
+	}
+	memcpy(block, tail->data, tail->length);
+	memcpy(block + tail->length, dat + 1, leng - 1);
+	
+	I2CInstruction_ID id = 0;
+	uint8_t sreg = I2CCriticalEnter();
+	// The ISR may have moved on meanwhile, so the tail may now be the head
+	if (I2CBufferLaneTail(buf, buf->addLane) == tail)
+	{
+		uint8_t * old = tail->data;
+		tail->data = block;
+		tail->length = merged;
+		id = tail->instrID;
+		block = old;
+	}
+	I2CCriticalExit(sreg);
+	
+	I2CPayloadRelease(block);	// The old payload, or the merged one if it was too late
+	if (id)
+	{
+		buf->coalesced++;
+	}
+	return id;
+}
+
+#endif /* I2C_COALESCE_WRITES */
+
+static I2CInstruction_ID I2CBufferAddInstructionEx(I2CBuffer_pT buf, int d_add, int rw, uint8_t* dat, int leng, uint8_t* rdDat, int rdLeng, uint8_t flags)
+{
+	
+	if (!buf)
+	{
+		return 0;
+	}
+	buf->addStatus = I2C_STATUS_UNKNOWN;	// Any refusal from here on is for want of room
+	if (!I2CInstructionValid(d_add, rw, leng, rdLeng))
+	{
+		I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+		return 0;
+	}
+	
+	// Before coalescing too: a merge takes a new payload block, which may be one the ISR is done with
+	I2CBufferReclaim(buf);
+#ifdef I2C_COALESCE_WRITES
+	if (!buf->coalesce)
+	{
+		flags &= ~I2C_INSTR_FLAG_MERGE;	// Nor may a later write be merged into it once coalescing is switched on
+	}
+	if (rw == I2C_WRITE && flags == I2C_INSTR_FLAG_MERGE)
+	{
+		I2CInstruction_ID merged = I2CBufferCoalesce(buf, d_add, dat, leng);
+		if (merged)
+		{
+			return merged;
+		}
+	}
+#endif
+	
+	struct I2CFuture * hpt = I2CHandleTake(buf);
+	
+#ifdef I2C_USE_RING_BUFFER
+	struct I2CInstruction newInstr;
+	uint8_t lane = buf->addLane;
+	
+	if (I2CRingUsed(&buf->lanes[lane]) >= I2C_RING_SIZE)
+	{
+		return 0;
+	}
+	if (!I2CInstructionInit(&newInstr, d_add, rw, dat, leng, rdDat, rdLeng, flags))
+	{
+		return 0;
+	}
+	I2CRetryArm(buf, &newInstr);
+	I2CHandleBind(hpt, buf, &newInstr);	// Moved on to the slot by I2CRingStage
+	return I2CRingPush(buf, lane, &newInstr);
+#else
+	I2CInstruction_pT newInstr = I2CInstructionNew(d_add, rw, dat, leng, rdDat, rdLeng, flags);
+	
+	if (newInstr == NULL)
+	{
+		return 0;
+	}
+	I2CRetryArm(buf, newInstr);
+	I2CHandleBind(hpt, buf, newInstr);
+	I2CInstruction_ID id = I2CBufferPushInstruction(buf, buf->addLane, newInstr);
+#ifdef I2C_USE_HANDLES
+	if (!id && hpt)
+	{
+		hpt->status = I2C_STATUS_UNKNOWN;	// Refused, never published
+	}
+#endif
+	return id;
+#endif
+	
+}
+
+// Adds an instruction at w_ptr
+I2CInstruction_ID I2CBufferAddInstruction(I2CBuffer_pT buf, int d_add, int rw, uint8_t* dat, int leng)
+{
+	// Write-reads need a second buffer, see I2CBufferAddWriteReadInstruction
+	if (rw != I2C_WRITE && rw != I2C_READ)
+	{
+		I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+		return 0;
+	}
+	// Switching coalescing on says every plain write to buf is a register pointer and data for an auto-incrementing device
+	return I2CBufferAddInstructionEx(buf, d_add, rw, dat, leng, NULL, 0, rw == I2C_WRITE ? I2C_INSTR_FLAG_MERGE : 0);
+}
+
+// Adds a copied write that is only merged if the caller says the device auto-increments
+I2CInstruction_ID I2CBufferAddRegisterWrite(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng, uint8_t mergeable)
+{
+	return I2CBufferAddInstructionEx(buf, d_add, I2C_WRITE, (uint8_t*)dat, leng, NULL, 0, mergeable ? I2C_INSTR_FLAG_MERGE : 0);
+}
+
+// Adds a write that streams straight out of the caller's memory
+I2CInstruction_ID I2CBufferAddInstructionNoCopy(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng)
+{
+	return I2CBufferAddInstructionEx(buf, d_add, I2C_WRITE, (uint8_t*)dat, leng, NULL, 0, I2C_INSTR_FLAG_BORROWED);
+}
+
+// Adds a write that streams straight out of program memory
+I2CInstruction_ID I2CBufferAddInstructionNoCopy_P(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng)
+{
+	return I2CBufferAddInstructionEx(buf, d_add, I2C_WRITE, (uint8_t*)dat, leng, NULL, 0, I2C_INSTR_FLAG_BORROWED | I2C_INSTR_FLAG_PROGMEM);
+}
+
+// Adds a write followed (after a repeated start) by a read, as one bus transaction
+I2CInstruction_ID I2CBufferAddWriteReadInstruction(I2CBuffer_pT buf, int d_add, uint8_t* wrDat, int wrLeng, uint8_t* rdDat, int rdLeng)
+{
+	return I2CBufferAddInstructionEx(buf, d_add, I2C_WRITE_READ, wrDat, wrLeng, rdDat, rdLeng, 0);
+}
+
+#ifdef I2C_USE_STREAMS
+
+// Adds a streaming instruction (the stream descriptor stands in for the streamed phase's data)
+I2CInstruction_ID I2CBufferAddStream(I2CBuffer_pT buf, int d_add, int rw, uint8_t* wrDat, int wrLeng, struct I2CStream * stream)
+{
+	if (!stream || !stream->callback || !stream->window || !stream->windowSize)
+	{
+		I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+		return 0;
+	}
+	
+	switch (rw)
+	{
+		case I2C_WRITE:
+			return I2CBufferAddInstructionEx(buf, d_add, rw, (uint8_t*)stream, 0, NULL, 0, I2C_INSTR_FLAG_BORROWED | I2C_INSTR_FLAG_STREAM);
+		case I2C_READ:
+			return I2CBufferAddInstructionEx(buf, d_add, rw, (uint8_t*)stream, 0, NULL, 0, I2C_INSTR_FLAG_STREAM);
+		case I2C_WRITE_READ:
+			return I2CBufferAddInstructionEx(buf, d_add, rw, wrDat, wrLeng, (uint8_t*)stream, 0, I2C_INSTR_FLAG_STREAM);
+		default:
+			I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+			return 0;
+	}
+}
+
+#endif /* I2C_USE_STREAMS */
+
+// Adds count instructions at the end of buf's add lane, all or none
+I2CInstruction_ID I2CBufferAddBatch(I2CBuffer_pT buf, const struct I2CBatchEntry * entries, uint8_t count, I2CInstruction_ID * lastID)
+{
+	uint8_t ind;
+	
+	if (!buf || !entries || !count)
+	{
+		I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+		return 0;
+	}
+	
+	// Every entry is checked before anything is reserved, so a bad one never leaves a copy or a slot behind
+	for (ind = 0; ind < count; ind++)
+	{
+		if (!I2CInstructionValid(entries[ind].address, entries[ind].readWrite, entries[ind].length, entries[ind].rdLength))
+		{
+			I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+			return 0;
+		}
+	}
+#ifdef I2C_USE_RING_BUFFER
+	if (count > I2C_RING_SIZE)	// Would never fit
+	{
+		I2CBufferSettleAdd(buf, I2C_STATUS_INVALID, 0);
+		return 0;
+	}
+#endif
+	buf->addStatus = I2C_STATUS_UNKNOWN;
+	struct I2CFuture * hpt = I2CHandleTake(buf);	// For the last instruction
+	
+	uint8_t lane = buf->addLane;
+	I2CInstruction_ID firstID = 0;
+	
+	I2CBufferReclaim(buf);
+	
+#ifdef I2C_USE_RING_BUFFER
+	struct I2CRing * ring = &buf->lanes[lane];
+	struct I2CInstruction newInstr;
+	
+	if (count > I2C_RING_SIZE - I2CRingUsed(ring))
+	{
+		return 0;
+	}
+	
+	// The slots past the tail are invisible to the ISR, so they can be filled in with interrupts on
+	for (ind = 0; ind < count; ind++)
+	{
+		if (!I2CInstructionInitEntry(&newInstr, &entries[ind]))
+		{
+			break;
+		}
+		I2CRetryArm(buf, &newInstr);
+		if (ind == count - 1)
+		{
+			I2CHandleBind(hpt, buf, &newInstr);
+		}
+		I2CInstruction_ID id = I2CRingStage(buf, lane, ind, &newInstr);
+		if (!ind)
+		{
+			firstID = id;
+		}
+		if (lastID)
+		{
+			*lastID = id;
+		}
+	}
+	// Out of payload storage: give back what was taken and add nothing
+	if (ind < count)
+	{
+		while (ind--)
+		{
+			I2CInstructionFreeData(&ring->slot[(uint8_t)(ring->tail + ind) & I2C_RING_MASK]);
+		}
+		return 0;
+	}
+	
+	I2CCompilerBarrier();	// Every slot is written before the batch is published
+	ring->tail += count;	// Single byte store, publishes the whole batch
+#ifdef I2C_PROFILE
+	I2CProfileQueueDepth(I2CBufferGetCurrentSize(buf));
+#endif
+	
+#else
+	I2CInstruction_pT first = NULL;
+	I2CInstruction_pT last = NULL;
+	I2CInstruction_pT ipt;
+	
+	struct I2CLane * lpt = &buf->lanes[lane];
+	
+	if (I2CBufferGetCurrentSize(buf) + count > I2C_MAX_BUFFER_SIZE || I2CLaneCount(lpt) + count > 0xFF)
+	{
+		return 0;
+	}
+	
+	// The nodes are private until they are linked in
+	for (ind = 0; ind < count; ind++)
+	{
+		ipt = I2CInstructionAlloc();
+		if (!ipt)
+		{
+			break;
+		}
+		if (!I2CInstructionInitEntry(ipt, &entries[ind]))
+		{
+			I2CInstructionRelease(ipt);
+			break;
+		}
+		I2CRetryArm(buf, ipt);
+		ipt->nextInstr = NULL;
+		if (last)
+		{
+			last->nextInstr = ipt;
+		}
+		else
+		{
+			first = ipt;
+		}
+		last = ipt;
+	}
+	// Out of storage: give back what was taken and add nothing
+	if (ind < count)
 	{
-		if (ipt->data)
+		while (first)
 		{
-			free(ipt->data);
+			ipt = first;
+			first = first->nextInstr;
+			I2CInstructionFreeData(ipt);
+			I2CInstructionRelease(ipt);
 		}
+		return 0;
 	}
 	
-	free(ipt);
-	sei();
-}
-
-int I2CInstructionGetAddress(I2CInstruction_pT ipt)
-{
-	if (!ipt)
+	// The IDs of a batch are consecutive, so start again from 1 rather than wrap in the middle of one
+	if (I2C_RECURRING_ID(0) - g_s_instrIDAssigner < count)
 	{
-		return 0;
+		g_s_instrIDAssigner = 1;
+	}
+	firstID = g_s_instrIDAssigner;
+	for (ipt = first; ipt; ipt = ipt->nextInstr)
+	{
+		ipt->instrID = g_s_instrIDAssigner;
+		g_s_instrIDAssigner++;
+	}
+	if (lastID)
+	{
+		*lastID = last->instrID;
 	}
+	I2CHandleBind(hpt, buf, last);
+	
+	lpt->endPt->nextInstr = first;
+	lpt->endPt = last;
+	I2CCompilerBarrier();	// Every node and link is written before the batch is published
+	lpt->added += count;	// Single byte store, publishes the whole batch
+#ifdef I2C_PROFILE
+	I2CProfileQueueDepth(I2CBufferGetCurrentSize(buf));
+#endif
 	
-	return ipt->dev_addr;
+#endif /* I2C_USE_RING_BUFFER */
+	
+	return firstID;
 }
 
-int I2CInstructionGetLength(I2CInstruction_pT ipt)
+size_t I2CBufferGetCurrentSize(I2CBuffer_pT buf)
 {
-	if (!ipt)
+	if (!buf)
 	{
 		return 0;
 	}
-	
-	return ipt->length;
-}
-
-uint8_t * I2CInstructionGetData(I2CInstruction_pT ipt)
-{
-	if (!ipt)
+#ifdef I2C_USE_RING_BUFFER
+	size_t size = 0;
+	uint8_t lane;
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
 	{
-		return NULL;
+		size += I2CRingCount(&buf->lanes[lane]);
 	}
-	
-	return ipt->data;
+	return size;
+#else
+	size_t size = 0;
+	uint8_t lane;
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
+	{
+		size += I2CLaneCount(&buf->lanes[lane]);
+	}
+	return size;
+#endif
 }
 
-int I2CInstructionGetReadWrite(I2CInstruction_pT ipt)
+int I2CBufferContains(I2CBuffer_pT buf, I2CInstruction_ID instr)
 {
-	if (!ipt)
+	if (!buf)
 	{
 		return 0;
 	}
-	
-	return ipt->readWrite;
-}
-
-I2CInstruction_pT I2CInstructionGetNextInstr(I2CInstruction_pT ipt)
-{
-	if (!ipt)
+	if (!instr)
 	{
-		return NULL;
+		return 0;
 	}
+#ifdef I2C_USE_RING_BUFFER
+	return I2CRingLookup(buf, instr) != NULL;
+#else
+	uint8_t lane;
+	uint8_t ind;
+	int found = 0;
 	
-	return ipt->nextInstr;
+	// Walks from lastPt, which only stays put while the ISR is held off (this also makes it safe from the callback)
+	uint8_t sreg = I2CCriticalEnter();
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS && !found; lane++)
+	{
+		struct I2CLane * lpt = &buf->lanes[lane];
+		I2CInstruction_pT ipt = lpt->lastPt;
+		for (ind = I2CLaneCount(lpt); ind; ind--)
+		{
+			ipt = ipt->nextInstr;
+			if (instr == ipt->instrID && !(ipt->flags & I2C_INSTR_FLAG_REMOVED))
+			{
+				found = 1;
+				break;
+			}
+		}
+	}
+	I2CCriticalExit(sreg);
+	return found;
+#endif
 }
 
-I2CInstruction_ID I2CInstructionGetID(I2CInstruction_pT ipt)
+int I2CBufferRemove(I2CBuffer_pT buf, I2CInstruction_ID instr)
 {
-	if (!ipt)
+	if (!buf)
+	{
+		return 0;
+	}
+	if (!instr)
 	{
 		return 0;
 	}
 	
-	return ipt->instrID;
-}
-
-int I2CInstructionPrint(I2CInstruction_pT ipt, FILE * ostream)
-{
-	size_t ind;
-
-	if (fprintf(ostream, "I_id: %lu: %s with Addr: %x; Data: ", (uint32_t)ipt->instrID, ((ipt->readWrite)?"Read":"Write"), ipt->dev_addr) < 0)
+#ifdef I2C_USE_RING_BUFFER
+	int removed = 0;
+	
+	uint8_t sreg = I2CCriticalEnter();
+	I2CInstruction_pT ipt = I2CRingLookup(buf, instr);
+	// We cannot remove the current instruction or else havoc will ensue
+	if (ipt && ipt != I2CBufferGetCurrent(buf))
 	{
-		return -1;	
+		// The ISR skips the slot when it reaches it and the producer frees it, so the ISR still only touches the head
+		ipt->flags |= I2C_INSTR_FLAG_REMOVED;
+#ifdef I2C_USE_HANDLES
+		I2CHandleFinish(ipt, I2C_STATUS_CANCELLED, 0);
+#endif
+		removed = 1;
 	}
-
-	for (ind = 0; ind < ipt->length; ind++)
+	I2CCriticalExit(sreg);
+	return removed;
+#else
+	uint8_t lane;
+	uint8_t ind;
+	I2CInstruction_pT removed = NULL;
+	
+	// Unlinking from the middle of a lane moves links the ISR follows, so this one does hold it off
+	uint8_t sreg = I2CCriticalEnter();
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS && !removed; lane++)
 	{
-		if (fprintf(ostream, "%x ", ipt->data[ind]) < 0)
+		struct I2CLane * lpt = &buf->lanes[lane];
+		I2CInstruction_pT prevPt = lpt->lastPt;
+		for (ind = 0; ind < I2CLaneCount(lpt); ind++)
 		{
-			return -1;
+			I2CInstruction_pT ipt = prevPt->nextInstr;
+			// A cancelled one is already gone as far as the caller is concerned
+			if (instr == ipt->instrID && !(ipt->flags & I2C_INSTR_FLAG_REMOVED))
+			{
+				// We cannot remove the current instruction or else havoc will ensue
+				if (!ind && lane == buf->lane)
+				{
+					break;
+				}
+				prevPt->nextInstr = ipt->nextInstr;
+				if (lpt->endPt == ipt)
+				{
+					lpt->endPt = prevPt;
+				}
+				lpt->added--;
+#ifdef I2C_USE_HANDLES
+				I2CHandleFinish(ipt, I2C_STATUS_CANCELLED, 0);
+#endif
+				removed = ipt;
+				break;
+			}
+			prevPt = ipt;
 		}
 	}
-	fputc('\n', ostream);
-	return 0;
-}
-
-I2CBuffer_pT I2CBufferNew()
-{
-	I2CBuffer_pT newBuf = malloc(sizeof(struct I2CBuffer));
+	I2CCriticalExit(sreg);
 	
-	if (!newBuf)
+	// No longer reachable by the ISR
+	if (removed)
 	{
-		return NULL;
+		I2CInstructionFree(removed);
 	}
-	newBuf->currPt = NULL;
-	newBuf->endPt = NULL;
-	newBuf->currentSize = 0;
-	return newBuf;
+	return removed != NULL;
+#endif
 }
 
-void I2CBufferFree(I2CBuffer_pT buf)
+void I2CBufferSetPriority(I2CBuffer_pT buf, uint8_t priority)
 {
 	if (!buf)
 	{
 		return;
 	}
-	
-	I2CInstruction_pT ipt = buf->currPt;
-	buf->currPt = NULL;
-	buf->endPt = NULL;
-	buf->currentSize = 0;
-	while (ipt)
+	if (priority >= I2C_PRIORITY_LEVELS)
 	{
-		I2CInstruction_pT next = ipt->nextInstr;
-		I2CInstructionFree(ipt);
-		ipt = next;
+		priority = I2C_PRIORITY_LOWEST;
 	}
-	free(buf);
+	
+	buf->addLane = priority;
 }
 
-// Moves to the next instruction
-I2CInstruction_ID I2CBufferMoveToNextInstruction(I2CBuffer_pT buf)
+#if I2C_MAX_RECURRING > 0
+
+int8_t I2CBufferAddRecurring(I2CBuffer_pT buf, int d_add, const uint8_t* wrDat, int wrLeng, uint8_t* dest, int rdLeng, uint16_t period)
 {
-	if (!buf)
-	{
-		return 0;
-	}
-	
-	cli();
-	
-	if (!buf->currPt)
-	{
-		return 0;
-	}
-	
-	buf->currentSize--;
+	int8_t ind;
 	
-	I2CInstruction_pT del = buf->currPt;
-	if (buf->endPt == buf->currPt)
+	if (!buf || !dest || rdLeng <= 0 || rdLeng > 0xFFFF || d_add < 0 || d_add > 0x7F)
 	{
-		buf->endPt = NULL;
-		buf->currPt = NULL;
+		return -1;
 	}
-	else
+	if (wrLeng < 0 || wrLeng > I2C_RECURRING_WRITE_SIZE || (wrLeng && !wrDat))
 	{
-		buf->currPt = buf->currPt->nextInstr;
+		return -1;
 	}
-	I2CInstructionFree(del);
-	
-	sei();
 	
-	// Returns the next instruction (or 0 if none)
-	if(buf->currPt)
+	for (ind = 0; ind < I2C_MAX_RECURRING; ind++)
 	{
-		return buf->currPt->instrID;
+		struct I2CRecurringSlot * rpt = &buf->recurring[ind];
+		if (rpt->active || rpt->running)
+		{
+			continue;
+		}
+		
+		// Not visible to the ISR until active is set, so a slot that fails here stays free
+		int valid;
+		if (wrLeng)
+		{
+			memcpy(rpt->wrData, wrDat, wrLeng);
+			valid = I2CInstructionInit(&rpt->instr, d_add, I2C_WRITE_READ, rpt->wrData, wrLeng, dest, rdLeng, I2C_INSTR_FLAG_BORROWED);
+		}
+		else
+		{
+			valid = I2CInstructionInit(&rpt->instr, d_add, I2C_READ, dest, rdLeng, NULL, 0, I2C_INSTR_FLAG_BORROWED);
+		}
+		if (!valid)
+		{
+			return -1;
+		}
+		rpt->instr.instrID = I2C_RECURRING_ID(ind);
+		rpt->dest = dest;
+		rpt->sampleLength = rdLeng;
+		rpt->period = period;
+		rpt->seq = 0;
+		rpt->front = 0;
+		rpt->due = I2CGetTicks();
+		rpt->active = 1;
+		return ind;
 	}
-	return 0;
-	
+	return -1;
 }
 
-int I2CBufferGetCurrentInstructionAddress(I2CBuffer_pT ibt)
+int I2CBufferStopRecurring(I2CBuffer_pT buf, int8_t handle)
 {
-	if (!ibt || !(ibt->currPt))
+	if (!buf || handle < 0 || handle >= I2C_MAX_RECURRING)
 	{
 		return 0;
 	}
 	
-	return ibt->currPt->dev_addr;
+	// A run on the bus finishes, the slot is only reused once it has
+	buf->recurring[handle].active = 0;
+	return 1;
 }
 
-int I2CBufferGetCurrentInstructionLength(I2CBuffer_pT ibt)
+uint16_t I2CBufferGetRecurringSample(I2CBuffer_pT buf, int8_t handle, uint8_t * out)
 {
-	if (!ibt || !(ibt->currPt))
+	uint16_t seq;
+	
+	if (!buf || handle < 0 || handle >= I2C_MAX_RECURRING)
 	{
 		return 0;
 	}
 	
-	return ibt->currPt->length;
+	struct I2CRecurringSlot * rpt = &buf->recurring[handle];
+	uint8_t sreg = I2CCriticalEnter();
+	seq = rpt->seq;
+	if (seq)
+	{
+		memcpy(out, rpt->dest + (rpt->front ? rpt->sampleLength : 0), rpt->sampleLength);
+	}
+	I2CCriticalExit(sreg);
+	return seq;
 }
 
-int I2CBufferSetCurrentInstructionData(I2CBuffer_pT ibt, int offset, uint8_t data)
+#endif /* I2C_MAX_RECURRING */
+
+#ifdef I2C_COALESCE_WRITES
+
+void I2CBufferSetCoalescing(I2CBuffer_pT buf, uint8_t enable)
 {
-	if (!ibt || !(ibt->currPt))
-	{
-		return 0;
-	}
-	if (offset >= ibt->currPt->length)
+	if (!buf)
 	{
-		return 0;
+		return;
 	}
-	*(ibt->currPt->data + offset) = data;
-	return 1;
+	
+	buf->coalesce = enable;
 }
 
-uint8_t I2CBufferGetCurrentInstructionData(I2CBuffer_pT ibt, int offset)
+uint16_t I2CBufferGetCoalesced(I2CBuffer_pT buf)
 {
-	if (!ibt || !(ibt->currPt))
-	{
-		return 0;
-	}
-	if (offset >= ibt->currPt->length)
+	if (!buf)
 	{
 		return 0;
 	}
-	return *(ibt->currPt->data + offset);
+	
+	return buf->coalesced;
 }
 
-int I2CBufferGetCurrentInstructionReadWrite(I2CBuffer_pT ibt)
+#endif /* I2C_COALESCE_WRITES */
+
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+
+void I2CBufferSetRetries(I2CBuffer_pT buf, uint8_t retries)
 {
-	if (!ibt || !(ibt->currPt))
+	if (!buf)
 	{
-		return 0;
+		return;
 	}
 	
-	return ibt->currPt->readWrite;
+	buf->retries = retries;
 }
 
-I2CInstruction_ID I2CBufferGetCurrentInstructionID(I2CBuffer_pT ibt)
+void I2CBufferGetRetryStats(I2CBuffer_pT buf, struct I2CRetryStats * out)
 {
-	if (!ibt || !(ibt->currPt))
+	if (!buf || !out)
 	{
-		return 0;
+		return;
 	}
 	
-	return ibt->currPt->instrID;
+	uint8_t sreg = I2CCriticalEnter();
+	*out = buf->retryStats;
+	I2CCriticalExit(sreg);
 }
 
-I2CInstruction_ID I2CBufferPushInstruction(I2CBuffer_pT buf, I2CInstruction_pT newInstr)
+#endif /* I2C_RETRY_BACKOFF */
+
+void I2CBufferSetCompletionCallback(I2CBuffer_pT buf, I2CCompletionCallback cb)
 {
-	if (!newInstr)
+	if (!buf)
 	{
-		return 0;
+		return;
 	}
-
 	
+	buf->callback = cb;
+}
 
-	if (!buf)
+uint8_t I2CBufferGetStatus(I2CBuffer_pT buf, I2CInstruction_ID instr, int * transferred)
+{
+	uint8_t ind;
+	uint8_t status = I2C_STATUS_UNKNOWN;
+	
+	if (!buf || !instr)
 	{
-		I2CInstructionFree(newInstr);
-		return 0;
+		return I2C_STATUS_UNKNOWN;
 	}
-	
-	if (buf->currentSize >= I2C_MAX_BUFFER_SIZE)
+	// Nothing was queued, it was done on the spot
+	if (instr == I2C_ID_NO_BUS)
 	{
-		I2CInstructionFree(newInstr);
-
-		return 0;
+		if (transferred)
+		{
+			*transferred = 0;
+		}
+		return I2C_STATUS_DONE;
+	}
+	if (I2CBufferContains(buf, instr))
+	{
+		return I2C_STATUS_PENDING;
 	}
 	
-	cli();
-
-	buf->currentSize++;
-	
-	if (buf->endPt)
+	uint8_t sreg = I2CCriticalEnter();
+	for (ind = 0; ind < I2C_RESULT_TABLE_SIZE; ind++)
 	{
-		buf->endPt->nextInstr = newInstr;
-		buf->endPt = buf->endPt->nextInstr;
+		if (buf->results[ind].instrID == instr)
+		{
+			status = buf->results[ind].status;
+			if (transferred)
+			{
+				*transferred = buf->results[ind].transferred;
+			}
+			break;
+		}
 	}
-	else
+	I2CCriticalExit(sreg);
+	return status;
+}
+
+void I2CBufferSettleAdd(I2CBuffer_pT buf, uint8_t status, int transferred)
+{
+	if (!buf)
 	{
-		buf->endPt = newInstr;
+		return;
 	}
 	
-	buf->endPt->nextInstr = NULL;
-	
-	if (!buf->currPt)
+	buf->addStatus = status;
+#ifdef I2C_USE_HANDLES
+	struct I2CFuture * hpt = I2CHandleTake(buf);
+	if (hpt)
 	{
-		buf->currPt = buf->endPt;
+		hpt->transferred = transferred;
+		hpt->status = status;	// Last, once transferred is in place
 	}
-	
-	sei();
-	return buf->endPt->instrID;
+#else
+	(void)transferred;
+#endif
 }
 
+uint8_t I2CBufferGetAddStatus(I2CBuffer_pT buf)
+{
+	return buf ? buf->addStatus : I2C_STATUS_INVALID;
+}
 
+#ifdef I2C_USE_HANDLES
 
-// Adds an instruction at w_ptr
-I2CInstruction_ID I2CBufferAddInstruction(I2CBuffer_pT buf, int d_add, int rw, uint8_t* dat, int leng)
+void I2CBufferSetHandle(I2CBuffer_pT buf, struct I2CFuture * handle)
 {
-	
 	if (!buf)
 	{
-		return 0;
+		return;
 	}
 	
-	I2CInstruction_pT newInstr = I2CInstructionNew(d_add, rw, dat, leng);
-	
-	if (newInstr == NULL)
+	buf->nextHandle = handle;
+	if (handle)
 	{
-		return 0;
+		handle->status = I2C_STATUS_UNKNOWN;
 	}
-	return I2CBufferPushInstruction(buf, newInstr);
-	
 }
 
-size_t I2CBufferGetCurrentSize(I2CBuffer_pT buf)
+uint8_t I2CHandlePoll(const struct I2CFuture * handle)
 {
-	if (!buf)
+	if (!handle)
 	{
-		return 0;
+		return I2C_STATUS_UNKNOWN;
 	}
-	return buf->currentSize;
+	
+	return handle->status;
 }
 
-int I2CBufferContains(I2CBuffer_pT buf, I2CInstruction_ID instr)
+uint8_t I2CHandleResult(const struct I2CFuture * handle, int * transferred)
 {
-	if (!buf)
-	{
-		return 0;
-	}
-	if (!instr)
+	if (!handle)
 	{
-		return 0;
+		return I2C_STATUS_UNKNOWN;
 	}
-	cli();
-	I2CInstruction_pT ipt = buf->currPt;
-	while (ipt != NULL)
+	
+	uint8_t status = handle->status;	// Read first, transferred is written before it
+	if (status != I2C_STATUS_PENDING && transferred)
 	{
-		if (instr == ipt->instrID)
-		{
-			sei();
-			return 1;
-		}
-		ipt = ipt->nextInstr;
+		*transferred = handle->transferred;
 	}
-	sei();
-	return 0;
+	return status;
 }
 
-int I2CBufferRemove(I2CBuffer_pT buf, I2CInstruction_ID instr)
+uint8_t I2CHandleWaitUntil(const struct I2CFuture * handle, uint16_t deadline)
 {
-	if (!buf)
+	if (!handle)
 	{
-		return 0;
+		return I2C_STATUS_UNKNOWN;
 	}
-	if (!instr)
+	
+	while (handle->status == I2C_STATUS_PENDING && (int16_t)(I2CGetTicks() - deadline) < 0)
+	{
+		I2CTask();
+	}
+	return handle->status;
+}
+
+int I2CHandleCancel(struct I2CFuture * handle)
+{
+	if (!handle)
 	{
 		return 0;
 	}
 	
-	I2CInstruction_pT ipt = buf->currPt;
-	I2CInstruction_pT lastPt = NULL;
-	while (ipt != NULL)
+	int cancelled = 0;
+	uint8_t callback = 0;
+	I2CBuffer_pT buf = handle->buf;
+	I2CInstruction_ID id = handle->id;
+	
+	// The ISR cannot finish the instruction (or move it, for a ring) while we look at it
+	uint8_t sreg = I2CCriticalEnter();
+	if (handle->status == I2C_STATUS_PENDING)
 	{
-		if (instr == ipt->instrID)
+		cancelled = 1;
+		// On the bus: the ISR ends it and reports it like any other instruction
+		if (!I2CCancelInFlight(buf, id))
 		{
-			if (lastPt == NULL)
-			{
-				// We cannot remove the current instruction or else havoc will ensue
-				return 0;
-			}
-			else
-			{
-				lastPt->nextInstr = ipt->nextInstr;
-			}
-			I2CInstructionFree(ipt);
-			return 1;
+			// Waiting: the consumer skips it when it reaches the head of its lane and the producer frees it, so
+			// nothing is unlinked and nothing is searched for
+			I2CInstruction_pT ipt = handle->instr;
+			ipt->flags |= I2C_INSTR_FLAG_REMOVED;
+			I2CBufferRecordResult(buf, ipt, I2C_STATUS_CANCELLED, 0);
+			callback = 1;
 		}
-		lastPt = ipt;
-		ipt = ipt->nextInstr;
 	}
-	return 0;
+	I2CCriticalExit(sreg);
+	
+	if (callback && buf->callback)
+	{
+		buf->callback(id, I2C_STATUS_CANCELLED, 0);
+	}
+	return cancelled;
 }
 
+#endif /* I2C_USE_HANDLES */
+
 void I2CBufferSendToBack(I2CBuffer_pT buf)
 {
 	if (!buf)
@@ -462,8 +2298,45 @@ void I2CBufferSendToBack(I2CBuffer_pT buf)
 		return;
 	}
 	
-	I2CBufferPushInstruction(buf, buf->currPt);
-	I2CBufferMoveToNextInstruction(buf);
+#if I2C_MAX_RECURRING > 0
+	// Recurring instructions come round again by themselves
+	if (buf->lane == I2C_RECURRING_LANE)
+	{
+		return;
+	}
+#endif
+	
+#ifdef I2C_USE_RING_BUFFER
+	struct I2CRing * ring = &buf->lanes[buf->lane];
+	
+	uint8_t sreg = I2CCriticalEnter();
+	I2CRingReclaim(ring);
+	if (I2CRingCount(ring))
+	{
+		// The instruction (and the data it owns) moves to the tail slot of its lane under a new ID, so the slot it
+		// leaves is given back straight away, with nothing to free
+		struct I2CInstruction moved = *I2CRingHead(ring);
+		ring->head++;
+		ring->reclaim++;
+		I2CRingPush(buf, buf->lane, &moved);
+		I2CRingSkipRemoved(ring);
+	}
+	I2CCriticalExit(sreg);
+#else
+	struct I2CLane * lpt = &buf->lanes[buf->lane];
+	
+	uint8_t sreg = I2CCriticalEnter();
+	// The node itself is relinked at the tail, so nothing is freed or copied and it keeps its ID
+	if (I2CLaneCount(lpt) > 1)
+	{
+		I2CInstruction_pT ipt = I2CLaneHead(lpt);
+		lpt->lastPt->nextInstr = ipt->nextInstr;
+		ipt->nextInstr = NULL;
+		lpt->endPt->nextInstr = ipt;
+		lpt->endPt = ipt;
+	}
+	I2CCriticalExit(sreg);
+#endif
 }
 
 int I2CBufferPrint(I2CBuffer_pT ibt, FILE * ostream)
@@ -471,24 +2344,51 @@ int I2CBufferPrint(I2CBuffer_pT ibt, FILE * ostream)
 	uint8_t TWCRCpy = TWCR;
 	TWCR &= ~(1<<TWI_INT_EN);
 
-	if (!ibt->currPt)
+	if (!I2CBufferGetCurrentSize(ibt))
 	{
 		fprintf(ostream, "Buffer is empty");
 		return 0;
 	}
 	
 
-	I2CInstruction_pT ipt = ibt->currPt;
-
 	fprintf(ostream, "Buffer Contains:\n");
 
-	while (ipt)
+	uint8_t lane;
+	for (lane = 0; lane < I2C_PRIORITY_LEVELS; lane++)
 	{
-		if (I2CInstructionPrint(ipt, ostream) < 0)
+#ifdef I2C_USE_RING_BUFFER
+		struct I2CRing * ring = &ibt->lanes[lane];
+		uint8_t ind;
+		for (ind = ring->head; ind != ring->tail; ind++)
 		{
-			return -1;
+			I2CInstruction_pT ipt = &ring->slot[ind & I2C_RING_MASK];
+			if (ipt->flags & I2C_INSTR_FLAG_REMOVED)
+			{
+				continue;
+			}
+			if (I2CInstructionPrint(ipt, ostream) < 0)
+			{
+				return -1;
+			}
+		}
+#else
+		struct I2CLane * lpt = &ibt->lanes[lane];
+		I2CInstruction_pT ipt = lpt->lastPt;
+		uint8_t ind;
+
+		for (ind = I2CLaneCount(lpt); ind; ind--)
+		{
+			ipt = ipt->nextInstr;
+			if (ipt->flags & I2C_INSTR_FLAG_REMOVED)
+			{
+				continue;
+			}
+			if (I2CInstructionPrint(ipt, ostream) < 0)
+			{
+				return -1;
+			}
 		}
-		ipt = ipt->nextInstr;
+#endif
 	}
 	fputc('\n', ostream);
 
@@ -9,29 +9,298 @@
 #ifndef I2CINSTRUCTION_H_
 #define I2CINSTRUCTION_H_
 
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
 #define I2C_MAX_BUFFER_SIZE     256
 
+/* Define I2C_USE_STATIC_POOL (globally, so every file sees the same value) to take instructions, write payloads
+ * and buffers from fixed, compile-time sized pools instead of the heap. Allocation and release are then O(1) and
+ * the library never calls malloc/free. Writes longer than I2C_POOL_PAYLOAD_SIZE (I2C_POOL_PAYLOAD_SIZE -
+ * I2C_READ_PHASE_SIZE for the write phase of a write-read) are rejected in this mode. */
+#ifdef I2C_USE_STATIC_POOL
+
+#ifndef I2C_POOL_SIZE
+#define I2C_POOL_SIZE           16      // Instruction slots shared by all buffers (max 255)
+#endif
+
+#ifndef I2C_POOL_PAYLOAD_SIZE
+#define I2C_POOL_PAYLOAD_SIZE   16      // Bytes in each payload arena block (max bytes per copied write)
+#endif
+
+#ifndef I2C_POOL_MAX_BUFFERS
+#define I2C_POOL_MAX_BUFFERS    1       // Number of I2CBuffers that can exist at once
+#endif
+
+#if I2C_POOL_SIZE > 255
+#error "I2C_POOL_SIZE must be 255 or less"
+#endif
+
+#endif /* I2C_USE_STATIC_POOL */
+
+/* Define I2C_USE_RING_BUFFER (globally) to back each I2CBuffer with a power-of-two ring of instruction descriptors
+ * instead of a linked list. IDs then encode the ring slot plus a generation count, so I2CBufferContains and
+ * I2CBufferRemove are O(1), and the ISR only ever touches the head slot. Removed instructions stay in their slot
+ * (and are counted by I2CBufferGetCurrentSize) until the head reaches them. Write payloads still come from the
+ * heap, or from the payload arena if I2C_USE_STATIC_POOL is also defined. */
+#ifdef I2C_USE_RING_BUFFER
+
+#ifndef I2C_RING_SIZE
+#define I2C_RING_SIZE           16      // Instructions per buffer; a power of two, 128 at most
+#endif
+
+#if (I2C_RING_SIZE < 2) || (I2C_RING_SIZE > 128) || (I2C_RING_SIZE & (I2C_RING_SIZE - 1))
+#error "I2C_RING_SIZE must be a power of two between 2 and 128"
+#endif
+
+#endif /* I2C_USE_RING_BUFFER */
+
+/* Each buffer has I2C_PRIORITY_LEVELS lanes, 0 being the most urgent. Whenever the driver starts a transaction it takes
+ * the oldest instruction in the most urgent lane that has one, so an instruction in lane 0 waits at most for the
+ * transaction already on the bus plus the lane 0 instructions queued before it, however much lower priority traffic
+ * is queued. New instructions go into the lane chosen with I2CBufferSetPriority (I2C_PRIORITY_LOWEST by default) */
+#ifndef I2C_PRIORITY_LEVELS
+#define I2C_PRIORITY_LEVELS     1
+#endif
+
+#define I2C_PRIORITY_HIGHEST    0
+#define I2C_PRIORITY_LOWEST     (I2C_PRIORITY_LEVELS - 1)
+
+#if (I2C_PRIORITY_LEVELS < 1) || (I2C_PRIORITY_LEVELS > 8)
+#error "I2C_PRIORITY_LEVELS must be between 1 and 8"
+#endif
+
+#if defined(I2C_USE_RING_BUFFER) && (I2C_PRIORITY_LEVELS * I2C_RING_SIZE > 256)
+#error "I2C_PRIORITY_LEVELS * I2C_RING_SIZE must be 256 or less"
+#endif
+
 #define I2C_WRITE	0
 #define I2C_READ	1
+#define I2C_WRITE_READ	2	// Write, repeated start, then read, all in one bus transaction
+
+// Completion status of an instruction (passed to the completion callback and returned by I2CBufferGetStatus)
+#define I2C_STATUS_DONE         0       // Every byte was transferred
+#define I2C_STATUS_ADDR_NACK    1       // The device did not ACK its address (absent or busy)
+#define I2C_STATUS_DATA_NACK    2       // The device NACKed a data byte before the end of a write
+#define I2C_STATUS_ARB_LOST     3       // Another master won arbitration
+#define I2C_STATUS_TIMEOUT      4       // The transaction was aborted for taking too long
+#define I2C_STATUS_BUS_ERROR    5       // The TWI reported an unexpected status
+#define I2C_STATUS_CANCELLED    6       // Cancelled through its handle before every byte was transferred (I2C_USE_HANDLES)
+#define I2C_STATUS_INVALID      7       // Refused when added, and always will be (bad address, flag, length or batch)
+#define I2C_STATUS_PENDING      0xFE    // Still queued or in progress
+#define I2C_STATUS_UNKNOWN      0xFF    // Not in the buffer and no longer (or never) in its result table
+
+/* Retries: set I2C_RETRY_BACKOFF (globally) to one of these to have instructions that end with I2C_STATUS_ADDR_NACK,
+ * I2C_STATUS_DATA_NACK or I2C_STATUS_ARB_LOST tried again, up to the count set with I2CBufferSetRetries. A failed
+ * instruction stays at the head of its lane (same storage, no copy) until it is retried, so later instructions in the
+ * lane keep their order, e.g. writes to an EEPROM that NACKs during its write cycle */
+#define I2C_RETRY_NONE          0       // No retries, the feature is left out (default)
+#define I2C_RETRY_IMMEDIATE     1       // Try again as soon as the bus is free
+#define I2C_RETRY_FIXED         2       // Try again I2C_RETRY_DELAY_TICKS ticks (see I2CTimerTick) after the failure
+#define I2C_RETRY_EXPONENTIAL   3       // Same, with the delay doubling after every failed retry
+
+#ifndef I2C_RETRY_BACKOFF
+#define I2C_RETRY_BACKOFF       I2C_RETRY_NONE
+#endif
+
+#ifndef I2C_RETRY_DELAY_TICKS
+#define I2C_RETRY_DELAY_TICKS   1       // First (or every, for I2C_RETRY_FIXED) backoff delay
+#endif
+
+#ifndef I2C_RETRY_MAX_DELAY_TICKS
+#define I2C_RETRY_MAX_DELAY_TICKS   1024    // Longest I2C_RETRY_EXPONENTIAL delay (at most 16384)
+#endif
+
+/* Define I2C_COALESCE_WRITES (globally) to have copied writes merged as they are added: a write whose first byte (an
+ * 8-bit register pointer) carries on from the register where the last write queued in the lane to the same device
+ * stops is appended to it, so START, address, pointer and STOP are paid once for the whole auto-increment burst.
+ * It only suits devices that auto-increment with 8-bit registers, so it is switched on per buffer with
+ * I2CBufferSetCoalescing, and only writes whose caller says so (both the one merged into and the one merged) take part */
+#ifndef I2C_COALESCE_MAX_LENGTH
+#ifdef I2C_USE_STATIC_POOL
+#define I2C_COALESCE_MAX_LENGTH I2C_POOL_PAYLOAD_SIZE   // A merged write must fit one payload block
+#else
+#define I2C_COALESCE_MAX_LENGTH 32      // Longest merged write, pointer included
+#endif
+#endif
+
+#if defined(I2C_USE_STATIC_POOL) && (I2C_COALESCE_MAX_LENGTH > I2C_POOL_PAYLOAD_SIZE)
+#error "I2C_COALESCE_MAX_LENGTH must be I2C_POOL_PAYLOAD_SIZE or less with I2C_USE_STATIC_POOL"
+#endif
+
+/* Recurring instructions (see I2CBufferAddRecurring). Each buffer has I2C_MAX_RECURRING resident slots; 0 leaves
+ * the feature out */
+#ifndef I2C_MAX_RECURRING
+#define I2C_MAX_RECURRING       0
+#endif
+
+#ifndef I2C_RECURRING_WRITE_SIZE
+#define I2C_RECURRING_WRITE_SIZE    2   // Bytes a recurring write-read can write (its register pointer)
+#endif
+
+#define I2C_RECURRING_ID(handle)    ((I2CInstruction_ID)(0xFF00 | (handle)))    // ID recurring runs report to the callback
+#define I2C_ID_NO_BUS   ((I2CInstruction_ID)0xFFFF)  // Returned for a request done without the bus (e.g. an I2CDevice cache hit)
+
+#ifndef I2C_RESULT_TABLE_SIZE
+#define I2C_RESULT_TABLE_SIZE   4       // Results of the most recent instructions kept by each buffer for I2CBufferGetStatus
+#endif
+
+/* Define I2C_USE_STREAMS (globally) for streaming instructions (see I2CBufferAddStream), which move any number of
+ * bytes through a small window that a callback fills or empties from the ISR */
+#ifdef I2C_USE_STREAMS
+
+/* Called from the TWI interrupt at each window boundary of a stream. For a write stream, put up to count bytes in window
+ * and return how many: fewer than count (an underrun, the producer has run dry) ends the stream after them. For a read
+ * stream, window holds the next count bytes received; return count. Keep it short, it runs in the ISR */
+typedef uint16_t (*I2CStreamCallback)(void * context, uint8_t * window, uint16_t count);
+
+/* A stream, owned by the caller. It must stay valid until its instruction has left the buffer */
+struct I2CStream
+{
+	I2CStreamCallback callback;
+	void * context;		// Passed to callback
+	uint8_t * window;	// windowSize bytes
+	uint16_t windowSize;	// At least 1
+	uint32_t length;	// Total bytes to write or read
+	uint32_t transferred;	// Bytes of the stream that crossed the bus, filled in when the instruction ends
+};
+
+#endif /* I2C_USE_STREAMS */
+
+/* I2CInstruction_ID is the memory safe way to identify I2CInstructions. IDs are 16 bits (they used to be 32), so one is
+ * handed out again after about 65000 newer instructions (or 254 newer ones in the same ring slot with
+ * I2C_USE_RING_BUFFER). 0 and 0xFF00 to 0xFFFF are never handed out: 0xFF00 | handle is I2C_RECURRING_ID(handle)
+ * and 0xFFFF is I2C_ID_NO_BUS */
+typedef uint16_t I2CInstruction_ID;
+
+#ifdef I2C_USE_HANDLES
+/* Define I2C_USE_HANDLES (globally) for handles: a future for one instruction that can be polled, waited on and
+ * cancelled in O(1), with no search of the buffer. A handle belongs to the caller (e.g. a task's state) and is armed
+ * by I2CBufferSetHandle before the add; the ISR fills in the result when the instruction leaves its buffer, and it
+ * must stay valid until then. The fields are filled in by the library, read them through the I2CHandle functions */
+struct I2CFuture
+{
+	struct I2CInstruction * instr;	// The descriptor while the instruction is pending
+	struct I2CBuffer * buf;
+	volatile int transferred;	// Bytes that crossed the bus, valid once status is no longer pending
+	I2CInstruction_ID id;
+	volatile uint8_t status;	// I2C_STATUS_PENDING, then the instruction's I2C_STATUS_ code
+};
+#endif
+
+/* Instruction descriptor, packed so that every queued instruction costs a small, predictable number of bytes (see the
+ * capacity calculator below): 10 bytes on an AVR, 8 in a ring. It is only in this header so that sizeof works: use
+ * the I2CBuffer functions, never the fields */
+typedef struct I2CInstruction
+{
+	uint8_t* data;		// Write data (followed by the read phase for an I2C_WRITE_READ), or the buffer a read fills
+#ifndef I2C_USE_RING_BUFFER
+	struct I2CInstruction * nextInstr;	// Rings find the next instruction by position
+#endif
+	uint16_t length;
+	I2CInstruction_ID instrID;
+	uint8_t addrRW;		// 7-bit address << 1, | 1 for a read (the SLA+R/W byte); a write-read is a write with a flag
+	uint8_t flags;		// I2C_INSTR_FLAG_ bits (see I2CInstruction.c)
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+	uint8_t retries;	// Retries allowed
+	uint8_t attempt;	// Retries used so far
+	uint16_t retryAt;	// Tick the next retry may start at
+#endif
+#ifdef I2C_USE_HANDLES
+	struct I2CFuture * handle;	// Told the result, NULL once it has been (or if there is none)
+#endif
+	
+}* I2CInstruction_pT;
+
+/* Capacity calculator. These are compile-time constants (sizeof), so they can size things or be checked against the
+ * SRAM left over, e.g. uint8_t depth = I2C_QUEUE_CAPACITY(512, 4). payload is the number of write bytes each
+ * instruction copies (0 for reads and NoCopy writes, plus I2C_READ_PHASE_SIZE for write-reads). Define I2C_SRAM_BUDGET (globally, in bytes) to have the build
+ * fail if the library's worst case footprint would not fit in it */
+#define I2C_DESCRIPTOR_SIZE     sizeof(struct I2CInstruction)
+
+// Payload bytes an I2C_WRITE_READ keeps after its write bytes for its read phase (buffer pointer and length), so a
+// write-read's payload is its write length plus this
+#define I2C_READ_PHASE_SIZE     (sizeof(uint8_t *) + sizeof(uint16_t))
+
+#ifndef I2C_HEAP_BLOCK_OVERHEAD
+#define I2C_HEAP_BLOCK_OVERHEAD sizeof(size_t)  // Bytes malloc keeps in front of each block (2 with avr-libc)
+#endif
+
+// Bytes one queued instruction takes: its descriptor (a ring slot, a pool slot or a heap block) plus its payload
+#if defined(I2C_USE_STATIC_POOL)
+// An arena block whatever the payload, plus its byte of the arena's free stack
+#define I2C_ENTRY_SIZE(payload)     (I2C_DESCRIPTOR_SIZE + I2C_POOL_PAYLOAD_SIZE + 1)
+#elif defined(I2C_USE_RING_BUFFER)
+#define I2C_ENTRY_SIZE(payload)     (I2C_DESCRIPTOR_SIZE + ((payload) ? (payload) + I2C_HEAP_BLOCK_OVERHEAD : 0))
+#else
+#define I2C_ENTRY_SIZE(payload)     (I2C_DESCRIPTOR_SIZE + I2C_HEAP_BLOCK_OVERHEAD + ((payload) ? (payload) + I2C_HEAP_BLOCK_OVERHEAD : 0))
+#endif
 
-/* I2CInstruction_ID is the memory safe way to identify I2CInstructions */
-typedef uint32_t I2CInstruction_ID;
+#define I2C_QUEUE_BYTES(depth, payload)     ((size_t)(depth) * I2C_ENTRY_SIZE(payload))     // SRAM depth instructions take
+#define I2C_QUEUE_CAPACITY(bytes, payload)  ((size_t)(bytes) / I2C_ENTRY_SIZE(payload))     // Instructions that fit in bytes
+
+/* Everything the driver needs to run an instruction, copied out of the buffer once when its transaction starts */
+struct I2CTransfer
+{
+	uint8_t * data;		// Write data, or the buffer a read fills
+	uint8_t * rdData;	// Read phase buffer of an I2C_WRITE_READ
+	int length;
+	int rdLength;
+	uint8_t address;
+	uint8_t readWrite;
+	uint8_t progmem;	// data is in program memory (read it with pgm_read_byte)
+#ifdef I2C_USE_STREAMS
+	struct I2CStream * stream;	// Streamed phase (the read phase of an I2C_WRITE_READ), NULL for an ordinary instruction
+#endif
+};
+
+/* One instruction of a batch for I2CBufferAddBatch */
+struct I2CBatchEntry
+{
+	const uint8_t * data;	// Write data, or the buffer a read fills
+	uint8_t * rdData;	// Read phase buffer of an I2C_WRITE_READ
+	int length;
+	int rdLength;
+	uint8_t address;
+	uint8_t readWrite;	// I2C_WRITE, I2C_READ or I2C_WRITE_READ
+	uint8_t flags;		// 0 (write data is copied), I2C_BATCH_NO_COPY or I2C_BATCH_PROGMEM
+};
+
+#define I2C_BATCH_NO_COPY       0x01    // data is borrowed, as with I2CBufferAddInstructionNoCopy (a write-read's is copied)
+#define I2C_BATCH_PROGMEM       0x02    // data is borrowed from program memory, as with I2CBufferAddInstructionNoCopy_P (ditto)
 
 /* I2CBuffer_pT is a pointer to an I2CBuffer structure */
 typedef struct I2CBuffer * I2CBuffer_pT;
 
+/* Called from the TWI interrupt when an instruction leaves its buffer. status is one of the I2C_STATUS_ codes and
+ * transferred is the number of data bytes that crossed the bus (written plus read). Keep it short, it runs in the ISR */
+typedef void (*I2CCompletionCallback)(I2CInstruction_ID id, uint8_t status, int transferred);
+
 /* I2CBuffer constructor. Returns a pointer to a new I2CBuffer or NULL is the operation failed */
 I2CBuffer_pT I2CBufferNew();
 
 /* I2CBuffer destructor. Frees all memory associated with an I2CBuffer. In all likelihood, never necessary as Buffers should last until program completion */
 void I2CBufferFree(I2CBuffer_pT buf);
 
-/* Frees the current instruction, Moves buf.currPt to the next instruction, returns the NEW buf.currPt's ID (0 if the operation failed) */
+/* Takes the current instruction off buf and moves on to the next one (from the most urgent lane), returns the NEW current
+ * instruction's ID (0 if the operation failed). Nothing is freed here: the storage is given back by the next add, so
+ * the ISR never has to touch the allocator */
 I2CInstruction_ID I2CBufferMoveToNextInstruction(I2CBuffer_pT buf);
 
+/* Records status and transferred for the current instruction, reports it to buf's completion callback (if any), then
+ * does the same as I2CBufferMoveToNextInstruction. Used by the driver when a transaction ends */
+I2CInstruction_ID I2CBufferCompleteCurrentInstruction(I2CBuffer_pT buf, uint8_t status, int transferred);
+
+/* Copies what the driver needs to run ibt->currPt into xfer, so the per-byte work never has to go back to the buffer.
+ * Returns True (1) if successful and False (0) if ibt is empty */
+int I2CBufferGetCurrentTransfer(I2CBuffer_pT ibt, struct I2CTransfer * xfer);
+
+/* Makes the oldest instruction in the most urgent non-empty lane of buf the current instruction and returns its ID
+ * (0 if buf is empty). Called by the driver before it starts a transaction, never while one is running. A recurring
+ * run, once picked, stays picked until it has been on the bus, so calling it again before the START is harmless */
+I2CInstruction_ID I2CBufferPickNext(I2CBuffer_pT buf);
+
 /* Returns the device address of ibt->currPt */
 int I2CBufferGetCurrentInstructionAddress(I2CBuffer_pT ibt);
 
@@ -45,21 +314,75 @@ uint8_t I2CBufferGetCurrentInstructionData(I2CBuffer_pT ibt, int offset);
  * Returns True (1) if successful and False (0) if the operation failed */
 int I2CBufferSetCurrentInstructionData(I2CBuffer_pT ibt, int offset, uint8_t data);
 
-/* Returns whether ibt->currPt is read or write */
+/* Returns whether ibt->currPt is read, write or write-read */
 int I2CBufferGetCurrentInstructionReadWrite(I2CBuffer_pT ibt);
 
+/* Returns the number of bytes ibt->currPt reads (its length for a read, its read phase's length for a write-read) */
+int I2CBufferGetCurrentInstructionReadLength(I2CBuffer_pT ibt);
+
+/* Stores a received byte at offset into ibt->currPt's read buffer (the read phase's buffer for a write-read)
+ * Returns True (1) if successful and False (0) if the operation failed */
+int I2CBufferSetCurrentInstructionReadData(I2CBuffer_pT ibt, int offset, uint8_t data);
+
 /* Returns ibt-currPt's ID */
 I2CInstruction_ID I2CBufferGetCurrentInstructionID(I2CBuffer_pT ibt);
 
+/* Adding never disables interrupts: the ISR only takes instructions off the front of a buffer, and each add publishes
+ * its instruction with a single byte store. So that this holds, all adds (and I2CBufferRemove/I2CBufferFree) on one
+ * buffer must come from the same context, normally the main loop; never add to a buffer from an ISR or callback */
+
 /* Adds a new instruction to the end of buf, where the new instruction has the following data
  * dev_addr = d_add
  * readWrite = rw
  * data = dat
  * length = leng
- * nextInstr = NULL */
+ * nextInstr = NULL
+ * d_add must be a 7-bit address and leng at most 65535 (what the packed descriptor holds), or 0 is returned */
 I2CInstruction_ID I2CBufferAddInstruction(I2CBuffer_pT buf, int d_add, int rw, uint8_t* dat, int leng);
 
-/* Returns buf.currentSize (See I2CBuffer struct) */
+/* Adds a copied write to the end of buf, like I2CBufferAddInstruction with I2C_WRITE, that with I2C_COALESCE_WRITES
+ * may be merged with the writes around it (see I2CBufferSetCoalescing) only if mergeable is 1: the caller says dat is
+ * an 8-bit register pointer followed by data for a device that auto-increments. I2CDevice adds its writes this way.
+ * Returns the new (or merged into) instruction's ID, or 0 if the operation failed */
+I2CInstruction_ID I2CBufferAddRegisterWrite(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng, uint8_t mergeable);
+
+/* Adds a write to the end of buf that streams straight from dat instead of copying it (zero-copy).
+ * Ownership contract: dat is only borrowed, so it must stay valid and unchanged until the instruction has left buf
+ * (I2CBufferContains(buf, id) returns 0). Use it for framebuffers and const tables that outlive the transfer.
+ * Returns the new instruction's ID, or 0 if the operation failed */
+I2CInstruction_ID I2CBufferAddInstructionNoCopy(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng);
+
+/* Same as I2CBufferAddInstructionNoCopy, but dat points into program memory (PROGMEM), so constant sequences such as
+ * display init commands never take up SRAM */
+I2CInstruction_ID I2CBufferAddInstructionNoCopy_P(I2CBuffer_pT buf, int d_add, const uint8_t* dat, int leng);
+
+/* Adds a combined transaction to the end of buf: wrLeng bytes from wrDat are written to d_add, then a repeated start
+ * (no STOP, so no other master can take the bus in between) reads rdLeng bytes into rdDat. This is the usual
+ * "write register pointer, then read N bytes" access. wrDat is copied, rdDat is filled in place.
+ * Returns the new instruction's ID, or 0 if the operation failed */
+I2CInstruction_ID I2CBufferAddWriteReadInstruction(I2CBuffer_pT buf, int d_add, uint8_t* wrDat, int wrLeng, uint8_t* rdDat, int rdLeng);
+
+#ifdef I2C_USE_STREAMS
+/* Adds a streaming instruction to the end of buf that moves stream->length bytes through stream->window, so a transfer
+ * of any size (an EEPROM dump, a framebuffer) needs no more RAM than the window. rw is I2C_WRITE (the stream is
+ * written), I2C_READ (the stream is read) or I2C_WRITE_READ (wrLeng bytes of wrDat are copied and written, then the
+ * stream is read after a repeated start, e.g. a memory address followed by the data). wrDat is ignored otherwise.
+ * stream is borrowed, see I2CBufferAddInstructionNoCopy. If the instruction fails part way, the read bytes still in
+ * the window are not passed to the callback.
+ * Returns the new instruction's ID, or 0 if the operation failed */
+I2CInstruction_ID I2CBufferAddStream(I2CBuffer_pT buf, int d_add, int rw, uint8_t* wrDat, int wrLeng, struct I2CStream * stream);
+#endif
+
+/* Adds count instructions to the end of buf (all in the same lane, in order), either all of them or none. Storage for
+ * the whole batch is taken up front and it is published to the ISR with one single byte store, so e.g. a display's
+ * init sequence is one queue update instead of one per command. Every entry is checked first (address, direction and
+ * lengths, as for the single adds), so one bad entry rejects the whole batch before anything is taken.
+ * Returns the first instruction's ID (0 if nothing was added) and stores the last one's in *lastID (if not NULL).
+ * The batch runs in order, so it has finished once I2CBufferContains(buf, *lastID) returns 0. Without
+ * I2C_USE_RING_BUFFER the IDs of a batch are consecutive numbers */
+I2CInstruction_ID I2CBufferAddBatch(I2CBuffer_pT buf, const struct I2CBatchEntry * entries, uint8_t count, I2CInstruction_ID * lastID);
+
+/* Returns the number of instructions in buf (all lanes, the current one included) */
 size_t I2CBufferGetCurrentSize(I2CBuffer_pT buf);
 
 /* Returns 1 (true) if buf contains instr, or 0 (false) if buf does not contain instr */
@@ -68,6 +391,100 @@ int I2CBufferContains(I2CBuffer_pT buf, I2CInstruction_ID instr);
 /* Removes instr from buf if buf contains instr. Returns 1 if buf contained instr, 0 otherwise */
 int I2CBufferRemove(I2CBuffer_pT buf, I2CInstruction_ID instr);
 
+#if I2C_MAX_RECURRING > 0
+/* Adds a recurring read to buf that stays resident: no allocation, ID or queueing per run. If wrLeng is not 0 it is a
+ * write-read (wrDat, up to I2C_RECURRING_WRITE_SIZE bytes, is copied), otherwise a plain read. It runs every period
+ * ticks of I2CTimerTick (0 means again as soon as each run ends), ahead of the queued instructions.
+ * dest must hold 2 * rdLeng bytes: each run fills one half while the other keeps the latest complete sample, so
+ * I2CBufferGetRecurringSample never sees a half-written sample. Runs that fail leave the latest sample alone.
+ * Returns a handle (0 to I2C_MAX_RECURRING - 1), or -1 if no slot is free or the arguments are bad (address past 0x7F,
+ * a length out of range, NULL wrDat with a wrLeng, NULL dest), in which case no slot is taken */
+int8_t I2CBufferAddRecurring(I2CBuffer_pT buf, int d_add, const uint8_t* wrDat, int wrLeng, uint8_t* dest, int rdLeng, uint16_t period);
+
+/* Stops a recurring instruction (a run on the bus right now still finishes). Returns 1 if successful, 0 otherwise */
+int I2CBufferStopRecurring(I2CBuffer_pT buf, int8_t handle);
+
+/* Copies the latest complete sample of a recurring instruction into out (rdLeng bytes) and returns how many samples
+ * it has completed so far (wrapping, never 0 after the first), or 0 if there is no sample yet (out is untouched) */
+uint16_t I2CBufferGetRecurringSample(I2CBuffer_pT buf, int8_t handle, uint8_t * out);
+#endif
+
+/* Sets the lane (I2C_PRIORITY_HIGHEST ... I2C_PRIORITY_LOWEST) that instructions added to buf from now on go into */
+void I2CBufferSetPriority(I2CBuffer_pT buf, uint8_t priority);
+
+#ifdef I2C_COALESCE_WRITES
+/* Merges copied writes added to buf from now on into the last write queued in the lane if enable is 1 (default 0).
+ * Switching it on says that every write added with I2CBufferAddInstruction may be merged; one added with
+ * I2CBufferAddRegisterWrite may be if its caller says so. The tail keeps growing while each write starts at the
+ * register just after its last one, up to I2C_COALESCE_MAX_LENGTH bytes (pointer included). A merged write returns
+ * the ID of the write it joined, which completes (one callback, one result) for all of them. Only a write that is not
+ * at the head of its lane is extended, so the ISR never sees it change; writes with a handle armed are never merged */
+void I2CBufferSetCoalescing(I2CBuffer_pT buf, uint8_t enable);
+
+/* Returns the number of writes merged into an earlier one in buf so far */
+uint16_t I2CBufferGetCoalesced(I2CBuffer_pT buf);
+#endif
+
+#if I2C_RETRY_BACKOFF != I2C_RETRY_NONE
+/* Retry counters of a buffer */
+struct I2CRetryStats
+{
+	uint32_t retries;	// Times a failed instruction was queued to be tried again
+	uint32_t recovered;	// Instructions that completed after at least one retry
+	uint32_t exhausted;	// Instructions that still failed after being retried
+};
+
+/* Sets how many times instructions added to buf from now on are retried after a NACK or lost arbitration (default 0).
+ * Streaming instructions are never retried, they cannot be rewound */
+void I2CBufferSetRetries(I2CBuffer_pT buf, uint8_t retries);
+
+/* Copies buf's retry counters into out */
+void I2CBufferGetRetryStats(I2CBuffer_pT buf, struct I2CRetryStats * out);
+#endif
+
+/* Sets the function called (from the ISR) each time an instruction in buf completes or fails. NULL disables it */
+void I2CBufferSetCompletionCallback(I2CBuffer_pT buf, I2CCompletionCallback cb);
+
+/* Returns I2C_STATUS_PENDING if buf still contains instr, otherwise its I2C_STATUS_ code from buf's result table
+ * (I2C_STATUS_UNKNOWN if it has been pushed out). If transferred is not NULL, it receives the byte count */
+uint8_t I2CBufferGetStatus(I2CBuffer_pT buf, I2CInstruction_ID instr, int * transferred);
+
+/* Returns why the last add to buf returned 0: I2C_STATUS_UNKNOWN if there was no room (try it again later),
+ * I2C_STATUS_INVALID if it can never be added (bad address, read/write flag, length, stream or batch) */
+uint8_t I2CBufferGetAddStatus(I2CBuffer_pT buf);
+
+/* Ends a request that a layer on top of buf answers without adding anything (e.g. from a cache, status
+ * I2C_STATUS_DONE) or refuses before its add (I2C_STATUS_INVALID, or I2C_STATUS_UNKNOWN if it may be tried again).
+ * status is what I2CBufferGetAddStatus reports; with I2C_USE_HANDLES the handle armed for buf's next add (if any) gets
+ * status and transferred straight away and is disarmed, so it is not left for whatever is added next */
+void I2CBufferSettleAdd(I2CBuffer_pT buf, uint8_t status, int transferred);
+
+#ifdef I2C_USE_HANDLES
+/* Arms handle for the next instruction added to buf (by any of the add functions; for I2CBufferAddBatch, the batch's
+ * last instruction). Its status is I2C_STATUS_PENDING once the add succeeds; if it fails, I2C_STATUS_INVALID or
+ * I2C_STATUS_UNKNOWN as I2CBufferGetAddStatus says. Either way the add disarms it */
+void I2CBufferSetHandle(I2CBuffer_pT buf, struct I2CFuture * handle);
+
+/* Returns handle's status: I2C_STATUS_PENDING while its instruction is queued or on the bus, then its I2C_STATUS_ code.
+ * Reads one byte, so it is cheap enough to poll from every pass of a scheduler */
+uint8_t I2CHandlePoll(const struct I2CFuture * handle);
+
+/* Same as I2CHandlePoll, and once the instruction has finished stores the number of bytes that crossed the bus in
+ * *transferred (if not NULL) */
+uint8_t I2CHandleResult(const struct I2CFuture * handle, int * transferred);
+
+/* Runs I2CTask until handle's instruction has finished or the tick count (see I2CTimerTick) reaches deadline, then
+ * returns its status (I2C_STATUS_PENDING if the deadline came first). Blocks, so not for use from a cooperative task */
+uint8_t I2CHandleWaitUntil(const struct I2CFuture * handle, uint16_t deadline);
+
+/* Cancels handle's instruction. One still waiting in its buffer ends straight away (its status, result and callback say
+ * I2C_STATUS_CANCELLED, and it never reaches the bus). One on the bus is ended by the ISR at the next byte boundary,
+ * with a STOP (a read NACKs one more byte first), and reports I2C_STATUS_CANCELLED unless it had already moved every
+ * byte; poll the handle to see when. Safe against the ISR, but call it from the same context as the adds.
+ * Returns 1 if the instruction was cancelled (or will be), 0 if it had already finished */
+int I2CHandleCancel(struct I2CFuture * handle);
+#endif
+
 /* Moves the current value of buf.currPt to buf.endPt and sets buf.currPt to the next instruction */
 void I2CBufferSendToBack(I2CBuffer_pT buf);
 
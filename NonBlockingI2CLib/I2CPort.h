@@ -0,0 +1,126 @@
+/*
+ * I2CPort.h
+ *
+ * Register abstraction layer. On an AVR this just pulls in the avr-libc headers. Define I2C_HOST_SIM (globally) to
+ * build the library on a normal computer instead: the TWI registers, the interrupt macros and pgm_read_byte are then
+ * mapped onto the simulated TWI peripheral in I2CSim.h/.c
+ */
+
+
+#ifndef I2C_PORT_H_
+#define I2C_PORT_H_
+
+#ifdef I2C_HOST_SIM
+
+#include <stdint.h>
+
+#include "I2CSim.h"
+
+// TWI registers
+#define TWCR    (g_i2cSimRegs.twcr)
+#define TWSR    (g_i2cSimRegs.twsr)
+#define TWDR    (g_i2cSimRegs.twdr)
+#define TWBR    (g_i2cSimRegs.twbr)
+#define TWAR    (g_i2cSimRegs.twar)
+#define TWAMR   (g_i2cSimRegs.twamr)
+
+// TWCR bits
+#define TWINT   7
+#define TWEA    6
+#define TWSTA   5
+#define TWSTO   4
+#define TWWC    3
+#define TWEN    2
+#define TWIE    0
+
+// TWSR bits
+#define TWPS1   1
+#define TWPS0   0
+
+// TWAR bits
+#define TWGCE   0
+
+// Interrupts
+#define ISR(vector)         void vector(void)
+#define cli()               I2CSimCli()
+#define sei()               I2CSimSei()
+#define I2CCriticalEnter()      I2CSimCriticalEnter()
+#define I2CCriticalExit(sreg)   I2CSimCriticalExit(sreg)
+
+// Program memory is ordinary memory on the host
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+// Bus lines, driven by hand for the bus clear and read for the bus-busy check
+#define I2C_SCL_LOW()       I2CSimDriveScl(0)
+#define I2C_SCL_RELEASE()   I2CSimDriveScl(1)
+#define I2C_SDA_LOW()       I2CSimDriveSda(0)
+#define I2C_SDA_RELEASE()   I2CSimDriveSda(1)
+#define I2C_SDA_READ()      I2CSimReadSda()
+#define I2C_SCL_READ()      I2CSimReadScl()
+#define _delay_us(us)       I2CSimDelayUs(us)
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Critical sections that put the interrupt flag back the way they found it, so they nest and can be entered with
+ * interrupts already off (e.g. from the ISR or a caller's own critical section):
+ *     uint8_t sreg = I2CCriticalEnter();
+ *     ...
+ *     I2CCriticalExit(sreg); */
+static inline uint8_t I2CCriticalEnter(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    return sreg;
+}
+
+static inline void I2CCriticalExit(uint8_t sreg)
+{
+    SREG = sreg;
+}
+
+/* Bus lines, driven by hand for the bus clear (only with I2C_TIMEOUT_TICKS) and read for the bus-busy check (only with
+ * I2C_MULTI_MASTER). They are open drain: low drives the line, release leaves it to the pull-up. Only needed when one
+ * of those is compiled in, so any AVR with a TWI builds without them. The TWI pins are known for the ATmega32u4
+ * (SCL = PD0, SDA = PD1) and the ATmega328P (SCL = PC5, SDA = PC4); for any other part define I2C_LINES_DDR,
+ * I2C_LINES_PORT, I2C_LINES_PIN, I2C_SCL_BIT and I2C_SDA_BIT (globally). I2C_TIMEOUT_TICKS is only set on the command
+ * line here (I2CDriver.h defaults it to 0 later), so undefined counts as 0 */
+#if (defined(I2C_TIMEOUT_TICKS) && I2C_TIMEOUT_TICKS > 0) || defined(I2C_MULTI_MASTER)
+#ifndef I2C_LINES_DDR
+#if defined(__AVR_ATmega32U4__)
+#define I2C_LINES_DDR       DDRD
+#define I2C_LINES_PORT      PORTD
+#define I2C_LINES_PIN       PIND
+#define I2C_SCL_BIT         0
+#define I2C_SDA_BIT         1
+#elif defined(__AVR_ATmega328P__)
+#define I2C_LINES_DDR       DDRC
+#define I2C_LINES_PORT      PORTC
+#define I2C_LINES_PIN       PINC
+#define I2C_SCL_BIT         5
+#define I2C_SDA_BIT         4
+#else
+#error "TWI pins unknown for this MCU: define I2C_LINES_DDR, I2C_LINES_PORT, I2C_LINES_PIN, I2C_SCL_BIT and I2C_SDA_BIT"
+#endif
+#endif
+
+#define I2C_SCL_LOW()       (I2C_LINES_PORT &= ~(1 << I2C_SCL_BIT), I2C_LINES_DDR |= (1 << I2C_SCL_BIT))
+#define I2C_SCL_RELEASE()   (I2C_LINES_DDR &= ~(1 << I2C_SCL_BIT))
+#define I2C_SDA_LOW()       (I2C_LINES_PORT &= ~(1 << I2C_SDA_BIT), I2C_LINES_DDR |= (1 << I2C_SDA_BIT))
+#define I2C_SDA_RELEASE()   (I2C_LINES_DDR &= ~(1 << I2C_SDA_BIT))
+#define I2C_SDA_READ()      ((I2C_LINES_PIN >> I2C_SDA_BIT) & 1)
+#define I2C_SCL_READ()      ((I2C_LINES_PIN >> I2C_SCL_BIT) & 1)
+#endif /* I2C_TIMEOUT_TICKS > 0 || I2C_MULTI_MASTER */
+
+#endif /* I2C_HOST_SIM */
+
+/* Compiler memory barrier: no memory access is moved across it. The lock-free queues publish with a single byte store
+ * of a counter, so the producer puts one before that store and the consumer one between loading the counter and
+ * touching the slot it guards. AVR has no out-of-order memory, so this is all the ordering they need */
+#define I2CCompilerBarrier()    __asm__ __volatile__("" ::: "memory")
+
+#endif /* I2C_PORT_H_ */
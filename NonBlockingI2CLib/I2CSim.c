@@ -0,0 +1,579 @@
+/*
+ * I2CSim.c
+ *
+ * Simulated TWI peripheral for host builds (I2C_HOST_SIM), see I2CSim.h
+ */
+
+#ifdef I2C_HOST_SIM
+
+// Other includes
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CSim.h"
+
+// Where the master is in the current transaction
+#define SIM_PHASE_IDLE      0   // No transaction (or the bus belongs to another master)
+#define SIM_PHASE_ADDRESS   1   // A start has been sent, the next byte is an address
+#define SIM_PHASE_WRITE     2   // Addressed a device for writing
+#define SIM_PHASE_READ      3   // Addressed a device for reading
+#define SIM_PHASE_NO_DEVICE 4   // The address was NACKed, waiting for a stop or start
+
+struct I2CSimRegs g_i2cSimRegs;
+
+static struct I2CSimDevice g_s_devices[I2C_SIM_MAX_DEVICES];
+static uint8_t g_s_deviceCount = 0;
+
+static struct I2CSimStats g_s_stats;
+
+static uint8_t g_s_intEnabled = 1;      // The global interrupt flag (I bit in SREG)
+static uint8_t g_s_intPending = 0;      // TWINT is set and the ISR has not run yet
+static uint8_t g_s_busOwned = 0;        // We are the bus master right now
+static uint8_t g_s_phase = SIM_PHASE_IDLE;
+static struct I2CSimDevice * g_s_curDev = NULL;
+static uint16_t g_s_writeIndex = 0;     // Data bytes written to g_s_curDev in this transaction
+static unsigned long g_s_arbCountdown = 0;
+static uint8_t g_s_sclDriven = 0;       // SCL is being driven low by hand
+static uint8_t g_s_sdaDriven = 0;       // SDA is being driven low by hand
+static unsigned long g_s_otherSteps = 0;    // Steps another master still has the bus for
+
+// Returns the CPU cycles in one SCL period for the current TWBR and prescaler
+static unsigned long bitCycles()
+{
+    static const uint8_t prescalers[] = {1, 4, 16, 64};
+    return (16 + 2UL * TWBR * prescalers[TWSR & 0x03]);
+}
+
+// Returns the device at address, or NULL if none answers to it
+static struct I2CSimDevice * findDevice(uint8_t address)
+{
+    uint8_t ind;
+    for (ind = 0; ind < g_s_deviceCount; ind++)
+    {
+        if (g_s_devices[ind].address == address)
+        {
+            return &g_s_devices[ind];
+        }
+    }
+    return NULL;
+}
+
+// Returns 1 if arbitration is lost on the byte being sent now, in which case the winner takes the bus
+static int arbitrationLost()
+{
+    if (!g_s_arbCountdown)
+    {
+        return 0;
+    }
+    g_s_arbCountdown--;
+    if (g_s_arbCountdown)
+    {
+        return 0;
+    }
+    g_s_otherSteps = I2C_SIM_ARB_WINNER_STEPS;
+    return 1;
+}
+
+// Sets TWSR to status (keeping the prescaler bits) and flags the interrupt
+static void raise(uint8_t status)
+{
+    TWSR = status | (TWSR & 0x03);
+    g_s_intPending = 1;
+}
+
+// The address byte in TWDR has been sent
+static void sendAddress()
+{
+    uint8_t address = TWDR >> 1;
+    uint8_t read = TWDR & 1;
+
+    g_s_stats.addrBytes++;
+    g_s_stats.busCycles += 9 * bitCycles();
+
+    if (arbitrationLost())
+    {
+        g_s_stats.arbLosses++;
+        g_s_busOwned = 0;
+        g_s_phase = SIM_PHASE_IDLE;
+        raise(ARB_LOST);
+        return;
+    }
+
+    g_s_curDev = findDevice(address);
+    if (g_s_curDev && g_s_curDev->nackAddrCount)
+    {
+        g_s_curDev->nackAddrCount--;
+        g_s_curDev = NULL;
+    }
+    if (!g_s_curDev)
+    {
+        g_s_stats.addrNacks++;
+        g_s_phase = SIM_PHASE_NO_DEVICE;
+        raise(read ? SLA_R_TRA_NACK_REC : SLA_W_TRA_NACK_REC);
+        return;
+    }
+
+    g_s_stats.busCycles += g_s_curDev->stretchBits * bitCycles();
+    g_s_writeIndex = 0;
+    g_s_phase = read ? SIM_PHASE_READ : SIM_PHASE_WRITE;
+    raise(read ? SLA_R_TRA_ACK_REC : SLA_W_TRA_ACK_REC);
+}
+
+// The data byte in TWDR has been sent to g_s_curDev
+static void sendData()
+{
+    struct I2CSimDevice * dev = g_s_curDev;
+
+    g_s_stats.busCycles += 9 * bitCycles();
+
+    if (arbitrationLost())
+    {
+        g_s_stats.arbLosses++;
+        g_s_busOwned = 0;
+        g_s_phase = SIM_PHASE_IDLE;
+        raise(ARB_LOST);
+        return;
+    }
+
+    g_s_stats.bytesWritten++;
+    if (g_s_writeIndex == dev->nackWriteAt)
+    {
+        g_s_stats.dataNacks++;
+        g_s_writeIndex++;
+        raise(DATA_TRA_NACK_REC);
+        return;
+    }
+
+    g_s_stats.busCycles += dev->stretchBits * bitCycles();
+    if (dev->memSize)
+    {
+        if (!g_s_writeIndex)
+        {
+            dev->pointer = TWDR % dev->memSize;
+        }
+        else
+        {
+            dev->mem[dev->pointer] = TWDR;
+            dev->pointer = (dev->pointer + 1) % dev->memSize;
+        }
+    }
+    g_s_writeIndex++;
+    raise(DATA_TRA_ACK_REC);
+}
+
+// g_s_curDev sends a byte, which the master ACKs if ack is set
+static void receiveData(uint8_t ack)
+{
+    struct I2CSimDevice * dev = g_s_curDev;
+
+    g_s_stats.busCycles += (9 + dev->stretchBits) * bitCycles();
+    g_s_stats.bytesRead++;
+
+    if (dev->memSize)
+    {
+        TWDR = dev->mem[dev->pointer];
+        dev->pointer = (dev->pointer + 1) % dev->memSize;
+    }
+    else
+    {
+        TWDR = 0xFF;    // Nothing drives SDA
+    }
+    raise(ack ? DATA_REC_ACK_TRA : DATA_REC_NACK_TRA);
+}
+
+void I2CSimReset(void)
+{
+    memset(&g_i2cSimRegs, 0, sizeof(g_i2cSimRegs));
+    memset(g_s_devices, 0, sizeof(g_s_devices));
+    memset(&g_s_stats, 0, sizeof(g_s_stats));
+    g_s_deviceCount = 0;
+    g_s_intEnabled = 1;
+    g_s_intPending = 0;
+    g_s_busOwned = 0;
+    g_s_phase = SIM_PHASE_IDLE;
+    g_s_curDev = NULL;
+    g_s_writeIndex = 0;
+    g_s_arbCountdown = 0;
+    g_s_sclDriven = 0;
+    g_s_sdaDriven = 0;
+    g_s_otherSteps = 0;
+}
+
+struct I2CSimDevice * I2CSimAddDevice(uint8_t address, uint8_t * mem, uint16_t memSize)
+{
+    if (g_s_deviceCount >= I2C_SIM_MAX_DEVICES)
+    {
+        return NULL;
+    }
+
+    struct I2CSimDevice * dev = &g_s_devices[g_s_deviceCount];
+    g_s_deviceCount++;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->address = address;
+    dev->mem = mem;
+    dev->memSize = mem ? memSize : 0;
+    dev->nackWriteAt = I2C_SIM_NO_NACK;
+    return dev;
+}
+
+void I2CSimLoseArbitrationAfter(unsigned long byteCount)
+{
+    g_s_arbCountdown = byteCount;
+}
+
+void I2CSimBusBusyFor(unsigned long steps)
+{
+    g_s_otherSteps = steps;
+}
+
+// Carries out the action requested by the last TWCR write. Returns 1 if there was one
+static int takeAction()
+{
+    uint8_t cr = TWCR;
+
+    // Writing a 1 to TWINT is what starts the next action. Here the bit stays set until the action has been taken
+    if (!(cr & (1 << TWINT)) || !(cr & (1 << TWEN)))
+    {
+        return 0;
+    }
+    // A device holding SCL low forever stops the peripheral in its tracks
+    if (g_s_curDev && g_s_curDev->stretchBits == I2C_SIM_STRETCH_FOREVER && g_s_phase != SIM_PHASE_IDLE)
+    {
+        return 0;
+    }
+    TWCR = cr & ~(1 << TWINT);
+
+    if (cr & (1 << TWSTO))
+    {
+        if (g_s_busOwned)
+        {
+            g_s_stats.stops++;
+            g_s_stats.busCycles += bitCycles();
+        }
+        g_s_busOwned = 0;
+        g_s_phase = SIM_PHASE_IDLE;
+        g_s_curDev = NULL;
+        // A stop on its own raises no interrupt
+        if (!(cr & (1 << TWSTA)))
+        {
+            return 1;
+        }
+    }
+
+    if (cr & (1 << TWSTA))
+    {
+        // The TWI waits for a free bus, which it never gets while a device holds SDA low
+        if (!I2CSimReadSda())
+        {
+            TWCR = cr & ~(1 << TWSTO);  // Still waiting to send the START
+            return 0;
+        }
+        g_s_stats.starts++;
+        g_s_stats.busCycles += bitCycles();
+        raise(g_s_busOwned ? REP_START_TRA : START_TRA);
+        g_s_busOwned = 1;
+        g_s_phase = SIM_PHASE_ADDRESS;
+        g_s_curDev = NULL;
+        return 1;
+    }
+
+    switch (g_s_phase)
+    {
+        case SIM_PHASE_ADDRESS:
+            sendAddress();
+            break;
+        case SIM_PHASE_WRITE:
+            sendData();
+            break;
+        case SIM_PHASE_READ:
+            receiveData(cr & (1 << TWEA));
+            break;
+        default:
+            // Nothing on the bus to talk to, the action is dropped
+            break;
+    }
+    return 1;
+}
+
+int I2CSimStep(void)
+{
+    // Deliver the interrupt for the last event first, as the real TWI would
+    if (g_s_intPending)
+    {
+        if (!g_s_intEnabled || !(TWCR & (1 << TWIE)))
+        {
+            return 0;
+        }
+        g_s_intPending = 0;
+        g_s_stats.interrupts++;
+        g_s_intEnabled = 0;     // Cleared on ISR entry...
+        TWI_vect();
+        g_s_intEnabled = 1;     // ...and set again by RETI
+
+        // A stop goes out as soon as TWINT is cleared, before the main loop can write TWCR again
+        if ((TWCR & (1 << TWINT)) && (TWCR & (1 << TWSTO)))
+        {
+            takeAction();
+        }
+        return 1;
+    }
+    // Another master has the bus: its transfer goes on, and a START of ours waits for its STOP
+    if (g_s_otherSteps)
+    {
+        g_s_otherSteps--;
+        g_s_stats.busCycles += 9 * bitCycles();
+        return 1;
+    }
+    return takeAction();
+}
+
+unsigned long I2CSimRunUntilIdle(unsigned long maxSteps)
+{
+    unsigned long steps = 0;
+    uint8_t idle = 0;
+
+    while (steps < maxSteps && idle < I2C_SIM_IDLE_PASSES)
+    {
+        I2CTask();
+        if (!I2CSimStep())
+        {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        steps++;
+    }
+    return steps;
+}
+
+const struct I2CSimStats * I2CSimGetStats(void)
+{
+    return &g_s_stats;
+}
+
+// The port has taken the pins, so the TWI's transaction is gone
+static void dropTransaction()
+{
+    g_s_busOwned = 0;
+    g_s_phase = SIM_PHASE_IDLE;
+    g_s_curDev = NULL;
+    g_s_intPending = 0;
+}
+
+void I2CSimDriveScl(uint8_t level)
+{
+    uint8_t ind;
+    
+    dropTransaction();
+    // Each rising edge clocks a stuck device one bit further
+    if (level && g_s_sclDriven)
+    {
+        g_s_stats.sclPulses++;
+        for (ind = 0; ind < g_s_deviceCount; ind++)
+        {
+            if (g_s_devices[ind].sdaStuckClocks)
+            {
+                g_s_devices[ind].sdaStuckClocks--;
+            }
+        }
+    }
+    g_s_sclDriven = !level;
+}
+
+void I2CSimDriveSda(uint8_t level)
+{
+    dropTransaction();
+    g_s_sdaDriven = !level;
+}
+
+uint8_t I2CSimReadSda(void)
+{
+    uint8_t ind;
+    
+    if (g_s_sdaDriven)
+    {
+        return 0;
+    }
+    for (ind = 0; ind < g_s_deviceCount; ind++)
+    {
+        if (g_s_devices[ind].sdaStuckClocks)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint8_t I2CSimReadScl(void)
+{
+    return !g_s_sclDriven && !g_s_otherSteps;
+}
+
+void I2CSimDelayUs(unsigned int us)
+{
+    g_s_stats.busCycles += us * (F_CPU / 1000000UL);
+    if (!g_s_intEnabled)
+    {
+        g_s_stats.maskedCycles += us * (F_CPU / 1000000UL);
+    }
+}
+
+// Returns 1 if the TWI answers to address (0 being the general call)
+static int slaveAddressed(uint8_t address)
+{
+    if (!(TWCR & (1 << TWEN)) || !(TWCR & (1 << TWEA)))
+    {
+        return 0;
+    }
+    if (!address)
+    {
+        return TWAR & (1 << TWGCE);
+    }
+    return (TWAR >> 1) == address;
+}
+
+// Runs the ISR for a slave event, as the TWI would, and takes the action it asks for
+static void slaveEvent(uint8_t status)
+{
+    TWSR = status | (TWSR & 0x03);
+    g_s_stats.interrupts++;
+    g_s_intEnabled = 0;
+    TWI_vect();
+    g_s_intEnabled = 1;
+    TWCR &= ~(1 << TWINT);
+}
+
+// The other master sends its START and address. Returns 1 if the TWI was addressed, with status (or its arbitration
+// lost form if our own master had the bus) raised
+static int otherMasterAddress(uint8_t address, uint8_t status, uint8_t arbStatus)
+{
+    g_s_stats.busCycles += 10 * bitCycles();
+    if (!slaveAddressed(address))
+    {
+        return 0;
+    }
+    // Our own transaction loses arbitration to the address
+    if (g_s_busOwned)
+    {
+        g_s_stats.arbLosses++;
+        g_s_busOwned = 0;
+        g_s_phase = SIM_PHASE_IDLE;
+        g_s_curDev = NULL;
+        g_s_intPending = 0;
+        status = arbStatus;
+    }
+    slaveEvent(status);
+    return 1;
+}
+
+// The other master writes len bytes to address, then sends its STOP if stop is set
+static int otherMasterWrite(uint8_t address, const uint8_t * data, int len, uint8_t stop)
+{
+    int ind;
+    uint8_t gc = !address;
+
+    if (!otherMasterAddress(address, gc ? GEN_CALL_ACK_TRA : SLA_W_REC_ACK_TRA, gc ? ARB_LOST_GEN_CALL_ACK_TRA : ARB_LOST_SLA_W_REC_ACK_TRA))
+    {
+        return -1;
+    }
+    for (ind = 0; ind < len; ind++)
+    {
+        uint8_t ack = TWCR & (1 << TWEA);
+        g_s_stats.busCycles += 9 * bitCycles();
+        TWDR = data[ind];
+        if (!ack)
+        {
+            // NACKed, so the TWI has left the transaction and the other master stops
+            slaveEvent(gc ? GEN_CALL_DATA_REC_NACK_TRA : SLA_W_DATA_REC_NACK_TRA);
+            return ind;
+        }
+        slaveEvent(gc ? GEN_CALL_DATA_REC_ACK_TRA : SLA_W_DATA_REC_ACK_TRA);
+    }
+    if (stop)
+    {
+        slaveEvent(STOP_OR_REP_START_REC);
+    }
+    return len;
+}
+
+int I2CSimMasterWrite(uint8_t address, const uint8_t * data, int len)
+{
+    return otherMasterWrite(address, data, len, 1);
+}
+
+int I2CSimMasterWriteNoStop(uint8_t address, const uint8_t * data, int len)
+{
+    return otherMasterWrite(address, data, len, 0);
+}
+
+void I2CSimBusError(void)
+{
+    g_s_busOwned = 0;
+    g_s_phase = SIM_PHASE_IDLE;
+    g_s_curDev = NULL;
+    g_s_intPending = 0;
+    slaveEvent(BUS_ERROR);      // Not only for slaves: runs the ISR for the event there and then
+}
+
+int I2CSimMasterRead(uint8_t address, uint8_t * out, int len)
+{
+    int ind;
+    uint8_t more;
+
+    if (!otherMasterAddress(address, SLA_R_REC_ACK_TRA, ARB_LOST_SLA_R_REC_ACK_TRA))
+    {
+        return -1;
+    }
+    for (ind = 0; ind < len; ind++)
+    {
+        g_s_stats.busCycles += 9 * bitCycles();
+        out[ind] = TWDR;
+        more = TWCR & (1 << TWEA);
+        if (ind + 1 == len)
+        {
+            slaveEvent(SLA_DATA_TRA_NACK_REC);     // The other master NACKs its last byte
+        }
+        else if (!more)
+        {
+            slaveEvent(LAST_DATA_TRA_ACK_REC);     // It wants more than the slave has, the rest reads as 0xFF
+            for (ind++; ind < len; ind++)
+            {
+                out[ind] = 0xFF;
+            }
+        }
+        else
+        {
+            slaveEvent(SLA_DATA_TRA_ACK_REC);
+        }
+    }
+    return len;
+}
+
+void I2CSimCli(void)
+{
+    g_s_intEnabled = 0;
+}
+
+void I2CSimSei(void)
+{
+    g_s_intEnabled = 1;
+}
+
+uint8_t I2CSimCriticalEnter(void)
+{
+    uint8_t sreg = g_s_intEnabled;
+    g_s_intEnabled = 0;
+    return sreg;
+}
+
+void I2CSimCriticalExit(uint8_t sreg)
+{
+    g_s_intEnabled = sreg;
+}
+
+#endif /* I2C_HOST_SIM */
@@ -0,0 +1,148 @@
+/*
+ * I2CSim.h
+ *
+ * Simulated TWI peripheral and slave devices for host builds (I2C_HOST_SIM). The driver talks to the simulated
+ * registers through I2CPort.h exactly as it would to the real TWI, and I2CSimStep plays the part of the hardware:
+ * it carries out whatever the last TWCR write asked for, updates TWSR/TWDR and calls the TWI_vect ISR.
+ */
+
+
+#ifndef I2C_SIM_H_
+#define I2C_SIM_H_
+
+#ifdef I2C_HOST_SIM
+
+#include <stdint.h>
+
+#ifndef I2C_SIM_MAX_DEVICES
+#define I2C_SIM_MAX_DEVICES         4       // Simulated slaves that can be on the bus at once
+#endif
+
+#ifndef I2C_SIM_ARB_WINNER_STEPS
+#define I2C_SIM_ARB_WINNER_STEPS    8       // Steps the master that wins arbitration keeps the bus for
+#endif
+
+#ifndef I2C_SIM_IDLE_PASSES
+#define I2C_SIM_IDLE_PASSES         4       // I2CTask calls with nothing happening before I2CSimRunUntilIdle gives up
+#endif
+
+#define I2C_SIM_NO_NACK             0xFFFF  // I2CSimDevice.nackWriteAt value for a device that ACKs every written byte
+#define I2C_SIM_STRETCH_FOREVER     0xFFFF  // I2CSimDevice.stretchBits value for a device that never lets go of SCL
+
+/* Simulated TWI registers (what TWCR, TWSR, ... expand to in a host build) */
+struct I2CSimRegs
+{
+    volatile uint8_t twcr;
+    volatile uint8_t twsr;
+    volatile uint8_t twdr;
+    volatile uint8_t twbr;
+    volatile uint8_t twar;
+    volatile uint8_t twamr;
+};
+
+extern struct I2CSimRegs g_i2cSimRegs;
+
+/* A simulated slave with a register map: the first byte of each write sets the register pointer, later bytes are
+ * stored from there and reads come from there, with the pointer auto-incrementing (wrapping at memSize).
+ * The remaining fields script its behaviour and may be changed at any time */
+struct I2CSimDevice
+{
+    uint8_t address;            // 7-bit address
+    uint8_t * mem;              // Register map (owned by the caller)
+    uint16_t memSize;
+    uint16_t pointer;           // Current register pointer
+    uint16_t nackAddrCount;     // NACK this many upcoming address phases (e.g. an EEPROM busy writing), then ACK
+    uint16_t nackWriteAt;       // NACK the written data byte with this index in each transaction (I2C_SIM_NO_NACK for none)
+    uint16_t stretchBits;       // Extra bit times the device stretches the clock by on every byte it ACKs or sends
+    uint16_t sdaStuckClocks;    // Holds SDA low (so no START can be sent) until SCL has been clocked this many times
+};
+
+/* Bus statistics, for tests and for benchmarking cycles per byte */
+struct I2CSimStats
+{
+    unsigned long starts;       // Starts and repeated starts
+    unsigned long stops;
+    unsigned long addrBytes;    // Address bytes sent (whether ACKed or not)
+    unsigned long bytesWritten; // Data bytes written
+    unsigned long bytesRead;    // Data bytes read
+    unsigned long addrNacks;
+    unsigned long dataNacks;
+    unsigned long arbLosses;
+    unsigned long interrupts;   // Times TWI_vect was called
+    unsigned long busCycles;    // CPU cycles of bus time (derived from TWBR/TWPS and clock stretching)
+    unsigned long sclPulses;    // SCL clocks driven by hand (bus clear)
+    unsigned long maskedCycles; // CPU cycles busy-waited (I2CSimDelayUs) with interrupts disabled
+};
+
+/* The TWI interrupt handler (defined by I2CDriver.c through ISR(TWI_vect)) */
+void TWI_vect(void);
+
+/* Resets the registers, removes every device and clears the statistics */
+void I2CSimReset(void);
+
+/* Puts a device at address on the bus, backed by mem. Returns it (so its script fields can be set) or NULL if full */
+struct I2CSimDevice * I2CSimAddDevice(uint8_t address, uint8_t * mem, uint16_t memSize);
+
+/* Makes the master lose arbitration when it sends its byteCount-th byte (address or data, counting from 1) from now.
+ * 0 cancels a pending loss */
+void I2CSimLoseArbitrationAfter(unsigned long byteCount);
+
+/* Another master has the bus for the next steps calls of I2CSimStep: SCL reads low and a START waits until it is done.
+ * Losing arbitration (see I2CSimLoseArbitrationAfter) also hands the bus to the winner for I2C_SIM_ARB_WINNER_STEPS */
+void I2CSimBusBusyFor(unsigned long steps);
+
+/* Plays another master on the bus that writes len bytes of data to address (0 for a general call), for testing the
+ * slave engine (I2C_SLAVE). If our own master is in the middle of a transaction it loses arbitration to it.
+ * Runs the ISR for every event straight away. Returns the number of data bytes ACKed, or -1 if the address was not */
+int I2CSimMasterWrite(uint8_t address, const uint8_t * data, int len);
+
+/* Same, but the other master leaves the transaction without a STOP or repeated start (it was reset, or gave up), so
+ * the slave engine is still addressed afterwards */
+int I2CSimMasterWriteNoStop(uint8_t address, const uint8_t * data, int len);
+
+/* An illegal START or STOP on the bus (a glitch): whatever transaction we were in, as master or slave, is lost, and the
+ * TWI reports a bus error (status 0x00). Runs the ISR for it straight away */
+void I2CSimBusError(void);
+
+/* Same as I2CSimMasterWrite, but the other master reads len bytes from address into out. Returns len, or -1 if the
+ * address was not ACKed */
+int I2CSimMasterRead(uint8_t address, uint8_t * out, int len);
+
+/* Carries out one bus event: delivers a pending interrupt if interrupts are enabled, otherwise performs the action
+ * requested by the last TWCR write. Returns 1 if something happened, 0 if the peripheral is idle or stuck */
+int I2CSimStep(void);
+
+/* Calls I2CTask and I2CSimStep until nothing is left to do (nothing has happened for I2C_SIM_IDLE_PASSES calls in a
+ * row, as with I2C_MULTI_MASTER I2CTask may need a few calls before it sends a START) or maxSteps have run. Returns
+ * the number of steps */
+unsigned long I2CSimRunUntilIdle(unsigned long maxSteps);
+
+/* Returns the statistics collected since the last I2CSimReset */
+const struct I2CSimStats * I2CSimGetStats(void);
+
+/* Bus lines driven by hand, what I2C_SCL_LOW() etc. map to in a host build. Taking the pins from the TWI ends
+ * whatever transaction it was in the middle of. level is 0 to drive the line low, 1 to release it */
+void I2CSimDriveScl(uint8_t level);
+void I2CSimDriveSda(uint8_t level);
+
+/* Returns the level of SDA (0 while a device holds it low) */
+uint8_t I2CSimReadSda(void);
+
+/* Returns the level of SCL (0 while driven low by hand or while another master has the bus) */
+uint8_t I2CSimReadScl(void);
+
+/* Busy wait, what _delay_us maps to in a host build (only adds to busCycles, and maskedCycles if interrupts are off) */
+void I2CSimDelayUs(unsigned int us);
+
+/* Interrupt enable flag, what cli()/sei() map to in a host build */
+void I2CSimCli(void);
+void I2CSimSei(void);
+
+/* What I2CCriticalEnter()/I2CCriticalExit() map to: disables interrupts and returns whether they were enabled, then
+ * puts that back */
+uint8_t I2CSimCriticalEnter(void);
+void I2CSimCriticalExit(uint8_t sreg);
+
+#endif /* I2C_HOST_SIM */
+
+#endif /* I2C_SIM_H_ */
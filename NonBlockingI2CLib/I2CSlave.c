@@ -0,0 +1,278 @@
+/*
+ * I2CSlave.c
+ *
+ * Slave (target) mode engine, see I2CSlave.h
+ */
+
+#ifdef I2C_SLAVE
+
+// Other includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CSlave.h"
+
+// How the slave presents itself
+#define SLAVE_MODEL_NONE        0
+#define SLAVE_MODEL_REGISTERS   1
+#define SLAVE_MODEL_MAILBOX     2
+
+static uint8_t g_s_model = SLAVE_MODEL_NONE;
+static I2CSlaveCallback g_s_callback = NULL;
+
+// Register map
+static uint8_t * g_s_regs = NULL;
+static uint8_t g_s_regSize = 0;
+static uint8_t g_s_writable = 0;        // Registers below this can be written
+static uint8_t g_s_pointer = 0;         // Register pointer, kept between transactions
+
+// Mailbox
+static uint8_t * g_s_rx = NULL;
+static uint8_t g_s_rxSize = 0;
+static const uint8_t * g_s_tx = NULL;
+static uint8_t g_s_txLength = 0;
+
+// The transaction in progress
+static volatile uint8_t g_s_busy = 0;   // Addressed, and the transaction has not ended yet
+static uint8_t g_s_generalCall = 0;
+static uint8_t g_s_pointerNext = 0;     // The next byte written sets the register pointer
+static uint8_t g_s_start = 0;           // Register (or mailbox index) the transaction started at
+static uint8_t g_s_count = 0;           // Bytes received or sent so far
+
+// Carries on, ACKing the next byte received if ack is set (or expecting an ACK for the byte in TWDR)
+static inline void slaveContinue(uint8_t ack)
+{
+    TWCR = (1 << TWI_INT_FLAG) | (ack ? (1 << TWI_ACK_EN) : 0) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+}
+
+// Goes back to waiting to be addressed
+static inline void slaveRearm()
+{
+    TWCR = (1 << TWI_INT_FLAG) | (1 << TWI_ACK_EN) | (1 << TWI_ENABLE) | (1 << TWI_INT_EN);
+}
+
+// Returns 1 if there is room for another byte written by the master
+static uint8_t slaveRoom()
+{
+    if (g_s_model == SLAVE_MODEL_REGISTERS)
+    {
+        return g_s_pointerNext || g_s_pointer < g_s_writable;
+    }
+    return g_s_count < g_s_rxSize;
+}
+
+// Stores a byte written by the master (slaveRoom said there was room for it)
+static void slaveStore(uint8_t data)
+{
+    if (g_s_model == SLAVE_MODEL_REGISTERS)
+    {
+        if (g_s_pointerNext)
+        {
+            g_s_pointer = data;
+            g_s_start = data;
+            g_s_pointerNext = 0;
+            return;
+        }
+        g_s_regs[g_s_pointer] = data;
+        g_s_pointer++;
+    }
+    else
+    {
+        g_s_rx[g_s_count] = data;
+    }
+    g_s_count++;
+}
+
+// Loads the next byte for the master to read and says whether more will follow
+static void slaveSend()
+{
+    uint8_t more = 0;
+
+    if (g_s_model == SLAVE_MODEL_REGISTERS && g_s_pointer < g_s_regSize)
+    {
+        TWDR = g_s_regs[g_s_pointer];
+        g_s_pointer++;
+        g_s_count++;
+        more = g_s_pointer < g_s_regSize;
+    }
+    else if (g_s_model == SLAVE_MODEL_MAILBOX && g_s_count < g_s_txLength)
+    {
+        TWDR = g_s_tx[g_s_count];
+        g_s_count++;
+        more = g_s_count < g_s_txLength;
+    }
+    else
+    {
+        TWDR = 0xFF;    // Nothing left, as if SDA were not driven
+    }
+    // With no ACK expected the TWI leaves the transaction after this byte (LAST_DATA_TRA_ACK_REC if it is ACKed anyway)
+    slaveContinue(more);
+}
+
+// Reports the transaction that just ended to the callback, unless no data byte was written or sent (a read past the
+// end of the map only got 0xFF, and g_s_start may be past size then)
+static void slaveEnd(uint8_t event)
+{
+    uint8_t * data;
+
+    g_s_busy = 0;
+    if (!g_s_callback || !g_s_count)
+    {
+        return;
+    }
+    if (g_s_model == SLAVE_MODEL_REGISTERS)
+    {
+        data = g_s_regs + g_s_start;
+    }
+    else
+    {
+        data = (event == I2C_SLAVE_EVENT_READ) ? (uint8_t *)g_s_tx : g_s_rx;
+    }
+    g_s_callback(event, data, g_s_count);
+}
+
+void I2CSlaveHandle(uint8_t status)
+{
+    switch (status)
+    {
+        // Addressed for writing (or a general call), possibly after winning arbitration from us
+        case SLA_W_REC_ACK_TRA:
+        case ARB_LOST_SLA_W_REC_ACK_TRA:
+        case GEN_CALL_ACK_TRA:
+        case ARB_LOST_GEN_CALL_ACK_TRA:
+            g_s_busy = 1;
+            g_s_generalCall = (status == GEN_CALL_ACK_TRA || status == ARB_LOST_GEN_CALL_ACK_TRA);
+            g_s_pointerNext = (g_s_model == SLAVE_MODEL_REGISTERS);
+            g_s_start = 0;
+            g_s_count = 0;
+            slaveContinue(g_s_model != SLAVE_MODEL_NONE && slaveRoom());
+            break;
+
+        // A byte has been received and ACKed
+        case SLA_W_DATA_REC_ACK_TRA:
+        case GEN_CALL_DATA_REC_ACK_TRA:
+            slaveStore(TWDR);
+            slaveContinue(slaveRoom());     // NACK the next byte if it has nowhere to go
+            break;
+
+        // A byte that had nowhere to go has been NACKed (and dropped), so the TWI has left the transaction
+        case SLA_W_DATA_REC_NACK_TRA:
+        case GEN_CALL_DATA_REC_NACK_TRA:
+        // The master has ended its write with a STOP or repeated start
+        case STOP_OR_REP_START_REC:
+            slaveEnd(g_s_generalCall ? I2C_SLAVE_EVENT_GENERAL_CALL : I2C_SLAVE_EVENT_WRITE);
+            slaveRearm();
+            break;
+
+        // Addressed for reading, possibly after winning arbitration from us
+        case SLA_R_REC_ACK_TRA:
+        case ARB_LOST_SLA_R_REC_ACK_TRA:
+            g_s_busy = 1;
+            g_s_start = g_s_pointer;
+            g_s_count = 0;
+            slaveSend();
+            break;
+
+        // The master ACKed a byte and wants another
+        case SLA_DATA_TRA_ACK_REC:
+            slaveSend();
+            break;
+
+        // The master NACKed (its last byte), or ACKed the byte we said was our last
+        case SLA_DATA_TRA_NACK_REC:
+        case LAST_DATA_TRA_ACK_REC:
+            slaveEnd(I2C_SLAVE_EVENT_READ);
+            slaveRearm();
+            break;
+
+        default:
+            slaveRearm();
+            break;
+    }
+}
+
+// Sets the slave address (and general call bit) the TWI answers to
+static void slaveSetAddress(uint8_t address)
+{
+    TWAR = (address << 1) | (TWAR & (1 << TWGCE));
+}
+
+void I2CSlaveInitRegisters(uint8_t address, uint8_t * regs, uint8_t size, uint8_t writable)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    g_s_model = regs ? SLAVE_MODEL_REGISTERS : SLAVE_MODEL_NONE;
+    g_s_regs = regs;
+    g_s_regSize = size;
+    g_s_writable = (writable < size) ? writable : size;
+    g_s_pointer = 0;
+    slaveSetAddress(address);
+    I2CCriticalExit(sreg);
+}
+
+void I2CSlaveInitMailbox(uint8_t address, uint8_t * rx, uint8_t rxSize)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    g_s_model = SLAVE_MODEL_MAILBOX;
+    g_s_rx = rx;
+    g_s_rxSize = rx ? rxSize : 0;
+    slaveSetAddress(address);
+    I2CCriticalExit(sreg);
+}
+
+void I2CSlaveSetRx(uint8_t * rx, uint8_t rxSize)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    g_s_rx = rx;
+    g_s_rxSize = rx ? rxSize : 0;
+    I2CCriticalExit(sreg);
+}
+
+void I2CSlaveSetTx(const uint8_t * tx, uint8_t txLength)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    g_s_tx = tx;
+    g_s_txLength = tx ? txLength : 0;
+    I2CCriticalExit(sreg);
+}
+
+void I2CSlaveSetGeneralCall(uint8_t enable)
+{
+    uint8_t sreg = I2CCriticalEnter();
+    if (enable)
+    {
+        TWAR |= (1 << TWGCE);
+    }
+    else
+    {
+        TWAR &= ~(1 << TWGCE);
+    }
+    I2CCriticalExit(sreg);
+}
+
+void I2CSlaveSetCallback(I2CSlaveCallback cb)
+{
+    g_s_callback = cb;
+}
+
+void I2CSlaveDisable()
+{
+    uint8_t sreg = I2CCriticalEnter();
+    g_s_model = SLAVE_MODEL_NONE;
+    TWAR = 0xFE;    // 0x7F is a reserved address no master uses, and general calls are off
+    I2CCriticalExit(sreg);
+}
+
+uint8_t I2CSlaveBusy()
+{
+    return g_s_busy;
+}
+
+void I2CSlaveReset()
+{
+    g_s_busy = 0;
+}
+
+#endif /* I2C_SLAVE */
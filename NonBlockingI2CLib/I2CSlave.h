@@ -0,0 +1,71 @@
+/*
+ * I2CSlave.h
+ *
+ * Interrupt driven slave (target) mode, so other masters can query this AVR while it keeps using the bus as a master.
+ * Define I2C_SLAVE (globally) to build it; the TWI_vect ISR in I2CDriver.c hands every slave status to I2CSlaveHandle.
+ */
+
+
+#ifndef I2C_SLAVE_H_
+#define I2C_SLAVE_H_
+
+#include <stdint.h>
+
+#ifdef I2C_SLAVE
+
+// Events passed to the slave callback
+#define I2C_SLAVE_EVENT_WRITE           0   // A master wrote length bytes, which are now at data
+#define I2C_SLAVE_EVENT_READ            1   // A master read length bytes, which were sent from data
+#define I2C_SLAVE_EVENT_GENERAL_CALL    2   // A general call wrote length bytes, which are now at data
+
+/* Called from the TWI interrupt at the end of every transaction another master has with us (after its STOP or
+ * repeated start, or once we have NACKed it) that moved at least one data byte, so length is never 0. Keep it short,
+ * it runs in the ISR */
+typedef void (*I2CSlaveCallback)(uint8_t event, uint8_t * data, uint8_t length);
+
+/* Answers to address as a register map: the first byte a master writes sets the register pointer, the bytes after it
+ * are stored in regs from there, and reads are sent from there, the pointer moving on with every byte. Only registers
+ * below writable can be written (the master gets a NACK past them); reads past size get 0xFF.
+ * regs is used in place (no copies), so the application reads and writes it directly */
+void I2CSlaveInitRegisters(uint8_t address, uint8_t * regs, uint8_t size, uint8_t writable);
+
+/* Answers to address as a mailbox: what a master writes goes into rx (from rx[0] every time, NACKed past rxSize) and
+ * what a master reads comes from the buffer set with I2CSlaveSetTx. Both are used in place */
+void I2CSlaveInitMailbox(uint8_t address, uint8_t * rx, uint8_t rxSize);
+
+/* Gives a mailbox a new receive buffer, e.g. from the callback to keep the last message while the next arrives */
+void I2CSlaveSetRx(uint8_t * rx, uint8_t rxSize);
+
+/* Sets what a mailbox sends to masters that read it (0xFF once txLength bytes have gone). tx is not copied, so it
+ * must stay valid until it is replaced */
+void I2CSlaveSetTx(const uint8_t * tx, uint8_t txLength);
+
+/* Answers to general calls (address 0) too if enable is 1. They are received like writes */
+void I2CSlaveSetGeneralCall(uint8_t enable);
+
+/* Sets the function called at the end of every slave transaction. NULL disables it */
+void I2CSlaveSetCallback(I2CSlaveCallback cb);
+
+/* Stops answering to any address */
+void I2CSlaveDisable();
+
+/* Returns 1 while another master is in the middle of a transaction with us (the driver starts nothing until it ends).
+ * A transaction normally ends with its STOP or repeated start; one cut short ends with a bus error, or with
+ * I2C_TIMEOUT_TICKS once it has made no progress for that long */
+uint8_t I2CSlaveBusy();
+
+/* Forgets the transaction in progress (if any) without reporting it, after a bus error or a bus reset. Called by the
+ * driver */
+void I2CSlaveReset();
+
+/* Handles a slave status (SLA_W_REC_ACK_TRA ... LAST_DATA_TRA_ACK_REC). Called by the driver from the ISR */
+void I2CSlaveHandle(uint8_t status);
+
+#else
+
+#define I2CSlaveBusy()  0
+#define I2CSlaveReset()
+
+#endif /* I2C_SLAVE */
+
+#endif /* I2C_SLAVE_H_ */
@@ -0,0 +1,238 @@
+/*
+ * bench.c
+ *
+ * Benchmarks through the simulator: bus cycles per byte (CPU cycles at F_CPU the bus is busy for, per data byte moved,
+ * addressing and STOPs included) for writes and reads of a few lengths at 100 and 400 kHz, and queue operations per
+ * second (instructions added, run through the simulated bus and reclaimed, per second of host time), and the same
+ * sequence (write, sleep, write-read) as an I2CCoro coroutine and as the hand-rolled state machine it replaces, run
+ * side by side (make size compares their code). Not a test: it checks nothing and is not part of make check
+ */
+
+// Other includes
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CCoro.h"
+
+// Name of the configuration the results go under (the Makefile passes it)
+#ifndef CHECK_NAME
+#define CHECK_NAME              "bench"
+#endif
+
+#define BENCH_QUEUE_ROUNDS      20000   // Batches of instructions for the ops/sec figure
+#define BENCH_QUEUE_BATCH       8       // Instructions added before the batch is run
+#define BENCH_SEQUENCE_ROUNDS   2000    // Runs of the coroutine (and hand-rolled) sequence
+
+static uint8_t g_mem[256];
+
+// Bus cycles per data byte for count instructions of length bytes each, all queued first and then run
+static double cyclesPerByte(uint32_t clock, uint8_t mode, uint16_t length, int count)
+{
+    static uint8_t data[129];
+    const struct I2CSimStats * stats = I2CSimGetStats();
+    int ind;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, g_mem, sizeof(g_mem));
+    I2CInit(clock);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    for (ind = 0; ind < count; ind++)
+    {
+        if (mode == I2C_READ)
+        {
+            I2CBufferAddInstruction(buf, 0x50, I2C_READ, data, length);
+        }
+        else
+        {
+            data[0] = 0;
+            I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, data, length + 1);   // The register pointer, then length bytes
+        }
+    }
+    I2CSimRunUntilIdle(10000000UL);
+    I2CBufferFree(buf);
+    return (double)stats->busCycles / ((unsigned long)length * count);
+}
+
+// Instructions per second of host time added, run and reclaimed
+static double queueOpsPerSecond(void)
+{
+    uint8_t wr[2] = {0x00, 0x01};
+    long round;
+    int ind;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, g_mem, sizeof(g_mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    clock_t start = clock();
+    for (round = 0; round < BENCH_QUEUE_ROUNDS; round++)
+    {
+        for (ind = 0; ind < BENCH_QUEUE_BATCH; ind++)
+        {
+            I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+        }
+        I2CSimRunUntilIdle(100000);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    I2CBufferFree(buf);
+    return seconds > 0 ? (double)BENCH_QUEUE_ROUNDS * BENCH_QUEUE_BATCH / seconds : 0;
+}
+
+// The sequence both versions run: configure, wait two ticks, read two registers back
+static uint8_t g_cfg[2] = {0x01, 0x60};
+static uint8_t g_reg = 0x01;
+static uint8_t g_raw[2];
+
+// As a coroutine (not static, so make size finds it)
+uint8_t benchCoroSequence(struct I2CCoro * co)
+{
+    I2C_CORO_BEGIN(co);
+    I2C_CORO_WRITE(co, 0x50, g_cfg, 2);
+    I2C_CORO_SLEEP(co, 2);
+    I2C_CORO_WRITE_READ(co, 0x50, &g_reg, 1, g_raw, 2);
+    I2C_CORO_END(co);
+}
+
+// The same by hand, with the same behaviour: a refused add is tried again unless it can never succeed
+#define HAND_WRITE          0
+#define HAND_WRITE_WAIT     1
+#define HAND_SLEEP          2
+#define HAND_READ           3
+#define HAND_READ_WAIT      4
+
+struct BenchHand
+{
+    I2CBuffer_pT buf;
+    I2CInstruction_ID id;
+    uint16_t wakeAt;
+    uint8_t state;
+    uint8_t status;
+};
+
+// Returns 1 once the transfer sm waits for has finished (or could never be added), with its status in sm
+static inline uint8_t handDone(struct BenchHand * sm)
+{
+    if (!sm->id)
+    {
+        sm->status = I2C_STATUS_INVALID;
+        return 1;
+    }
+    sm->status = I2CBufferGetStatus(sm->buf, sm->id, NULL);
+    return sm->status != I2C_STATUS_PENDING;
+}
+
+uint8_t benchHandSequence(struct BenchHand * sm)
+{
+    switch (sm->state)
+    {
+        case HAND_WRITE:
+            sm->id = I2CBufferAddInstruction(sm->buf, 0x50, I2C_WRITE, g_cfg, 2);
+            if (!sm->id && I2CBufferGetAddStatus(sm->buf) != I2C_STATUS_INVALID)
+            {
+                return I2C_CORO_WAITING;
+            }
+            sm->state = HAND_WRITE_WAIT;
+            // fall through
+        case HAND_WRITE_WAIT:
+            if (!handDone(sm))
+            {
+                return I2C_CORO_WAITING;
+            }
+            sm->wakeAt = I2CGetTicks() + 2;
+            sm->state = HAND_SLEEP;
+            // fall through
+        case HAND_SLEEP:
+            if ((int16_t)(I2CGetTicks() - sm->wakeAt) < 0)
+            {
+                return I2C_CORO_WAITING;
+            }
+            sm->state = HAND_READ;
+            // fall through
+        case HAND_READ:
+            sm->id = I2CBufferAddWriteReadInstruction(sm->buf, 0x50, &g_reg, 1, g_raw, 2);
+            if (!sm->id && I2CBufferGetAddStatus(sm->buf) != I2C_STATUS_INVALID)
+            {
+                return I2C_CORO_WAITING;
+            }
+            sm->state = HAND_READ_WAIT;
+            // fall through
+        case HAND_READ_WAIT:
+            if (!handDone(sm))
+            {
+                return I2C_CORO_WAITING;
+            }
+            break;
+    }
+    sm->state = HAND_WRITE;
+    return I2C_CORO_DONE;
+}
+
+/* Runs the sequence rounds times as a coroutine (hand 0) or by hand (1), calling it once per I2CTask. Returns the host
+ * time per call in ns, with the calls per round in *calls */
+static double sequenceNsPerCall(uint8_t hand, long rounds, double * calls)
+{
+    struct I2CCoro co;
+    struct BenchHand sm = {0};
+    unsigned long total = 0;
+    long round;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, g_mem, sizeof(g_mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CCoroInit(&co, buf);
+    sm.buf = buf;
+    clock_t start = clock();
+    for (round = 0; round < rounds; round++)
+    {
+        uint8_t result = I2C_CORO_WAITING;
+        while (result != I2C_CORO_DONE)
+        {
+            result = hand ? benchHandSequence(&sm) : benchCoroSequence(&co);
+            total++;
+            I2CTask();
+            I2CSimStep();
+            if (total % 64 == 0)
+            {
+                I2CTimerTick();
+            }
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    I2CBufferFree(buf);
+    *calls = (double)total / rounds;
+    return seconds * 1e9 / total;
+}
+
+int main(void)
+{
+    static const uint32_t clocks[2] = {100000, 400000};
+    static const uint16_t lengths[4] = {1, 4, 16, 128};
+    int c, l;
+
+    printf("%-10s %8s %8s %14s %14s\n", "config", "clock", "length", "write cyc/B", "read cyc/B");
+    for (c = 0; c < 2; c++)
+    {
+        for (l = 0; l < 4; l++)
+        {
+            printf("%-10s %8lu %8u %14.1f %14.1f\n", CHECK_NAME, (unsigned long)clocks[c], lengths[l],
+                   cyclesPerByte(clocks[c], I2C_WRITE, lengths[l], 8),
+                   cyclesPerByte(clocks[c], I2C_READ, lengths[l], 8));
+        }
+    }
+    printf("%-10s queue ops/sec %.0f\n", CHECK_NAME, queueOpsPerSecond());
+
+    double calls;
+    double ns = sequenceNsPerCall(0, BENCH_SEQUENCE_ROUNDS, &calls);
+    printf("%-10s coroutine   %6.1f calls/sequence %6.1f ns/call\n", CHECK_NAME, calls, ns);
+    ns = sequenceNsPerCall(1, BENCH_SEQUENCE_ROUNDS, &calls);
+    printf("%-10s hand-rolled %6.1f calls/sequence %6.1f ns/call\n", CHECK_NAME, calls, ns);
+    return 0;
+}
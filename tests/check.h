@@ -0,0 +1,44 @@
+/*
+ * check.h
+ *
+ * Assertions for the host tests. A failed CHECK prints where it is and the test carries on; main returns
+ * CHECK_RESULT(), which is nonzero if anything failed
+ */
+
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+
+// Name the result line goes under (the Makefile passes the test's configuration)
+#ifndef CHECK_NAME
+#define CHECK_NAME __FILE__
+#endif
+
+static int g_checkFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            g_checkFailures++; \
+        } \
+    } while (0)
+
+/* Integer comparison that also prints both values when it fails */
+#define CHECK_EQ(actual, expected) \
+    do { \
+        long a_ = (long)(actual), e_ = (long)(expected); \
+        if (a_ != e_) \
+        { \
+            printf("%s:%d: %s is %ld, expected %ld\n", __FILE__, __LINE__, #actual, a_, e_); \
+            g_checkFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_RESULT() \
+    (printf("%s: %s\n", CHECK_NAME, g_checkFailures ? "FAILED" : "passed"), g_checkFailures != 0)
+
+#endif /* CHECK_H_ */
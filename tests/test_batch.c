@@ -0,0 +1,129 @@
+/*
+ * test_batch.c
+ *
+ * I2CBufferAddBatch: all or none, in order, copies independent of the caller, bad entries refused before anything
+ * is reserved. Built for the linked list, the ring and the static pool
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+#define BATCH   12
+
+static int g_calls;
+static int g_order[64];
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)transferred;
+    if (g_calls < 64)
+    {
+        g_order[g_calls] = status;
+    }
+    g_calls++;
+}
+
+int main(void)
+{
+    uint8_t mem[64] = {0};
+    uint8_t cmds[BATCH][2];
+    struct I2CBatchEntry entries[BATCH];
+    uint8_t ind;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x3C, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+
+    for (ind = 0; ind < BATCH; ind++)
+    {
+        cmds[ind][0] = ind;
+        cmds[ind][1] = 0x40 + ind;
+        entries[ind] = (struct I2CBatchEntry){cmds[ind], NULL, 2, 0, 0x3C, I2C_WRITE, 0};
+    }
+    entries[3].flags = I2C_BATCH_NO_COPY;
+
+    // All of it, behind what was already queued
+    I2CInstruction_ID before = I2CBufferAddInstruction(buf, 0x3C, I2C_WRITE, cmds[0], 1);
+    I2CInstruction_ID last = 0;
+    I2CInstruction_ID first = I2CBufferAddBatch(buf, entries, BATCH, &last);
+    CHECK(first != 0 && last != 0 && first != last && first != before);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), BATCH + 1);
+    CHECK(I2CBufferContains(buf, first) && I2CBufferContains(buf, last));
+    for (ind = 0; ind < BATCH; ind++)
+    {
+        if (ind != 3)
+        {
+            cmds[ind][1] = 0;   // Copied, except the borrowed entry
+        }
+    }
+
+    // Refused before anything is reserved: the buffer is left as it was
+    entries[5].readWrite = 9;
+    CHECK_EQ(I2CBufferAddBatch(buf, entries, 6, NULL), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    entries[5].readWrite = I2C_WRITE;
+    entries[2].address = 0x90;
+    CHECK_EQ(I2CBufferAddBatch(buf, entries, 6, NULL), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    entries[2].address = 0x3C;
+    entries[4].length = -1;
+    CHECK_EQ(I2CBufferAddBatch(buf, entries, 6, NULL), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    entries[4].length = 2;
+    CHECK_EQ(I2CBufferAddBatch(buf, entries, 0, NULL), 0);
+    CHECK_EQ(I2CBufferAddBatch(buf, NULL, 3, NULL), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), BATCH + 1);
+
+    // Runs in order, from the copies
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(g_calls, BATCH + 1);
+    CHECK(!I2CBufferContains(buf, last));
+    CHECK_EQ(I2CBufferGetStatus(buf, last, NULL), I2C_STATUS_DONE);
+    for (ind = 0; ind < BATCH; ind++)
+    {
+        CHECK_EQ(g_order[ind], I2C_STATUS_DONE);
+        CHECK_EQ(mem[ind], 0x40 + ind);
+    }
+
+    // A write-read keeps its read phase after its write bytes, so even a borrowed one is copied
+    uint8_t reg[2] = {0x05, 0x07};
+    uint8_t rd[2][2] = {{0}};
+    struct I2CBatchEntry reads[2] = {
+        {&reg[0], rd[0], 1, 2, 0x3C, I2C_WRITE_READ, I2C_BATCH_NO_COPY},
+        {&reg[1], rd[1], 1, 2, 0x3C, I2C_WRITE_READ, 0},
+    };
+    I2CBufferAddInstruction(buf, 0x3C, I2C_WRITE, cmds[0], 1);     // Keeps the batch from starting straight away
+    CHECK(I2CBufferAddBatch(buf, reads, 2, &last) != 0);
+    reg[0] = reg[1] = 0;
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, last, NULL), I2C_STATUS_DONE);
+    CHECK(rd[0][0] == 0x45 && rd[0][1] == 0x46 && rd[1][0] == 0x47 && rd[1][1] == 0x48);
+
+    // Batches that do not fit are refused whole, and fit again once the bus has drained the buffer
+    int batches = 0;
+    while (I2CBufferAddBatch(buf, entries, 5, NULL) && batches < 1000)
+    {
+        batches++;
+    }
+    CHECK(batches > 0 && batches < 1000);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_UNKNOWN);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), batches * 5);
+    I2CSimRunUntilIdle(1000000);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(I2CBufferAddBatch(buf, entries, 5, NULL) != 0);
+    I2CSimRunUntilIdle(100000);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
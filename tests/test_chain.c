@@ -0,0 +1,77 @@
+/*
+ * test_chain.c
+ *
+ * Instruction chaining (I2C_CHAIN_MODE): the ISR starts each queued instruction itself, with a repeated start and no
+ * STOP in between (or STOP then START), after a single I2CTask call; an instruction that fails ends the chain. Built
+ * for both chaining modes
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+// Kicks the bus once, then lets the ISR carry on by itself for as long as it has anything to do
+static void kickOnce(void)
+{
+    I2CTask();
+    while (I2CSimStep())
+    {
+    }
+}
+
+int main(void)
+{
+    uint8_t mem[16] = {0};
+    uint8_t wr[3] = {0x02, 0x11, 0x22};
+    uint8_t reg = 0x02;
+    uint8_t rd[2] = {0};
+    uint8_t next = 0;
+    I2CInstruction_ID ids[4];
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+
+    // Four instructions (one of them a write-read) from one kick
+    ids[0] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 3);
+    wr[0] = 0x08;
+    ids[1] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 3);
+    ids[2] = I2CBufferAddWriteReadInstruction(buf, 0x50, &reg, 1, rd, 2);
+    ids[3] = I2CBufferAddInstruction(buf, 0x50, I2C_READ, &next, 1);
+    kickOnce();
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[0], NULL), I2C_STATUS_DONE);
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[3], NULL), I2C_STATUS_DONE);
+    CHECK(rd[0] == 0x11 && rd[1] == 0x22 && mem[8] == 0x11 && mem[9] == 0x22);
+    CHECK_EQ(stats->starts, 5);
+#if I2C_CHAIN_MODE == I2C_CHAIN_REP_START
+    CHECK_EQ(stats->stops, 1);                  // Only once the queue is empty
+#else
+    CHECK_EQ(stats->stops, 4);                  // Between the instructions too
+#endif
+
+    // A NACK in the middle ends the chain with a STOP; the rest waits for the next kick
+    unsigned long starts = stats->starts, stops = stats->stops;
+    ids[0] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    ids[1] = I2CBufferAddInstruction(buf, 0x51, I2C_WRITE, wr, 2);
+    ids[2] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    kickOnce();
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[0], NULL), I2C_STATUS_DONE);
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[1], NULL), I2C_STATUS_ADDR_NACK);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 1);
+    CHECK_EQ(stats->starts - starts, 2);
+    CHECK_EQ(stats->stops - stops, I2C_CHAIN_MODE == I2C_CHAIN_REP_START ? 1 : 2);
+    kickOnce();
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[2], NULL), I2C_STATUS_DONE);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,90 @@
+/*
+ * test_clock.c
+ *
+ * SCL clock setup at F_CPU = 16 MHz: the TWBR/prescaler pairs worked out at compile time and at run time, the clamp at
+ * the slowest prescaler, and devices with their own clock (I2C_MAX_DEVICE_CLOCKS) retuning the TWI between
+ * instructions
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static const I2CClock g_clk100k = I2C_CLOCK(100000);
+static const I2CClock g_clk400k = I2C_CLOCK(400000);
+
+// Starts the next instruction and returns the TWBR/prescaler pair it went out with, then lets it finish
+static I2CClock runNext(void)
+{
+    I2CTask();
+    I2CClock clk = (I2CClock)(((TWSR & 0x03) << 8) | TWBR);
+    while (I2CSimStep())
+    {
+    }
+    return clk;
+}
+
+int main(void)
+{
+    uint8_t fast[4] = {0}, slow[4] = {0};
+    uint8_t wr[2] = {0x01, 0x5A};
+
+    // 16 MHz / (16 + 2 * 72) = 100 kHz and 16 MHz / (16 + 2 * 12) = 400 kHz, no prescaler needed
+    CHECK_EQ(g_clk100k, 0x048);
+    CHECK_EQ(g_clk400k, 0x00C);
+    CHECK_EQ(I2CClockFor(100000), 0x048);
+    CHECK_EQ(I2CClockFor(400000), 0x00C);
+    CHECK_EQ(I2C_CLOCK_FREQ(g_clk100k), 100000);
+    CHECK_EQ(I2C_CLOCK_FREQ(g_clk400k), 400000);
+
+    // Too slow for TWBR alone: the smallest prescaler that fits, TWBR rounded up so the clock is never too fast
+    CHECK_EQ(I2CClockFor(30000), 0x141);
+    CHECK_EQ(I2C_CLOCK_FREQ(0x141), 29850);
+    CHECK_EQ(I2CClockFor(1000), 0x37D);
+    CHECK_EQ(I2C_CLOCK(1000), 0x37D);
+
+    // Slower than the slowest prescaler can go: clamped to TWPS = 3, TWBR = 255
+    CHECK_EQ(I2CClockFor(10), 0x3FF);
+    CHECK_EQ(I2C_CLOCK(10), 0x3FF);
+    I2CSimReset();
+    I2CInit(10);
+    CHECK_EQ(TWBR, 255);
+    CHECK_EQ(TWSR & 0x03, 3);
+    CHECK_EQ(I2CGetSclFreq(), 489);
+
+    I2C_INIT(100000);
+    CHECK_EQ(TWBR, 72);
+    CHECK_EQ(TWSR & 0x03, 0);
+    CHECK_EQ(I2CGetSclFreq(), 100000);
+
+    // A device with its own clock gets it for its own instructions only, the TWI going back in between
+    I2CSimAddDevice(0x50, fast, sizeof(fast));
+    I2CSimAddDevice(0x20, slow, sizeof(slow));
+    CHECK(I2CSetDeviceClock(0x50, g_clk400k));
+    CHECK(I2CSetDeviceClock(0x50, g_clk400k));     // Same device again, no new entry
+    CHECK(I2CSetDeviceClock(0x51, I2C_CLOCK(1000000)));
+    CHECK(!I2CSetDeviceClock(0x52, g_clk400k));     // I2C_MAX_DEVICE_CLOCKS is 2
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CBufferAddInstruction(buf, 0x20, I2C_WRITE, wr, 2);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+    unsigned long cycles = stats->busCycles;
+    CHECK_EQ(runNext(), g_clk400k);
+    unsigned long fastCycles = stats->busCycles - cycles;
+    cycles = stats->busCycles;
+    CHECK_EQ(runNext(), g_clk100k);
+    unsigned long slowCycles = stats->busCycles - cycles;
+    CHECK_EQ(runNext(), g_clk400k);
+    CHECK_EQ(slowCycles, 4 * fastCycles);
+    CHECK(fast[1] == 0x5A && slow[1] == 0x5A);
+    CHECK_EQ(I2CGetSclFreq(), 400000);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
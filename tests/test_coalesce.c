@@ -0,0 +1,150 @@
+/*
+ * test_coalesce.c
+ *
+ * Write coalescing (I2C_COALESCE_WRITES): consecutive register writes to one device share a transaction, anything
+ * else is left alone, and no merge grows past I2C_COALESCE_MAX_LENGTH. Built with malloc and with the static pool,
+ * where a merge must be able to use the blocks of writes that are already done
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static int g_calls;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)status;
+    (void)transferred;
+    g_calls++;
+}
+
+int main(void)
+{
+    uint8_t mem[64] = {0};
+    uint8_t other[64] = {0};
+    I2CInstruction_ID ids[12];
+    uint8_t wr[2];
+    uint8_t reg;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x68, mem, sizeof(mem));
+    I2CSimAddDevice(0x69, other, sizeof(other));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+
+    // Off by default
+    wr[0] = 0x00;
+    wr[1] = 1;
+    I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);
+    wr[0] = 0x01;
+    I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 2);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), 0);
+    I2CSimRunUntilIdle(10000);
+
+    I2CBufferSetCoalescing(buf, 1);
+    unsigned long starts = stats->starts;
+    int count = 0;
+    wr[0] = 0x30;
+    wr[1] = 0xEE;
+    ids[count++] = I2CBufferAddInstruction(buf, 0x69, I2C_WRITE, wr, 2);
+    for (reg = 0x10; reg < 0x18; reg++)
+    {
+        wr[0] = reg;
+        wr[1] = 0xA0 + reg;
+        ids[count++] = I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);
+    }
+    uint8_t wr3[3] = {0x18, 1, 2};
+    ids[count++] = I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr3, 3);  // Several bytes carry on too
+    wr[0] = 0x05;
+    wr[1] = 0x55;
+    ids[count++] = I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);   // Not the next register
+    wr[0] = 0x06;
+    wr[1] = 0x66;
+    ids[count++] = I2CBufferAddInstruction(buf, 0x69, I2C_WRITE, wr, 2);   // Another device
+    CHECK(ids[1] == ids[8] && ids[1] == ids[9]);
+    CHECK(ids[10] != ids[9] && ids[11] != ids[10]);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), 8);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 4);
+
+    g_calls = 0;
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(stats->starts - starts, 4);
+    CHECK_EQ(g_calls, 4);
+    CHECK_EQ(I2CBufferGetStatus(buf, ids[5], NULL), I2C_STATUS_DONE);
+    for (reg = 0x10; reg < 0x18; reg++)
+    {
+        CHECK_EQ(mem[reg], 0xA0 + reg);
+    }
+    CHECK(mem[0x18] == 1 && mem[0x19] == 2 && mem[5] == 0x55);
+    CHECK(other[0x30] == 0xEE && other[6] == 0x66);
+
+    // A long run is split so that no write is longer than the limit
+    starts = stats->starts;
+    wr[0] = 0x3F;
+    I2CBufferAddInstruction(buf, 0x69, I2C_WRITE, wr, 2);     // Keeps the run from starting at the head
+    for (reg = 0; reg < 40; reg++)
+    {
+        wr[0] = reg;
+        wr[1] = reg ^ 0x5A;
+        I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);
+    }
+    unsigned long written = stats->bytesWritten;
+    I2CSimRunUntilIdle(100000);
+    unsigned long runStarts = stats->starts - starts - 1;
+    CHECK_EQ(runStarts, (40 + I2C_COALESCE_MAX_LENGTH - 2) / (I2C_COALESCE_MAX_LENGTH - 1));
+    CHECK_EQ(stats->bytesWritten - written, 2 + 40 + runStarts);
+    for (reg = 0; reg < 40; reg++)
+    {
+        CHECK_EQ(mem[reg], reg ^ 0x5A);
+    }
+
+#ifdef I2C_USE_STATIC_POOL
+    // Payload blocks the ISR is done with are given back before a merge needs one: fill the pool, run all but the
+    // last two writes (the head is never merged into), then merge into the last. In a ring every block can be taken
+    // (a list keeps one node linked in, so one block is always left there)
+#ifdef I2C_USE_RING_BUFFER
+    const int fill = I2C_POOL_SIZE - 1;
+#else
+    const int fill = I2C_POOL_SIZE - 2;
+#endif
+    int done;
+    wr[0] = 0x00;
+    for (done = 0; done < fill; done++)
+    {
+        CHECK(I2CBufferAddInstruction(buf, 0x69, I2C_WRITE, wr, 2) != 0);   // Same register, so none of them merge
+    }
+    wr[0] = 0x20;
+    wr[1] = 0x01;
+    I2CInstruction_ID last = I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2);
+    CHECK(last != 0);
+    g_calls = 0;
+    while (g_calls < fill - 1)
+    {
+        I2CTask();
+        while (I2CSimStep())
+        {
+        }
+    }
+    int coalesced = I2CBufferGetCoalesced(buf);
+    wr[0] = 0x21;
+    wr[1] = 0x02;
+    CHECK_EQ(I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, wr, 2), last);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), coalesced + 1);
+    I2CSimRunUntilIdle(100000);
+    CHECK(mem[0x20] == 0x01 && mem[0x21] == 0x02);
+#endif
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
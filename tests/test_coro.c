@@ -0,0 +1,129 @@
+/*
+ * test_coro.c
+ *
+ * I2CCoro: awaits, sleeps and spawning, a first add refused for want of room, and an add that can never succeed.
+ * Built with and without handles
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CCoro.h"
+#include "check.h"
+
+static uint8_t g_cfg[2] = {0x01, 0x60};
+static uint8_t g_reg = 0x10;
+static uint8_t g_raw[2];
+static uint8_t g_nacked[3] = {5, 6, 7};
+static int g_reads;
+static uint8_t g_statuses[8];
+
+// Configures the device, samples it three times, then writes to an address nobody answers
+static uint8_t sensorTask(struct I2CCoro * co)
+{
+    static int sample;
+
+    I2C_CORO_BEGIN(co);
+    I2C_CORO_WRITE(co, 0x48, g_cfg, 2);
+    g_statuses[0] = I2C_CORO_STATUS(co);
+    CHECK_EQ(I2C_CORO_TRANSFERRED(co), 2);
+    for (sample = 0; sample < 3; sample++)
+    {
+        I2C_CORO_SLEEP(co, 2);
+        I2C_CORO_WRITE_READ(co, 0x48, &g_reg, 1, g_raw, 2);
+        g_statuses[1 + sample] = I2C_CORO_STATUS(co);
+        g_reads++;
+    }
+    I2C_CORO_WRITE(co, 0x77, g_nacked, 3);
+    g_statuses[4] = I2C_CORO_STATUS(co);
+    I2C_CORO_END(co);
+}
+
+static uint8_t parentTask(struct I2CCoro * co, struct I2CCoro * child)
+{
+    I2C_CORO_BEGIN(co);
+    I2CCoroInit(child, co->buf);
+    I2C_CORO_SPAWN(co, sensorTask(child));
+    I2C_CORO_YIELD(co);
+    I2C_CORO_END(co);
+}
+
+// Awaits a write to an address that does not exist, then one that does
+static uint8_t invalidTask(struct I2CCoro * co)
+{
+    I2C_CORO_BEGIN(co);
+    I2C_CORO_WRITE(co, 0x90, g_cfg, 2);
+    g_statuses[5] = I2C_CORO_STATUS(co);
+    I2C_CORO_WRITE(co, 0x48, g_cfg, 2);
+    g_statuses[6] = I2C_CORO_STATUS(co);
+    I2C_CORO_END(co);
+}
+
+int main(void)
+{
+    uint8_t mem[32];
+    uint8_t ind;
+
+    for (ind = 0; ind < sizeof(mem); ind++)
+    {
+        mem[ind] = 0xA0 + ind;
+    }
+    I2CSimReset();
+    I2CSimAddDevice(0x48, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+
+    // Fill the buffer so the first await has to try again
+    uint8_t filler = 0;
+    int filled = 0;
+    while (I2CBufferAddInstruction(buf, 0x48, I2C_WRITE, &filler, 1) && filled < 1000)
+    {
+        filled++;
+    }
+    CHECK(filled > 0);
+
+    struct I2CCoro co, child;
+    I2CCoroInit(&co, buf);
+    uint8_t result = I2C_CORO_WAITING;
+    int tick, step;
+    for (tick = 0; tick < 200 && result != I2C_CORO_DONE; tick++)
+    {
+        for (step = 0; step < 40 && result != I2C_CORO_DONE; step++)
+        {
+            result = parentTask(&co, &child);
+            I2CTask();
+            I2CSimStep();
+        }
+        I2CTimerTick();
+    }
+    CHECK_EQ(result, I2C_CORO_DONE);
+    CHECK_EQ(g_reads, 3);
+    CHECK_EQ(g_statuses[0], I2C_STATUS_DONE);
+    CHECK_EQ(g_statuses[1], I2C_STATUS_DONE);
+    CHECK_EQ(g_statuses[3], I2C_STATUS_DONE);
+    CHECK_EQ(g_statuses[4], I2C_STATUS_ADDR_NACK);
+    CHECK(g_raw[0] == 0xA0 + 0x10 && g_raw[1] == 0xA0 + 0x11);
+    CHECK(mem[1] == 0x60);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+
+    // An add refused for good ends its await instead of being retried forever
+    I2CCoroInit(&co, buf);
+    result = I2C_CORO_WAITING;
+    for (step = 0; step < 1000 && result != I2C_CORO_DONE; step++)
+    {
+        result = invalidTask(&co);
+        I2CTask();
+        I2CSimStep();
+    }
+    CHECK_EQ(result, I2C_CORO_DONE);
+    CHECK_EQ(g_statuses[5], I2C_STATUS_INVALID);
+    CHECK_EQ(g_statuses[6], I2C_STATUS_DONE);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,204 @@
+/*
+ * test_device.c
+ *
+ * I2CDevice register cache: write-through, reads and read-modify-writes answered without the bus, loads, volatile
+ * registers and devices that do not auto-increment. Built plain and with handles and coalescing, where only writes to
+ * an auto-incrementing device with 8-bit registers may be merged
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CDevice.h"
+#include "check.h"
+
+#define REGS    32
+
+int main(void)
+{
+    uint8_t mem[REGS];
+    uint8_t eeprom[64] = {0};
+    static uint8_t shadow[REGS], valid[I2C_DEVICE_MAP_BYTES(REGS)];
+    static const uint8_t volatileRegs[I2C_DEVICE_MAP_BYTES(REGS)] = {0x00, 0x00, 0x0F, 0x00};   // 16 to 19
+    struct I2CDevice imu;
+    uint8_t out[8] = {0};
+    uint8_t ind;
+
+    for (ind = 0; ind < REGS; ind++)
+    {
+        mem[ind] = 0x40 + ind;
+    }
+    I2CSimReset();
+    I2CSimAddDevice(0x68, mem, sizeof(mem));
+    I2CSimAddDevice(0x50, eeprom, sizeof(eeprom));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+    I2CDeviceInit(&imu, buf, 0x68, I2C_DEVICE_AUTO_INC, shadow, valid, volatileRegs, REGS);
+
+    // Nothing is cached to begin with, and a bus read does not fill the cache
+    I2CInstruction_ID id = I2CDeviceRead(&imu, 3, out, 2);
+    CHECK(id != 0 && id != I2C_ID_NO_BUS);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+    CHECK(out[0] == 0x43 && out[1] == 0x44);
+    CHECK(!I2CDeviceIsCached(&imu, 3, 2));
+
+    // Written through, then read back without the bus
+    uint8_t cfg[3] = {0x11, 0x22, 0x33};
+    CHECK(I2CDeviceWrite(&imu, 5, cfg, 3) != 0);
+    CHECK(I2CDeviceIsCached(&imu, 5, 3));
+    I2CSimRunUntilIdle(100000);
+    CHECK(mem[5] == 0x11 && mem[6] == 0x22 && mem[7] == 0x33);
+    unsigned long starts = stats->starts;
+    CHECK_EQ(I2CDeviceRead(&imu, 5, out, 3), I2C_ID_NO_BUS);
+    CHECK(out[0] == 0x11 && out[1] == 0x22 && out[2] == 0x33);
+    CHECK_EQ(I2CBufferGetStatus(buf, I2C_ID_NO_BUS, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(stats->starts, starts);
+
+    // Read-modify-write is one write, or none at all
+    CHECK(I2CDeviceUpdate(&imu, 6, 0x0F, 0x05) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(mem[6], 0x25);
+    CHECK_EQ(stats->starts - starts, 1);
+    CHECK_EQ(I2CDeviceUpdate(&imu, 6, 0x0F, 0x05), I2C_ID_NO_BUS);
+    CHECK_EQ(I2CDeviceUpdate(&imu, 9, 1, 1), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+
+    // Loaded registers are cached once the read is back; volatile ones never are
+    CHECK(I2CDeviceLoad(&imu, 8, 4) != 0);
+    CHECK(!I2CDeviceIsCached(&imu, 8, 4));
+    CHECK_EQ(I2CDeviceLoad(&imu, 20, 1), 0);       // One load at a time
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_UNKNOWN);
+    I2CSimRunUntilIdle(100000);
+    CHECK(I2CDeviceIsCached(&imu, 8, 4));
+    CHECK_EQ(shadow[9], 0x49);
+    CHECK_EQ(I2CDeviceLoad(&imu, 15, 2), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    starts = stats->starts;
+    I2CDeviceRead(&imu, 16, out, 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(stats->starts - starts, 2);
+    CHECK_EQ(out[0], 0x50);
+
+    // A write over a load still on its way drops the load
+    I2CDeviceInvalidate(&imu, 0, REGS);
+    CHECK(I2CDeviceLoad(&imu, 0, 4) != 0);
+    uint8_t value = 0x99;
+    I2CDeviceWrite(&imu, 1, &value, 1);
+    I2CSimRunUntilIdle(100000);
+    CHECK(!I2CDeviceIsCached(&imu, 0, 1));
+    CHECK_EQ(mem[1], 0x99);
+
+    // The discarded load is still on its way: a second write, an Assume or another load cannot cache over it
+    CHECK(I2CDeviceLoad(&imu, 0, 4) != 0);
+    value = 0x5A;
+    I2CDeviceWrite(&imu, 2, &value, 1);
+    value = 0xA5;
+    I2CDeviceWrite(&imu, 2, &value, 1);
+    CHECK(!I2CDeviceIsCached(&imu, 2, 1));
+    CHECK_EQ(I2CDeviceAssume(&imu, 2, &value, 1), 0);
+    CHECK_EQ(I2CDeviceLoad(&imu, 2, 1), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_UNKNOWN);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(mem[2], 0xA5);
+    CHECK(!I2CDeviceIsCached(&imu, 0, 4));
+    CHECK(I2CDeviceRead(&imu, 2, out, 1) != I2C_ID_NO_BUS);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(out[0], 0xA5);
+    CHECK(I2CDeviceWrite(&imu, 2, &value, 1) != 0);
+    CHECK(I2CDeviceIsCached(&imu, 2, 1));
+    CHECK_EQ(shadow[2], 0xA5);
+    I2CSimRunUntilIdle(100000);
+
+    // No auto-increment: one transfer per register
+    struct I2CDevice ee;
+    static uint8_t eeShadow[64], eeValid[I2C_DEVICE_MAP_BYTES(64)];
+    I2CDeviceInit(&ee, buf, 0x50, 0, eeShadow, eeValid, NULL, 64);
+    uint8_t data[3] = {7, 8, 9};
+    starts = stats->starts;
+    id = I2CDeviceWrite(&ee, 0x21, data, 3);
+    I2CSimRunUntilIdle(100000);
+    CHECK(eeprom[0x21] == 7 && eeprom[0x22] == 8 && eeprom[0x23] == 9);
+    CHECK_EQ(stats->starts - starts, 3);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+    I2CDeviceInvalidate(&ee, 0, 64);
+    memset(out, 0, sizeof(out));
+    starts = stats->starts;
+    I2CDeviceRead(&ee, 0x21, out, 3);
+    I2CSimRunUntilIdle(100000);
+    CHECK(out[0] == 7 && out[1] == 8 && out[2] == 9);
+    CHECK_EQ(stats->starts - starts, 6);
+
+#ifdef I2C_COALESCE_WRITES
+    // Single-register writes become one burst only on an auto-incrementing device with 8-bit registers
+    uint8_t wide[64] = {0};
+    struct I2CDevice wideDev;
+    I2CSimAddDevice(0x51, wide, sizeof(wide));
+    I2CDeviceInit(&wideDev, buf, 0x51, I2C_DEVICE_AUTO_INC | I2C_DEVICE_REG16, NULL, NULL, NULL, 0);
+    I2CBufferSetCoalescing(buf, 1);
+    uint8_t blocker[2] = {0x3F, 0};
+    uint8_t v[3] = {0xA1, 0xA2, 0xA3};
+
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, blocker, 2);     // Keeps the writes from starting at the head
+    starts = stats->starts;
+    unsigned long written = stats->bytesWritten;
+    id = I2CDeviceWrite(&imu, 0x1A, &v[0], 1);
+    CHECK_EQ(I2CDeviceWrite(&imu, 0x1B, &v[1], 1), id);
+    CHECK_EQ(I2CDeviceWrite(&imu, 0x1C, &v[2], 1), id);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(stats->starts - starts, 2);
+    CHECK_EQ(stats->bytesWritten - written, 2 + 4);     // The blocker, then pointer and three registers
+    CHECK(mem[0x1A] == 0xA1 && mem[0x1B] == 0xA2 && mem[0x1C] == 0xA3);
+
+    // No auto-increment: each write keeps its own transaction, and a plain write is not merged into one either
+    I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, blocker, 2);
+    starts = stats->starts;
+    I2CDeviceWrite(&ee, 0x30, &v[0], 1);
+    I2CDeviceWrite(&ee, 0x31, &v[1], 1);
+    uint8_t plain[2] = {0x32, 0xA3};
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, plain, 2);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(stats->starts - starts, 4);
+    CHECK(eeprom[0x30] == 0xA1 && eeprom[0x31] == 0xA2 && eeprom[0x32] == 0xA3);
+
+    // 16-bit registers: {00 10 v} then {02 00 y} looks like a run from an 8-bit pointer, but 0x0200 is not 0x0011
+    I2CBufferAddInstruction(buf, 0x68, I2C_WRITE, blocker, 2);
+    starts = stats->starts;
+    I2CInstruction_ID first = I2CDeviceWrite(&wideDev, 0x0010, &v[0], 1);
+    CHECK(I2CDeviceWrite(&wideDev, 0x0200, &v[1], 1) != first);
+    I2CDeviceWrite(&wideDev, 0x0011, &v[2], 1);
+    CHECK_EQ(I2CBufferGetCoalesced(buf), 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(stats->starts - starts, 4);
+    I2CBufferSetCoalescing(buf, 0);
+#endif
+
+#ifdef I2C_USE_HANDLES
+    // A cache hit settles an armed handle straight away, a refusal too; neither follows the next add
+    struct I2CFuture handle;
+    int transferred = 0;
+    I2CDeviceWrite(&imu, 5, cfg, 3);
+    I2CSimRunUntilIdle(100000);
+    I2CBufferSetHandle(buf, &handle);
+    CHECK_EQ(I2CDeviceRead(&imu, 5, out, 3), I2C_ID_NO_BUS);
+    CHECK_EQ(I2CHandleResult(&handle, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 3);
+    I2CBufferSetHandle(buf, &handle);
+    CHECK_EQ(I2CDeviceUpdate(&imu, 12, 1, 1), 0);
+    CHECK_EQ(I2CHandlePoll(&handle), I2C_STATUS_INVALID);
+    I2CDeviceRead(&imu, 16, out, 1);
+    CHECK_EQ(I2CHandlePoll(&handle), I2C_STATUS_INVALID);
+    I2CSimRunUntilIdle(100000);
+#endif
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,146 @@
+/*
+ * test_handles.c
+ *
+ * struct I2CFuture (I2C_USE_HANDLES): results, cancellation before and during a transfer, and disarming on adds
+ * that are refused or answered without one. Built for the linked list and the ring
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static int g_calls;
+static uint8_t g_lastStatus;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)transferred;
+    g_calls++;
+    g_lastStatus = status;
+}
+
+// Runs the bus for steps events
+static void runSteps(int steps)
+{
+    while (steps-- > 0)
+    {
+        I2CTask();
+        I2CSimStep();
+    }
+}
+
+int main(void)
+{
+    uint8_t mem[64] = {0};
+    uint8_t wr[40];
+    uint8_t rd[40];
+    struct I2CFuture first, second;
+    int transferred;
+    uint8_t ind;
+
+    for (ind = 0; ind < sizeof(wr); ind++)
+    {
+        wr[ind] = ind;
+    }
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+
+    // Pending, then done with its byte count
+    I2CBufferSetHandle(buf, &first);
+    I2CInstruction_ID id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 4);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_PENDING);
+    CHECK_EQ(first.id, id);
+    I2CSimRunUntilIdle(10000);
+    transferred = -1;
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 4);
+
+    // Cancelled while queued: never reaches the bus, the callback and result table agree
+    I2CBufferSetHandle(buf, &first);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 4);
+    I2CBufferSetHandle(buf, &second);
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 4);
+    g_calls = 0;
+    CHECK(I2CHandleCancel(&second));
+    CHECK_EQ(I2CHandlePoll(&second), I2C_STATUS_CANCELLED);
+    CHECK(!I2CBufferContains(buf, id));
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_CANCELLED);
+    CHECK_EQ(g_calls, 1);
+    CHECK_EQ(g_lastStatus, I2C_STATUS_CANCELLED);
+    unsigned long written = I2CSimGetStats()->bytesWritten;
+    I2CSimRunUntilIdle(10000);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_DONE);
+    CHECK_EQ(I2CSimGetStats()->bytesWritten - written, 4);
+    CHECK_EQ(I2CHandleCancel(&second), 0);
+
+    // Cancelled on the bus: a write stops at the next byte boundary, a read after one more byte
+    I2CBufferSetHandle(buf, &first);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr));
+    written = I2CSimGetStats()->bytesWritten;
+    runSteps(12);
+    CHECK(I2CHandleCancel(&first));
+    I2CSimRunUntilIdle(10000);
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_CANCELLED);
+    CHECK(transferred > 0 && transferred < (int)sizeof(wr));
+    CHECK_EQ(I2CSimGetStats()->bytesWritten - written, transferred);
+    I2CBufferSetHandle(buf, &first);
+    I2CBufferAddWriteReadInstruction(buf, 0x50, wr, 1, rd, sizeof(rd));
+    runSteps(20);
+    CHECK(I2CHandleCancel(&first));
+    I2CSimRunUntilIdle(10000);
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_CANCELLED);
+    CHECK(transferred < 1 + (int)sizeof(rd));
+
+    // The buffer still works afterwards
+    I2CBufferSetHandle(buf, &first);
+    I2CBufferAddInstruction(buf, 0x50, I2C_READ, rd, 3);
+    I2CSimRunUntilIdle(10000);
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 3);
+    CHECK_EQ(I2CHandleCancel(&first), 0);
+
+    // Refused adds settle the handle and disarm it, so it does not follow the next add
+    I2CBufferSetHandle(buf, &first);
+    CHECK_EQ(I2CBufferAddInstruction(buf, 0x90, I2C_WRITE, wr, 1), 0);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_INVALID);
+    I2CBufferSetHandle(buf, &first);
+    CHECK_EQ(I2CBufferAddInstruction(buf, 0x50, 9, wr, 1), 0);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_INVALID);
+    I2CBufferSetHandle(buf, &first);
+    CHECK_EQ(I2CBufferAddBatch(buf, NULL, 0, NULL), 0);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_INVALID);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 1);
+    CHECK_EQ(I2CHandlePoll(&first), I2C_STATUS_INVALID);
+    I2CSimRunUntilIdle(10000);
+
+    // As does a layer that answers without an add
+    I2CBufferSetHandle(buf, &first);
+    I2CBufferSettleAdd(buf, I2C_STATUS_DONE, 2);
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 2);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 1);
+    CHECK_EQ(I2CHandleResult(&first, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 2);
+    I2CSimRunUntilIdle(10000);
+
+    // Freeing the buffer finishes what it still held
+    I2CBufferSetHandle(buf, &second);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 1);
+    I2CBuffer_pT other = I2CBufferNew();
+    I2CSetCurBuf(other);
+    I2CBufferFree(buf);
+    CHECK(I2CHandlePoll(&second) != I2C_STATUS_PENDING);
+
+    I2CBufferFree(other);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,107 @@
+/*
+ * test_multimaster.c
+ *
+ * Multi-master (I2C_MULTI_MASTER, I2C_ARB_RESTARTS = 2, I2C_BUS_FREE_SAMPLES = 3): an instruction that loses
+ * arbitration goes again from its first byte once the winner is done, one that keeps losing gives up with
+ * I2C_STATUS_ARB_LOST after I2C_ARB_RESTARTS restarts, and no START goes out until the bus has read free on
+ * I2C_BUS_FREE_SAMPLES I2CTask calls in a row
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static int g_calls;
+static uint8_t g_status;
+static int g_transferred;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    g_calls++;
+    g_status = status;
+    g_transferred = transferred;
+}
+
+int main(void)
+{
+    uint8_t mem[8] = {0};
+    uint8_t wr[4] = {0x01, 0xA1, 0xA2, 0xA3};
+    uint8_t rd[3];
+    int step;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+
+    // Lost on the second data byte: sent again from the start once the winner lets go, and reported once
+    I2CSimLoseArbitrationAfter(3);
+    I2CInstruction_ID id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 4);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(g_calls, 1);
+    CHECK_EQ(g_transferred, 4);
+    CHECK_EQ(stats->arbLosses, 1);
+    CHECK_EQ(stats->starts, 2);
+    CHECK_EQ(stats->addrBytes, 2);
+    CHECK(mem[1] == 0xA1 && mem[2] == 0xA2 && mem[3] == 0xA3);
+
+    // Lost on every attempt: the first go and I2C_ARB_RESTARTS more, then given up on without a STOP of ours
+    g_calls = 0;
+    unsigned long starts = stats->starts, losses = stats->arbLosses, stops = stats->stops;
+    wr[1] = 0xB1;
+    I2CSimLoseArbitrationAfter(1);
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    for (step = 0; step < 1000 && !g_calls; step++)
+    {
+        I2CTask();
+        I2CSimStep();
+        if (stats->arbLosses != losses)
+        {
+            losses = stats->arbLosses;
+            I2CSimLoseArbitrationAfter(1);      // The same again next time
+        }
+    }
+    I2CSimLoseArbitrationAfter(0);
+    CHECK_EQ(g_calls, 1);
+    CHECK_EQ(g_status, I2C_STATUS_ARB_LOST);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_ARB_LOST);
+    CHECK_EQ(stats->starts - starts, 1 + I2C_ARB_RESTARTS);
+    CHECK_EQ(stats->stops, stops);
+    CHECK_EQ(mem[1], 0xA1);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+
+    // Another master on the bus: no START while it is, nor until the bus has read free I2C_BUS_FREE_SAMPLES times
+    starts = stats->starts;
+    I2CSimBusBusyFor(20);
+    id = I2CBufferAddWriteReadInstruction(buf, 0x50, wr, 1, rd, 3);
+    while (!I2CSimReadScl())
+    {
+        I2CTask();
+        CHECK(!(TWCR & (1 << TWSTA)));
+        I2CSimStep();
+    }
+    for (step = 1; step < I2C_BUS_FREE_SAMPLES; step++)
+    {
+        I2CTask();
+        CHECK(!(TWCR & (1 << TWSTA)));
+    }
+    I2CTask();
+    CHECK(TWCR & (1 << TWSTA));
+    CHECK_EQ(stats->starts, starts);            // Asked for, not sent yet
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+    CHECK(rd[0] == 0xA1 && rd[1] == 0xA2 && rd[2] == 0xA3);
+    CHECK_EQ(stats->arbLosses, 1 + 1 + I2C_ARB_RESTARTS);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,91 @@
+/*
+ * test_priority.c
+ *
+ * Priority lanes (I2C_PRIORITY_LEVELS = 3): the next transaction always comes from the most urgent lane with anything
+ * in it, first in first out within a lane, and the instruction already on the bus is never overtaken. Built with lists
+ * and with rings
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static I2CInstruction_ID g_ids[8];
+static char g_order[16];
+static int g_done;
+
+// Records the order instructions finish in, by their index in g_ids
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    int ind;
+
+    (void)status;
+    (void)transferred;
+    for (ind = 0; ind < 8; ind++)
+    {
+        if (g_ids[ind] == id)
+        {
+            g_order[g_done++] = '0' + ind;
+        }
+    }
+}
+
+int main(void)
+{
+    uint8_t mem[8] = {0};
+    uint8_t wr[2] = {0x00, 0x01};
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+
+    // Three low priority instructions, the first of them put on the bus straight away
+    g_ids[0] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    g_ids[1] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    g_ids[2] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CTask();
+    I2CSimStep();
+
+    // Then two in the middle lane and two urgent ones, one of which is taken back out
+    I2CBufferSetPriority(buf, 1);
+    g_ids[3] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    g_ids[4] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CBufferSetPriority(buf, I2C_PRIORITY_HIGHEST);
+    g_ids[5] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    g_ids[6] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    g_ids[7] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    CHECK(I2CBufferRemove(buf, g_ids[6]));
+#ifdef I2C_USE_RING_BUFFER
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 8);  // A removed slot counts until the head reaches it
+#else
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 7);
+#endif
+    CHECK_EQ(I2CBufferGetCurrentInstructionID(buf), g_ids[0]);
+
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(strcmp(g_order, "0573412") == 0);
+
+    // An urgent instruction added between two low priority ones still goes first once the bus is free
+    memset(g_order, 0, sizeof(g_order));
+    g_done = 0;
+    I2CBufferSetPriority(buf, I2C_PRIORITY_LOWEST);
+    g_ids[0] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CBufferSetPriority(buf, I2C_PRIORITY_HIGHEST);
+    g_ids[1] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CBufferSetPriority(buf, I2C_PRIORITY_LOWEST);
+    g_ids[2] = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK(strcmp(g_order, "102") == 0);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
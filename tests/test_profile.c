@@ -0,0 +1,80 @@
+/*
+ * test_profile.c
+ *
+ * Profiler (I2C_PROFILE): after a scripted run the counters add up to exactly what went over the bus, bytes, NACKs and
+ * arbitration losses, and bytesPerSecond follows from the ticks counted
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+int main(void)
+{
+    uint8_t mem[16] = {0};
+    uint8_t wr[3] = {0x02, 0x11, 0x22};
+    uint8_t rd[4];
+    struct I2CProfile prof;
+    int ind;
+
+    I2CSimReset();
+    struct I2CSimDevice * dev = I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CProfileReset();
+
+    // 3 + 3 + 3 written, then 1 + 4 for the write-read
+    for (ind = 0; ind < 3; ind++)
+    {
+        I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 3);
+    }
+    I2CBufferAddWriteReadInstruction(buf, 0x50, wr, 1, rd, 4);
+    I2CSimRunUntilIdle(100000);
+    I2CProfileGetSnapshot(&prof);
+    CHECK_EQ(prof.bytes, 14);
+    CHECK_EQ(prof.nacks, 0);
+    CHECK_EQ(prof.arbLosses, 0);
+    CHECK_EQ(prof.isrCount[START_TRA >> 3], 4);
+    CHECK_EQ(prof.isrCount[REP_START_TRA >> 3], 1);
+    CHECK_EQ(prof.queueHighWater, 4);
+    CHECK_EQ(prof.defaultCases, 0);
+    CHECK_EQ(prof.bytesPerSecond, 0);           // No tick yet
+
+    // An address NACK, a data NACK on the second byte (which still went over the bus) and a lost arbitration
+    I2CBufferAddInstruction(buf, 0x51, I2C_READ, rd, 2);
+    I2CSimRunUntilIdle(100000);
+    dev->nackWriteAt = 1;
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 3);
+    I2CSimRunUntilIdle(100000);
+    dev->nackWriteAt = I2C_SIM_NO_NACK;
+    I2CSimLoseArbitrationAfter(2);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 3);
+    I2CSimRunUntilIdle(100000);
+    I2CProfileGetSnapshot(&prof);
+    CHECK_EQ(prof.bytes, 16);
+    CHECK_EQ(prof.nacks, 2);
+    CHECK_EQ(prof.arbLosses, 1);
+    CHECK_EQ(prof.isrCount[SLA_R_TRA_NACK_REC >> 3], 1);
+    CHECK_EQ(prof.isrCount[DATA_TRA_NACK_REC >> 3], 1);
+
+    // 16 bytes over 8 ticks of 1 ms
+    for (ind = 0; ind < 8; ind++)
+    {
+        I2CTimerTick();
+    }
+    I2CProfileGetSnapshot(&prof);
+    CHECK_EQ(prof.ticks, 8);
+    CHECK_EQ(prof.bytesPerSecond, 16UL * I2C_PROFILE_TICK_HZ / 8);
+
+    I2CProfileReset();
+    I2CProfileGetSnapshot(&prof);
+    CHECK(prof.bytes == 0 && prof.nacks == 0 && prof.ticks == 0 && prof.queueHighWater == 0);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
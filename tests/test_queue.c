@@ -0,0 +1,125 @@
+/*
+ * test_queue.c
+ *
+ * Adds, transfers, results and refusals of a buffer on the simulated bus. Built for the linked list, the ring
+ * (I2C_USE_RING_BUFFER) and the static pool (I2C_USE_STATIC_POOL)
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static int g_calls;
+static uint8_t g_lastStatus;
+static int g_lastTransferred;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    g_calls++;
+    g_lastStatus = status;
+    g_lastTransferred = transferred;
+}
+
+int main(void)
+{
+    uint8_t mem[16];
+    uint8_t ind;
+
+    for (ind = 0; ind < sizeof(mem); ind++)
+    {
+        mem[ind] = 0xA0 + ind;
+    }
+    I2CSimReset();
+    struct I2CSimDevice * dev = I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    CHECK(buf != NULL);
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+
+    // A write, then a write-read of what it wrote
+    uint8_t wr[3] = {2, 0x11, 0x22};
+    uint8_t reg = 2;
+    uint8_t rd[4] = {0};
+    I2CInstruction_ID wrID = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr));
+    I2CInstruction_ID rdID = I2CBufferAddWriteReadInstruction(buf, 0x50, &reg, 1, rd, sizeof(rd));
+    CHECK(wrID != 0 && rdID != 0 && wrID != rdID);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 2);
+    CHECK(I2CBufferContains(buf, wrID));
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(g_calls, 2);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(!I2CBufferContains(buf, wrID));
+    int transferred = -1;
+    CHECK_EQ(I2CBufferGetStatus(buf, wrID, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 3);
+    CHECK_EQ(I2CBufferGetStatus(buf, rdID, &transferred), I2C_STATUS_DONE);
+    CHECK_EQ(transferred, 5);
+    CHECK(rd[0] == 0x11 && rd[1] == 0x22 && rd[2] == 0xA4 && rd[3] == 0xA5);
+    CHECK_EQ(I2CSimGetStats()->starts, 3);     // The write-read's repeated start counts too
+
+    // The payload was copied, so changing it after the add changes nothing
+    uint8_t wr2[2] = {8, 0x33};
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr2, sizeof(wr2));
+    wr2[1] = 0;
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(mem[8], 0x33);
+
+    // Nobody at the address, a busy device, lost arbitration
+    uint8_t in[2];
+    I2CBufferAddInstruction(buf, 0x51, I2C_READ, in, sizeof(in));
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(g_lastStatus, I2C_STATUS_ADDR_NACK);
+    dev->nackAddrCount = 1;
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr));
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(g_lastStatus, I2C_STATUS_ADDR_NACK);
+    I2CSimLoseArbitrationAfter(2);
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr));
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(g_lastStatus, I2C_STATUS_ARB_LOST);
+
+    // A removed instruction never reaches the bus
+    unsigned long written = I2CSimGetStats()->bytesWritten;
+    I2CInstruction_ID keep = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr2, sizeof(wr2));
+    I2CInstruction_ID drop = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr));
+    CHECK(I2CBufferRemove(buf, drop));
+    CHECK(!I2CBufferContains(buf, drop));
+    CHECK(I2CBufferContains(buf, keep));
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(I2CSimGetStats()->bytesWritten - written, sizeof(wr2));
+
+    // Refused for good, whatever the room left
+    CHECK_EQ(I2CBufferAddInstruction(buf, 0x90, I2C_WRITE, wr, sizeof(wr)), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    CHECK_EQ(I2CBufferAddInstruction(buf, 0x50, 9, wr, sizeof(wr)), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    CHECK_EQ(I2CBufferAddWriteReadInstruction(buf, 0x50, &reg, 1, rd, -1), 0);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_INVALID);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+
+    // Refused for want of room until the bus has drained the buffer
+    int added = 0;
+    while (I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr2, sizeof(wr2)) && added < 1000)
+    {
+        added++;
+    }
+    CHECK(added > 0 && added < 1000);
+    CHECK_EQ(I2CBufferGetAddStatus(buf), I2C_STATUS_UNKNOWN);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), added);
+    g_calls = 0;
+    I2CSimRunUntilIdle(1000000);
+    CHECK_EQ(g_calls, added);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr2, sizeof(wr2)) != 0);
+    I2CSimRunUntilIdle(1000);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
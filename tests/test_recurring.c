@@ -0,0 +1,98 @@
+/*
+ * test_recurring.c
+ *
+ * Recurring reads (I2C_MAX_RECURRING): periodic samples, back to back runs that still let the queue through,
+ * stopping, and bad arguments refused without taking a slot. Built for the linked list and the ring
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+// Runs the bus for steps events
+static void runSteps(int steps)
+{
+    while (steps-- > 0)
+    {
+        I2CTask();
+        I2CSimStep();
+    }
+}
+
+int main(void)
+{
+    uint8_t mem[8] = {10, 11, 12, 13, 14, 15, 16, 17};
+    uint8_t reg = 2;
+    uint8_t dest[4];
+    uint8_t out[2] = {0};
+    uint8_t ind;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+
+    // A write-read every 10 ticks
+    int8_t slow = I2CBufferAddRecurring(buf, 0x50, &reg, 1, dest, 2, 10);
+    CHECK(slow >= 0);
+    CHECK_EQ(I2CBufferGetRecurringSample(buf, slow, out), 0);
+    uint8_t wr[2] = {2, 0x99};
+    for (ind = 0; ind < 35; ind++)
+    {
+        if (ind == 5)
+        {
+            CHECK(I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, sizeof(wr)) != 0);
+        }
+        runSteps(40);
+        I2CTimerTick();
+    }
+    uint16_t seq = I2CBufferGetRecurringSample(buf, slow, out);
+    CHECK(seq >= 3 && seq <= 5);
+    CHECK(out[0] == 0x99 && out[1] == 13);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(I2CBufferStopRecurring(buf, slow));
+    I2CSimRunUntilIdle(1000);
+
+    // Two back to back reads (period 0) must not starve the queue
+    uint8_t destA[2], destB[2];
+    int8_t fastA = I2CBufferAddRecurring(buf, 0x50, NULL, 0, destA, 1, 0);
+    int8_t fastB = I2CBufferAddRecurring(buf, 0x50, NULL, 0, destB, 1, 0);
+    CHECK(fastA >= 0 && fastB >= 0 && fastA != fastB);
+    CHECK_EQ(I2CBufferAddRecurring(buf, 0x50, NULL, 0, destA, 1, 0), -1);     // Every slot taken
+    for (ind = 0; ind < 5; ind++)
+    {
+        uint8_t w[2] = {ind, 0x40 + ind};
+        I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, w, sizeof(w));
+    }
+    runSteps(2000);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+    CHECK(mem[0] == 0x40 && mem[4] == 0x44);
+    CHECK(I2CBufferGetRecurringSample(buf, fastA, out) > 0);
+    CHECK(I2CBufferGetRecurringSample(buf, fastB, out) > 0);
+
+    // Stopped: the bus goes quiet and the slots can be used again
+    CHECK(I2CBufferStopRecurring(buf, fastA));
+    CHECK(I2CBufferStopRecurring(buf, fastB));
+    runSteps(200);
+    unsigned long starts = I2CSimGetStats()->starts;
+    for (ind = 0; ind < 100; ind++)
+    {
+        I2CTimerTick();
+        runSteps(1);
+    }
+    CHECK_EQ(I2CSimGetStats()->starts, starts);
+    CHECK_EQ(I2CBufferAddRecurring(buf, 0x50, NULL, 1, destA, 1, 5), -1);       // Bad arguments take no slot
+    CHECK_EQ(I2CBufferAddRecurring(buf, 0x80, NULL, 0, destA, 1, 5), -1);
+    CHECK_EQ(I2CBufferAddRecurring(buf, 0x50, NULL, 0, NULL, 1, 5), -1);
+    CHECK(I2CBufferAddRecurring(buf, 0x50, NULL, 0, destA, 1, 5) >= 0);
+    CHECK(I2CBufferAddRecurring(buf, 0x50, NULL, 0, destB, 1, 5) >= 0);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
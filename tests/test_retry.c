@@ -0,0 +1,145 @@
+/*
+ * test_retry.c
+ *
+ * Retries (I2C_RETRY_BACKOFF): the backoff between attempts in ticks, an instruction that succeeds after a few NACKs,
+ * one that runs out of retries and reports the status of its last attempt, and the lane waiting behind it. Built for
+ * immediate, fixed and exponential backoff
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static int g_calls;
+static uint8_t g_status;
+static int g_transferred;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    g_calls++;
+    g_status = status;
+    g_transferred = transferred;
+}
+
+// Runs for ticks ticks, noting the tick of every address phase (up to 8)
+static int runTicks(int ticks, uint16_t * attempts)
+{
+    const struct I2CSimStats * stats = I2CSimGetStats();
+    unsigned long addrBytes = stats->addrBytes;
+    int count = 0;
+    int tick, step;
+
+    for (tick = 0; tick < ticks; tick++)
+    {
+        for (step = 0; step < 60; step++)
+        {
+            I2CTask();
+            I2CSimStep();
+            if (stats->addrBytes != addrBytes && count < 8)
+            {
+                attempts[count++] = I2CGetTicks();
+            }
+            addrBytes = stats->addrBytes;
+        }
+        I2CTimerTick();
+    }
+    return count;
+}
+
+// The backoff after the failed attempt number attempt (0 for the first failure)
+static uint16_t expectedDelay(int attempt)
+{
+#if I2C_RETRY_BACKOFF == I2C_RETRY_IMMEDIATE
+    (void)attempt;
+    return 0;
+#elif I2C_RETRY_BACKOFF == I2C_RETRY_FIXED
+    (void)attempt;
+    return I2C_RETRY_DELAY_TICKS;
+#else
+    return I2C_RETRY_DELAY_TICKS << attempt;
+#endif
+}
+
+int main(void)
+{
+    uint8_t eeprom[8] = {0}, other[8] = {0};
+    uint8_t wr[2] = {0x01, 0xA1};
+    uint16_t attempts[8];
+    struct I2CRetryStats retryStats;
+    int count, ind;
+
+    I2CSimReset();
+    struct I2CSimDevice * ee = I2CSimAddDevice(0x50, eeprom, sizeof(eeprom));
+    I2CSimAddDevice(0x51, other, sizeof(other));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+
+    // Not retried unless asked for
+    ee->nackAddrCount = 1;
+    I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    runTicks(2, attempts);
+    CHECK_EQ(g_status, I2C_STATUS_ADDR_NACK);
+
+    // Busy for two attempts, through on the third; the write behind it waits its turn
+    I2CBufferSetRetries(buf, 4);
+    ee->nackAddrCount = 2;
+    g_calls = 0;
+    I2CInstruction_ID first = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    uint8_t wr2[2] = {0x02, 0xA2};
+    I2CInstruction_ID second = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr2, 2);
+    count = runTicks(20, attempts);
+    CHECK_EQ(count, 4);
+    for (ind = 1; ind < 3; ind++)
+    {
+        CHECK_EQ((uint16_t)(attempts[ind] - attempts[ind - 1]), expectedDelay(ind - 1));
+    }
+    CHECK_EQ(I2CBufferGetStatus(buf, first, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(I2CBufferGetStatus(buf, second, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(g_calls, 2);                       // Once per instruction, not per attempt
+    CHECK(eeprom[1] == 0xA1 && eeprom[2] == 0xA2);
+    I2CBufferGetRetryStats(buf, &retryStats);
+    CHECK_EQ(retryStats.retries, 2);
+    CHECK_EQ(retryStats.recovered, 1);
+    CHECK_EQ(retryStats.exhausted, 0);
+
+    // Never through: one attempt plus 3 retries, then the address NACK is what is reported
+    I2CBufferSetRetries(buf, 3);
+    ee->nackAddrCount = 100;
+    g_calls = 0;
+    first = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr, 2);
+    count = runTicks(40, attempts);
+    CHECK_EQ(count, 4);
+    for (ind = 1; ind < 4; ind++)
+    {
+        CHECK_EQ((uint16_t)(attempts[ind] - attempts[ind - 1]), expectedDelay(ind - 1));
+    }
+    CHECK_EQ(g_calls, 1);
+    CHECK_EQ(g_status, I2C_STATUS_ADDR_NACK);
+    CHECK_EQ(I2CBufferGetStatus(buf, first, NULL), I2C_STATUS_ADDR_NACK);
+    I2CBufferGetRetryStats(buf, &retryStats);
+    CHECK_EQ(retryStats.retries, 2 + 3);
+    CHECK_EQ(retryStats.exhausted, 1);
+
+    // A data NACK retried to the end reports the data NACK, and how far its last attempt got
+    ee->nackAddrCount = 0;
+    ee->nackWriteAt = 1;
+    g_calls = 0;
+    uint8_t wr3[3] = {0x04, 1, 2};
+    first = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, wr3, 3);
+    runTicks(40, attempts);
+    CHECK_EQ(g_calls, 1);
+    CHECK_EQ(g_status, I2C_STATUS_DATA_NACK);
+    CHECK_EQ(g_transferred, 2);
+    CHECK_EQ(I2CSimGetStats()->dataNacks, 4);
+    ee->nackWriteAt = I2C_SIM_NO_NACK;
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
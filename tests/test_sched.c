@@ -0,0 +1,103 @@
+/*
+ * test_sched.c
+ *
+ * Several registered buffers: the order their transactions go out in under I2C_SCHED_POLICY, and removing a buffer.
+ * Built once for each policy
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+static char g_order[32];
+static int g_done;
+
+// One callback per buffer, each recording its buffer's letter
+static void onCompleteA(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)status;
+    (void)transferred;
+    g_order[g_done++] = 'A';
+}
+
+static void onCompleteB(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)status;
+    (void)transferred;
+    g_order[g_done++] = 'B';
+}
+
+static void onCompleteC(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    (void)status;
+    (void)transferred;
+    g_order[g_done++] = 'C';
+}
+
+int main(void)
+{
+    uint8_t mem[8] = {0};
+    uint8_t wr[2] = {0x00, 0x01};
+    I2CBuffer_pT bufs[3];
+    int ind;
+
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    for (ind = 0; ind < 3; ind++)
+    {
+        bufs[ind] = I2CBufferNew();
+    }
+    I2CBufferSetCompletionCallback(bufs[0], onCompleteA);
+    I2CBufferSetCompletionCallback(bufs[1], onCompleteB);
+    I2CBufferSetCompletionCallback(bufs[2], onCompleteC);
+    I2CSetCurBuf(bufs[0]);
+    CHECK(I2CAddBuffer(bufs[1], 2));
+    CHECK(I2CAddBuffer(bufs[2], 1));
+
+    // A and C get three instructions each, B four
+    for (ind = 0; ind < 4; ind++)
+    {
+        if (ind < 3)
+        {
+            I2CBufferAddInstruction(bufs[0], 0x50, I2C_WRITE, wr, 2);
+            I2CBufferAddInstruction(bufs[2], 0x50, I2C_WRITE, wr, 2);
+        }
+        I2CBufferAddInstruction(bufs[1], 0x50, I2C_WRITE, wr, 2);
+    }
+    I2CSimRunUntilIdle(100000);
+#if I2C_SCHED_POLICY == I2C_SCHED_ROUND_ROBIN
+    CHECK(strcmp(g_order, "BCABCABCAB") == 0);  // One each in turn, carrying on from the last buffer served
+#elif I2C_SCHED_POLICY == I2C_SCHED_WEIGHTED
+    CHECK(strcmp(g_order, "BBCABBCACA") == 0);  // B's weight is 2
+#else
+    CHECK(strcmp(g_order, "AAABBBBCCC") == 0);  // Registration order
+#endif
+
+    // A removed buffer is skipped, its instructions left where they are
+    memset(g_order, 0, sizeof(g_order));
+    g_done = 0;
+    CHECK(I2CRemoveBuffer(bufs[1]));
+    CHECK(!I2CRemoveBuffer(bufs[1]));
+    I2CBufferAddInstruction(bufs[1], 0x50, I2C_WRITE, wr, 2);
+    I2CBufferAddInstruction(bufs[2], 0x50, I2C_WRITE, wr, 2);
+    I2CBufferAddInstruction(bufs[0], 0x50, I2C_WRITE, wr, 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(strlen(g_order), 2);
+    CHECK(strchr(g_order, 'B') == NULL);
+    CHECK_EQ(I2CBufferGetCurrentSize(bufs[1]), 1);
+
+    for (ind = 0; ind < 3; ind++)
+    {
+        I2CBufferFree(bufs[ind]);
+    }
+    return CHECK_RESULT();
+}
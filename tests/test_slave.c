@@ -0,0 +1,177 @@
+/*
+ * test_slave.c
+ *
+ * Slave mode (I2C_SLAVE), driven by another master played by the simulator: register map writes and reads with the
+ * pointer moving on, NACKs past the writable registers, 0xFF past the end of the map, mailbox overflow, general calls,
+ * a master instruction that loses arbitration to a master addressing us, and bus errors (and, with the watchdog, a
+ * master that leaves us without a STOP). Built plain and with I2C_TIMEOUT_TICKS
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "I2CSlave.h"
+#include "check.h"
+
+// The slave transactions reported to the callback
+static uint8_t g_events[8];
+static uint8_t g_lengths[8];
+static uint8_t g_data[8][8];
+static int g_count;
+
+static void onSlave(uint8_t event, uint8_t * data, uint8_t length)
+{
+    if (g_count < 8)
+    {
+        g_events[g_count] = event;
+        g_lengths[g_count] = length;
+        memcpy(g_data[g_count], data, length > 8 ? 8 : length);
+    }
+    g_count++;
+}
+
+int main(void)
+{
+    uint8_t regs[6] = {10, 11, 12, 13, 14, 15};
+    uint8_t rx[3] = {0};
+    const uint8_t tx[2] = {0x5A, 0xA5};
+    uint8_t out[8];
+
+    I2CSimReset();
+    uint8_t mem[8] = {0};
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CSlaveInitRegisters(0x30, regs, sizeof(regs), 3);
+    I2CSlaveSetCallback(onSlave);
+
+    // Pointer 1, then registers 1 and 2; register 3 is read only, so the third data byte is NACKed
+    const uint8_t write[4] = {0x01, 0xAA, 0xBB, 0xCC};
+    CHECK_EQ(I2CSimMasterWrite(0x30, write, 4), 3);
+    CHECK(regs[0] == 10 && regs[1] == 0xAA && regs[2] == 0xBB && regs[3] == 13);
+    CHECK_EQ(g_count, 1);
+    CHECK_EQ(g_events[0], I2C_SLAVE_EVENT_WRITE);
+    CHECK_EQ(g_lengths[0], 2);
+    CHECK(g_data[0][0] == 0xAA && g_data[0][1] == 0xBB);
+
+    // A pointer on its own is not reported; the read goes on from it, and the next read from where that one stopped
+    CHECK_EQ(I2CSimMasterWrite(0x30, write, 1), 1);
+    CHECK_EQ(g_count, 1);
+    CHECK_EQ(I2CSimMasterRead(0x30, out, 3), 3);
+    CHECK(out[0] == 0xAA && out[1] == 0xBB && out[2] == 13);
+    CHECK_EQ(g_count, 2);
+    CHECK_EQ(g_events[1], I2C_SLAVE_EVENT_READ);
+    CHECK_EQ(g_lengths[1], 3);
+    CHECK_EQ(g_data[1][0], 0xAA);
+    CHECK_EQ(I2CSimMasterRead(0x30, out, 4), 4);
+    CHECK(out[0] == 14 && out[1] == 15 && out[2] == 0xFF && out[3] == 0xFF);
+    CHECK_EQ(g_lengths[2], 2);                  // Only the bytes that came from the map
+
+    // A read that starts past the end gets nothing but 0xFF and is not reported
+    const uint8_t pastEnd = 6;
+    I2CSimMasterWrite(0x30, &pastEnd, 1);
+    CHECK_EQ(I2CSimMasterRead(0x30, out, 2), 2);
+    CHECK(out[0] == 0xFF && out[1] == 0xFF);
+    CHECK_EQ(g_count, 3);
+
+    // Not our address
+    CHECK_EQ(I2CSimMasterWrite(0x31, write, 2), -1);
+
+    // Mailbox: everything past rx is NACKed, reads come from tx then 0xFF
+    g_count = 0;
+    I2CSlaveInitMailbox(0x31, rx, sizeof(rx));
+    I2CSlaveSetTx(tx, sizeof(tx));
+    CHECK_EQ(I2CSimMasterWrite(0x31, write, 4), 3);
+    CHECK(rx[0] == 0x01 && rx[1] == 0xAA && rx[2] == 0xBB);
+    CHECK_EQ(g_events[0], I2C_SLAVE_EVENT_WRITE);
+    CHECK_EQ(g_lengths[0], 3);
+    CHECK_EQ(I2CSimMasterRead(0x31, out, 3), 3);
+    CHECK(out[0] == 0x5A && out[1] == 0xA5 && out[2] == 0xFF);
+    CHECK_EQ(g_events[1], I2C_SLAVE_EVENT_READ);
+    CHECK_EQ(g_lengths[1], 2);
+    CHECK_EQ(I2CSimMasterWrite(0x30, write, 2), -1);   // The register map is gone
+
+    // General calls only once asked for, and reported as such
+    CHECK_EQ(I2CSimMasterWrite(0x00, write, 2), -1);
+    I2CSlaveSetGeneralCall(1);
+    g_count = 0;
+    CHECK_EQ(I2CSimMasterWrite(0x00, write, 2), 2);
+    CHECK_EQ(g_count, 1);
+    CHECK_EQ(g_events[0], I2C_SLAVE_EVENT_GENERAL_CALL);
+    CHECK(g_data[0][0] == 0x01 && g_data[0][1] == 0xAA);
+
+    // Addressed while our own write is on the bus: the write loses arbitration, the slave transaction goes ahead
+    uint8_t big[6] = {0, 1, 2, 3, 4, 5};
+    I2CInstruction_ID id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    int step;
+    for (step = 0; step < 4; step++)
+    {
+        I2CTask();
+        I2CSimStep();
+    }
+    g_count = 0;
+    CHECK_EQ(I2CSimMasterWrite(0x31, write, 2), 2);
+    CHECK_EQ(g_count, 1);
+    CHECK(!I2CSlaveBusy());
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_ARB_LOST);
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(mem[4], 5);
+
+    // A master that leaves a write to us without a STOP holds our queue off, until a bus error ends its transaction
+    // (unreported). With no transaction of ours on the bus, the error fails none of our instructions
+    g_count = 0;
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    CHECK_EQ(I2CSimMasterWriteNoStop(0x31, write, 2), 2);
+    CHECK(I2CSlaveBusy());
+    I2CSimRunUntilIdle(1000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_PENDING);
+    I2CSimBusError();
+    CHECK(!I2CSlaveBusy());
+    CHECK_EQ(g_count, 0);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_PENDING);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+
+    // A bus error in the middle of our own write ends it, and the next one goes ahead
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    for (step = 0; step < 4; step++)
+    {
+        I2CTask();
+        I2CSimStep();
+    }
+    I2CSimBusError();
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_BUS_ERROR);
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+
+#if I2C_TIMEOUT_TICKS > 0
+    // Without a bus error, the watchdog ends the abandoned transaction once it has been quiet for I2C_TIMEOUT_TICKS
+    id = I2CBufferAddInstruction(buf, 0x50, I2C_WRITE, big, 6);
+    CHECK_EQ(I2CSimMasterWriteNoStop(0x31, write, 2), 2);
+    for (step = 0; step < I2C_TIMEOUT_TICKS - 1; step++)
+    {
+        I2CTimerTick();
+        I2CSimRunUntilIdle(1000);
+    }
+    CHECK(I2CSlaveBusy());
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_PENDING);
+    I2CTimerTick();
+    I2CSimRunUntilIdle(100000);
+    CHECK(!I2CSlaveBusy());
+    CHECK_EQ(I2CBufferGetStatus(buf, id, NULL), I2C_STATUS_DONE);
+#endif
+
+    I2CSlaveDisable();
+    CHECK_EQ(I2CSimMasterWrite(0x31, write, 2), -1);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
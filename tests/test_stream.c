@@ -0,0 +1,152 @@
+/*
+ * test_stream.c
+ *
+ * Streaming instructions (I2C_USE_STREAMS): writes and reads several windows long, window boundaries falling on odd
+ * lengths (the last read byte still NACKed, nothing read past the end), and a producer that runs dry part way
+ */
+
+// Other includes
+#include <stdint.h>
+#include <string.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+// What a callback saw: the window sizes it was called with, and the bytes produced or consumed so far
+struct Trace
+{
+    uint16_t counts[16];
+    int calls;
+    uint32_t bytes;
+    uint32_t available;         // Bytes a producer has in all (it runs dry after them)
+    uint8_t first;              // First byte a producer sends (the register pointer)
+    uint8_t data[64];           // What a consumer received
+};
+
+static uint8_t g_status;
+static int g_transferred;
+
+static void onComplete(I2CInstruction_ID id, uint8_t status, int transferred)
+{
+    (void)id;
+    g_status = status;
+    g_transferred = transferred;
+}
+
+// Sends first, then 0x80, 0x81, ... until it runs out
+static uint16_t produce(void * context, uint8_t * window, uint16_t count)
+{
+    struct Trace * trace = context;
+    uint16_t ind;
+
+    trace->counts[trace->calls++] = count;
+    for (ind = 0; ind < count && trace->bytes < trace->available; ind++)
+    {
+        window[ind] = trace->bytes ? (uint8_t)(0x7F + trace->bytes) : trace->first;
+        trace->bytes++;
+    }
+    return ind;
+}
+
+static uint16_t consume(void * context, uint8_t * window, uint16_t count)
+{
+    struct Trace * trace = context;
+
+    trace->counts[trace->calls++] = count;
+    memcpy(trace->data + trace->bytes, window, count);
+    trace->bytes += count;
+    return count;
+}
+
+int main(void)
+{
+    uint8_t mem[64];
+    uint8_t window[8];
+    struct Trace trace;
+    uint8_t ind;
+
+    for (ind = 0; ind < sizeof(mem); ind++)
+    {
+        mem[ind] = ind;
+    }
+    I2CSimReset();
+    I2CSimAddDevice(0x50, mem, sizeof(mem));
+    I2CInit(400000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    I2CBufferSetCompletionCallback(buf, onComplete);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+
+    // A write four windows long: the pointer (0x10) then 19 bytes
+    memset(&trace, 0, sizeof(trace));
+    trace.available = 20;
+    trace.first = 0x10;
+    struct I2CStream write = {produce, &trace, window, 6, 20, 0};
+    CHECK(I2CBufferAddStream(buf, 0x50, I2C_WRITE, NULL, 0, &write) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(g_status, I2C_STATUS_DONE);
+    CHECK_EQ(g_transferred, 20);
+    CHECK_EQ(write.transferred, 20);
+    CHECK_EQ(trace.calls, 4);
+    CHECK(trace.counts[0] == 6 && trace.counts[1] == 6 && trace.counts[2] == 6 && trace.counts[3] == 2);
+    CHECK(mem[0x10] == 0x80 && mem[0x22] == 0x92 && mem[0x23] == 0x23);
+    CHECK_EQ(stats->bytesWritten, 20);
+
+    // A read of 11 bytes through a window of 5 after a repeated start: windows of 5, 5 and 1
+    memset(&trace, 0, sizeof(trace));
+    uint8_t reg = 0x20;
+    struct I2CStream read = {consume, &trace, window, 5, 11, 0};
+    unsigned long bytesRead = stats->bytesRead;
+    CHECK(I2CBufferAddStream(buf, 0x50, I2C_WRITE_READ, &reg, 1, &read) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(g_status, I2C_STATUS_DONE);
+    CHECK_EQ(read.transferred, 11);
+    CHECK_EQ(trace.calls, 3);
+    CHECK(trace.counts[0] == 5 && trace.counts[1] == 5 && trace.counts[2] == 1);
+    CHECK(trace.data[0] == 0x90 && trace.data[2] == 0x92 && trace.data[3] == 0x23 && trace.data[10] == 0x2A);
+    CHECK_EQ(stats->bytesRead - bytesRead, 11);  // The 11th byte was NACKed, none read past it
+
+    // A plain read of 7 bytes through a window of 2, the last window a single byte
+    memset(&trace, 0, sizeof(trace));
+    read.windowSize = 2;
+    read.length = 7;
+    bytesRead = stats->bytesRead;
+    CHECK(I2CBufferAddStream(buf, 0x50, I2C_READ, NULL, 0, &read) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(read.transferred, 7);
+    CHECK_EQ(trace.calls, 4);
+    CHECK_EQ(trace.counts[3], 1);
+    CHECK(trace.data[0] == 0x2B && trace.data[6] == 0x31);
+    CHECK_EQ(stats->bytesRead - bytesRead, 7);
+
+    // A producer with 13 of the 40 bytes asked for: the write ends after them and comes up short
+    memset(&trace, 0, sizeof(trace));
+    trace.available = 13;
+    trace.first = 0x30;
+    struct I2CStream underrun = {produce, &trace, window, 8, 40, 0};
+    unsigned long written = stats->bytesWritten, stops = stats->stops;
+    CHECK(I2CBufferAddStream(buf, 0x50, I2C_WRITE, NULL, 0, &underrun) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(g_status, I2C_STATUS_DONE);
+    CHECK_EQ(g_transferred, 13);
+    CHECK_EQ(underrun.transferred, 13);
+    CHECK_EQ(trace.calls, 2);
+    CHECK_EQ(stats->bytesWritten - written, 13);
+    CHECK_EQ(stats->stops - stops, 1);
+    CHECK(mem[0x30] == 0x80 && mem[0x3B] == 0x8B && mem[0x3C] == 0x3C);
+
+    // One that runs dry right on a window boundary
+    memset(&trace, 0, sizeof(trace));
+    trace.available = 16;
+    underrun.transferred = 0;
+    CHECK(I2CBufferAddStream(buf, 0x50, I2C_WRITE, NULL, 0, &underrun) != 0);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(underrun.transferred, 16);
+    CHECK_EQ(trace.calls, 3);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 0);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}
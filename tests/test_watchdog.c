@@ -0,0 +1,101 @@
+/*
+ * test_watchdog.c
+ *
+ * Stalled-transaction watchdog (I2C_TIMEOUT_TICKS = 5): a slave stretching SCL forever is given up on after exactly
+ * I2C_TIMEOUT_TICKS ticks, a slave holding SDA low is let go by the 9 clock pulses of the bus clear, and either way the
+ * stalled instruction ends with I2C_STATUS_TIMEOUT while the rest of the queue carries on
+ */
+
+// Other includes
+#include <stdint.h>
+
+// Custom includes
+#include "I2CPort.h"
+#include "I2CDriver.h"
+#include "check.h"
+
+// Gives the driver and the bus plenty of time within one tick
+static void runTick(void)
+{
+    int step;
+
+    for (step = 0; step < 50; step++)
+    {
+        I2CTask();
+        I2CSimStep();
+    }
+    I2CTimerTick();
+}
+
+int main(void)
+{
+    uint8_t hung[8] = {0}, good[8] = {0};
+    uint8_t wr[2] = {0x01, 0x55};
+    uint8_t rd;
+    int tick;
+
+    I2CSimReset();
+    struct I2CSimDevice * bad = I2CSimAddDevice(0x20, hung, sizeof(hung));
+    I2CSimAddDevice(0x21, good, sizeof(good));
+    I2CInit(100000);
+    I2CBuffer_pT buf = I2CBufferNew();
+    I2CSetCurBuf(buf);
+    const struct I2CSimStats * stats = I2CSimGetStats();
+
+    // Clock stretched for good: still waiting one tick short of the timeout, given up on at it
+    bad->stretchBits = I2C_SIM_STRETCH_FOREVER;
+    I2CInstruction_ID stalled = I2CBufferAddInstruction(buf, 0x20, I2C_WRITE, wr, 2);
+    I2CInstruction_ID next = I2CBufferAddInstruction(buf, 0x21, I2C_WRITE, wr, 2);
+    for (tick = 0; tick < I2C_TIMEOUT_TICKS; tick++)
+    {
+        runTick();
+    }
+    CHECK_EQ(I2CBufferGetStatus(buf, stalled, NULL), I2C_STATUS_PENDING);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 2);
+    I2CTask();
+    CHECK_EQ(I2CBufferGetStatus(buf, stalled, NULL), I2C_STATUS_TIMEOUT);
+    CHECK_EQ(I2CBufferGetCurrentSize(buf), 1);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, next, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(good[1], 0x55);
+
+    // SDA held low, so not even the START gets out: the bus clear clocks it free, then the queue carries on
+    bad->stretchBits = 0;
+    bad->sdaStuckClocks = 9;
+    wr[1] = 0x66;
+    unsigned long pulses = stats->sclPulses;
+    stalled = I2CBufferAddInstruction(buf, 0x21, I2C_WRITE, wr, 2);
+    next = I2CBufferAddWriteReadInstruction(buf, 0x21, wr, 1, &rd, 1);
+    for (tick = 0; tick <= I2C_TIMEOUT_TICKS; tick++)
+    {
+        runTick();
+    }
+    CHECK_EQ(I2CBufferGetStatus(buf, stalled, NULL), I2C_STATUS_TIMEOUT);
+    CHECK_EQ(bad->sdaStuckClocks, 0);
+    CHECK(I2CSimReadSda());
+    CHECK_EQ(stats->sclPulses - pulses, 9 + 1);     // The 9 pulses, then the one of the STOP
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(I2CBufferGetStatus(buf, next, NULL), I2C_STATUS_DONE);
+    CHECK_EQ(rd, 0x55);                             // The stalled write never happened
+    CHECK_EQ(stats->maskedCycles, 0);               // The clocking ran with interrupts on
+
+    // No more than 9 pulses at a time: a slave that needs more is let go on the next timeout
+    bad->sdaStuckClocks = 12;
+    pulses = stats->sclPulses;
+    stalled = I2CBufferAddInstruction(buf, 0x21, I2C_WRITE, wr, 2);
+    next = I2CBufferAddInstruction(buf, 0x21, I2C_WRITE, wr, 2);
+    for (tick = 0; tick <= 2 * I2C_TIMEOUT_TICKS; tick++)
+    {
+        runTick();
+    }
+    CHECK_EQ(I2CBufferGetStatus(buf, stalled, NULL), I2C_STATUS_TIMEOUT);
+    CHECK_EQ(I2CBufferGetStatus(buf, next, NULL), I2C_STATUS_TIMEOUT);
+    CHECK_EQ(stats->sclPulses - pulses, 9 + 1 + 2 + 1);  // The first STOP's clock counts for the slave too
+    CHECK(I2CSimReadSda());
+    I2CBufferAddInstruction(buf, 0x21, I2C_WRITE, wr, 2);
+    I2CSimRunUntilIdle(100000);
+    CHECK_EQ(good[1], 0x66);
+
+    I2CBufferFree(buf);
+    return CHECK_RESULT();
+}